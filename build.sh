@@ -11,3 +11,4 @@ export DEBUG="yes"
 
 server/build.sh || exit $?
 client/build.sh || exit $?
+tests/build.sh || exit $?
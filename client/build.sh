@@ -25,6 +25,23 @@ elif [ -d "${DIR}/libssh/prefix/lib64" ]; then
     LIBSSH_LIB="${DIR}/libssh/prefix/lib64/libssh.a"
 fi
 
+cd ${DIR}
+
+if ! [ -d lz4 ]; then
+    git clone https://github.com/lz4/lz4 || exit $?
+    make -C lz4/lib -j$(nproc) liblz4.a || exit $?
+fi
+
+if ! [ -d zstd ]; then
+    git clone https://github.com/facebook/zstd || exit $?
+    make -C zstd/lib -j$(nproc) libzstd.a || exit $?
+fi
+
+LZ4_INCLUDE="${DIR}/lz4/lib"
+LZ4_LIB="${DIR}/lz4/lib/liblz4.a"
+ZSTD_INCLUDE="${DIR}/zstd/lib"
+ZSTD_LIB="${DIR}/zstd/lib/libzstd.a"
+
 cd ${DIR}/..
 
 SRC=""
@@ -48,13 +65,13 @@ else
     fi
 fi
 
-CPP_FLAGS="--std=c++20 -Wall -Werror ${OPT} -fno-omit-frame-pointer -mno-omit-leaf-frame-pointer -Ishared -Iclient -Iclient/imgui -Iclient/imgui/backends -Iclient/imgui/misc/cpp -I${LIBSSH_INCLUDE}"
+CPP_FLAGS="--std=c++20 -Wall -Werror ${OPT} -fno-omit-frame-pointer -mno-omit-leaf-frame-pointer -Ishared -Iclient -Iclient/imgui -Iclient/imgui/backends -Iclient/imgui/misc/cpp -I${LIBSSH_INCLUDE} -I${LZ4_INCLUDE} -I${ZSTD_INCLUDE}"
 
 if [ $(uname) = "Darwin" ]; then
     CPP_FLAGS+=" -I/opt/homebrew/include"
 fi
 
-LD_FLAGS=" ${LIBSSH_LIB} -lssl -lcrypto -lz"
+LD_FLAGS=" ${LIBSSH_LIB} ${LZ4_LIB} ${ZSTD_LIB} -lssl -lcrypto -lz"
 if [ $(uname) = "Darwin" ]; then
     LD_FLAGS+=" -L/opt/homebrew/lib -framework OpenGL"
 else
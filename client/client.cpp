@@ -1,11 +1,11 @@
 #include <vector>
 #include <string>
-#include <sstream>
 #include <cstdio>
 #include <unistd.h>
 
 #include "common.hpp"
 #include "ssh_link.hpp"
+#include "link_message.hpp"
 #include "ui.hpp"
 #include "profile.hpp"
 #include "topo.hpp"
@@ -23,7 +23,12 @@ int main() {
 
     ui.set_window(window);
 
+    /* Wakes the UI out of glfwWaitEventsTimeout() as soon as the server sends something. */
+    ssh_link.on_receive = [] { glfwPostEmptyEvent(); };
+
     while (!ui.window_should_close()) {
+        ui.wait_for_events();
+
         while (auto m = ssh_link.try_pull()) {
             handle_message(ui, std::move(*m));
         }
@@ -35,41 +40,110 @@ int main() {
     return 0;
 }
 
+static void handle_server_connect(UI &ui, const Link_Message &msg) {
+    ui.set_connected(true);
+    ui.log("The server has been connected.");
+
+    u32 caps = 0;
+    if (link_read_u32(msg.payload, caps)) {
+        caps &= ssh_link.supported_capabilities();
+    }
+    if (caps) {
+        ssh_link.request(Link_Op::LINK_CAPS_REQUEST, link_u32_payload(caps));
+    }
+
+    ssh_link.request(Link_Op::TOPOLOGY_REQUEST);
+    ssh_link.request(Link_Op::CONFIG_REQUEST);
+}
+
+static void handle_link_caps(UI &ui, const Link_Message &msg) {
+    u32 caps;
+    if (link_read_u32(msg.payload, caps)) {
+        ssh_link.set_capabilities(caps);
+    }
+}
+
+static void handle_server_warning(UI &ui, const Link_Message &msg) {
+    ui.log(Log_Severity::WARNING, "SERVER WARNING: " + std::string(msg.payload), true);
+}
+
+static void handle_config(UI &ui, const Link_Message &msg) {
+    config = Profile_Config::from_serialized(msg.payload);
+    ui.config_changed();
+}
+
+static void handle_topology(UI &ui, const Link_Message &msg) {
+    topo = Topology::from_serialized(msg.payload);
+    ui.topology_changed();
+    ui.focus_tab("Dashboard");
+}
+
+static void handle_heatmap_data(UI &ui, const Link_Message &msg) {
+    Monitor_Data monitor = Monitor_Data::from_serialized(msg.payload);
+
+    /* The server has only just started counting these events. */
+    if (monitor.interval_ns == 0) {
+        ui.log("Counting has started; request profile data again to see the counts.");
+    }
+
+    ui.set_heatmap(std::move(monitor));
+    ui.focus_tab("Profile");
+}
+
+static void handle_monitor_started(UI &ui, const Link_Message &msg) {
+    ui.start_live_monitor(Monitor_Stream_Header::from_serialized(msg.payload));
+    ui.focus_tab("Live");
+}
+
+static void handle_monitor_batch(UI &ui, const Link_Message &msg) {
+    ui.add_live_monitor_batch(Monitor_Stream_Batch::from_serialized(msg.payload));
+}
+
+static void handle_monitor_aggregate(UI &ui, const Link_Message &msg) {
+    ui.add_live_monitor_aggregate(Monitor_Aggregate_Batch::from_serialized(msg.payload));
+}
+
+static void handle_stack_delta(UI &ui, const Link_Message &msg) {
+    ui.add_stack_delta(Stack_Trie_Delta::from_serialized(msg.payload));
+}
+
+static const Link_Dispatcher<UI> dispatcher = {
+    { Link_Op::SERVER_CONNECT,    handle_server_connect    },
+    { Link_Op::LINK_CAPS,         handle_link_caps         },
+    { Link_Op::SERVER_WARNING,    handle_server_warning    },
+    { Link_Op::CONFIG,            handle_config            },
+    { Link_Op::TOPOLOGY,          handle_topology          },
+    { Link_Op::HEATMAP_DATA,      handle_heatmap_data      },
+    { Link_Op::MONITOR_STARTED,   handle_monitor_started   },
+    { Link_Op::MONITOR_BATCH,     handle_monitor_batch     },
+    { Link_Op::MONITOR_AGGREGATE, handle_monitor_aggregate },
+    { Link_Op::STACK_DELTA,       handle_stack_delta       },
+};
+
 void handle_message(UI &ui, std::string &&message) {
-    std::stringstream ss(message);
-    std::string       s;
-
-    if (!std::getline(ss, s, ';')) { return; }
-
-    ui.log("server sends: " + s);
-
-    if (s == "SERVER-CONNECT") {
-        ui.set_connected(true);
-        ui.log("The server has been connected.");
-        ssh_link.send("REQUEST/TOPOLOGY");
-        ssh_link.send("REQUEST/CONFIG");
-    } else if (s == "SERVER-WARNING") {
-        if (std::getline(ss, s, ';')) {
-            s = "SERVER WARNING: " + s;
-            ui.log(std::move(s), true);
-        }
-    } else if (s == "CONFIG") {
-        if (std::getline(ss, s, ';')) {
-            config = Profile_Config::from_serialized(s);
-        }
-    } else if (s == "TOPOLOGY") {
-        if (std::getline(ss, s, ';')) {
-            topo = Topology::from_serialized(s);
-            ui.focus_tab("Dashboard");
-        }
-    } else if (s == "HEATMAP-DATA") {
-        std::vector<float> data;
-        while (std::getline(ss, s, ';')) {
-            data.push_back(std::stof(s));
-        }
-        ui.set_heatmap(std::move(data));
-        ui.focus_tab("Profile");
-    } else {
-        ui.log("bad server response: " + s, true);
+    Link_Message msg;
+
+    Link_Dispatcher<UI>::Result result;
+
+    try {
+        result = dispatcher.dispatch(ui, message, msg);
+    } catch (...) {
+        /* A payload that doesn't deserialize. */
+        result = Link_Dispatcher<UI>::Result::MALFORMED;
+    }
+
+    switch (result) {
+        case Link_Dispatcher<UI>::Result::OK:
+            /* Live monitor batches arrive many times a second and would push everything else out of the log. */
+            if (msg.op != Link_Op::MONITOR_BATCH && msg.op != Link_Op::MONITOR_AGGREGATE && msg.op != Link_Op::STACK_DELTA) {
+                ui.log(Log_Severity::DEBUG, std::string("server sends: ") + link_op_name(msg.op));
+            }
+            break;
+        case Link_Dispatcher<UI>::Result::MALFORMED:
+            ui.log(Log_Severity::ERROR, "bad server response (" + std::to_string(message.size()) + " bytes)", true);
+            break;
+        case Link_Dispatcher<UI>::Result::UNHANDLED:
+            ui.log(Log_Severity::ERROR, std::string("unexpected server message: ") + link_op_name(msg.op), true);
+            break;
     }
 }
@@ -1,3 +1,155 @@
 #pragma once
 
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <cctype>
+
+#include "common.hpp"
+
 extern void log_message(std::string &&message, bool pop_up = false);
+
+namespace {
+
+enum class Log_Severity : u8 {
+    DEBUG,
+    INFO,
+    WARNING,
+    ERROR,
+
+    COUNT,
+};
+
+static constexpr const char *log_severity_names[] = {
+    "debug",
+    "info",
+    "warning",
+    "error",
+};
+
+static_assert(std::size(log_severity_names) == (size_t)Log_Severity::COUNT, "every severity needs a name");
+
+/*
+ * The most recent lines of the log, in one fixed-size byte arena. Every line
+ * gets a sequence number; once the arena or the line table is full, the oldest
+ * lines are dropped to make room, so a session that runs for days costs the
+ * same memory as one that runs for a minute.
+ *
+ * A line's text is never split across the end of the arena: if it doesn't fit
+ * in what's left there, the writer skips to the start.
+ */
+struct Log_Ring {
+    static constexpr size_t ARENA_SIZE = 1 << 20;
+    static constexpr size_t MAX_LINES  = 1 << 14;
+    static constexpr size_t MAX_LINE   = 4096;
+
+    struct Line {
+        u64          start;     /* Arena position, before the modulo. */
+        u32          length;
+        Log_Severity severity;
+    };
+
+private:
+    std::vector<char> arena;
+    std::vector<Line> lines;        /* Indexed by sequence % MAX_LINES. */
+    u64               first = 0;    /* Oldest sequence still held. */
+    u64               next  = 0;
+    u64               head  = 0;    /* Where the next line's text goes, before the modulo. */
+
+public:
+    Log_Ring() : arena(ARENA_SIZE), lines(MAX_LINES) {}
+
+    u64 begin() const { return this->first; }
+    u64 end()   const { return this->next; }
+
+    const Line &line(u64 seq) const { return this->lines[seq % MAX_LINES]; }
+
+    std::string_view text(u64 seq) const {
+        const Line &l = this->line(seq);
+        return std::string_view(this->arena.data() + l.start % ARENA_SIZE, l.length);
+    }
+
+    u64 add(Log_Severity severity, std::string_view message) {
+        message = message.substr(0, MAX_LINE);
+
+        u64 start = this->head;
+
+        if (start % ARENA_SIZE + message.size() > ARENA_SIZE) {
+            start += ARENA_SIZE - start % ARENA_SIZE;
+        }
+
+        u64 end = start + message.size();
+
+        while (this->first < this->next
+        &&     (this->next - this->first >= MAX_LINES || this->line(this->first).start + ARENA_SIZE < end)) {
+            this->first += 1;
+        }
+
+        std::copy(message.begin(), message.end(), this->arena.begin() + start % ARENA_SIZE);
+
+        this->lines[this->next % MAX_LINES] = { start, (u32)message.size(), severity };
+        this->head                          = end;
+
+        return this->next++;
+    }
+
+    void clear() {
+        this->first = this->next;
+    }
+};
+
+/*
+ * The sequence numbers of the lines that pass a severity threshold and contain
+ * a string (ignoring case). Lines added since the last update() are the only
+ * ones looked at, and a query that narrows the previous one (it contains it)
+ * only re-checks the current matches.
+ */
+struct Log_Filter {
+    std::vector<u64> matches;
+
+private:
+    Log_Severity min_severity = Log_Severity::DEBUG;
+    std::string  query;
+    u64          scanned      = 0;
+
+    static bool contains(std::string_view text, std::string_view query) {
+        auto it = std::search(text.begin(), text.end(), query.begin(), query.end(),
+                              [](char a, char b) { return std::tolower((unsigned char)a) == std::tolower((unsigned char)b); });
+        return it != text.end() || query.empty();
+    }
+
+    bool accepts(const Log_Ring &ring, u64 seq) const {
+        return ring.line(seq).severity >= this->min_severity && contains(ring.text(seq), this->query);
+    }
+
+public:
+    void update(const Log_Ring &ring, Log_Severity min_severity, std::string_view query) {
+        bool narrower = min_severity >= this->min_severity && contains(query, this->query);
+
+        if (min_severity != this->min_severity || query != this->query) {
+            if (!narrower) {
+                this->matches.clear();
+                this->scanned = ring.begin();
+            }
+
+            this->min_severity = min_severity;
+            this->query        = query;
+
+            std::erase_if(this->matches, [&](u64 seq) { return seq < ring.begin() || !this->accepts(ring, seq); });
+        }
+
+        auto gone = std::lower_bound(this->matches.begin(), this->matches.end(), ring.begin());
+        this->matches.erase(this->matches.begin(), gone);
+
+        for (u64 seq = std::max(this->scanned, ring.begin()); seq < ring.end(); seq += 1) {
+            if (this->accepts(ring, seq)) {
+                this->matches.push_back(seq);
+            }
+        }
+
+        this->scanned = ring.end();
+    }
+};
+
+}
@@ -4,12 +4,16 @@
 #include <optional>
 #include <memory>
 #include <thread>
+#include <chrono>
 #include <functional>
+#include <vector>
+#include <algorithm>
 
 #include "common.hpp"
 #include "log.hpp"
 #include "ssh_link_inbox.hpp"
-#include "base64.hpp"
+#include "link_message.hpp"
+#include "link_protocol.hpp"
 
 #define LIBSSH_STATIC 1
 #include "libssh/libsshpp.hpp"
@@ -29,6 +33,7 @@ struct SSH_Link_Client {
 
 private:
     SSH_Link_Inbox                inbox;
+    SSH_Link_Inbox                bulk_inbox;
     State                         state = INIT;
     std::unique_ptr<ssh::Session> session;
     std::unique_ptr<ssh::Channel> sftp_channel;
@@ -38,10 +43,16 @@ private:
     std::string                   error_string;
     std::thread                   thr;
     int                           read_thread_should_stop = 0;
+    u32                           caps = 0;
+    u32                           next_request_id = 1;
 public:
     std::string                   user;
     std::string                   hostname;
     std::string                   pass;
+    bool                          allow_binary_framing = true;
+    bool                          allow_compression    = true;
+    size_t                        read_buffer_size     = LINK_DEFAULT_READ_BUFFER_SIZE;
+    std::function<void()>         on_receive;       /* Called from the read thread once messages are waiting. */
 
 public:
     void default_fill_user_and_host() {
@@ -122,37 +133,34 @@ private:
     }
 
     static void read_thread(SSH_Link_Client &self) {
-        static constexpr const char *OSC_PATTERN = "\033]9998;";
-
-        char         buff[4096];
-        const char  *osc_state = OSC_PATTERN;
-        std::string  cur_msg;
+        std::vector<char>  buff(std::max(self.read_buffer_size, (size_t)1));
+        Link_Stream_Parser parser(LINK_OSC_TO_CLIENT);
 
         while (!self.read_thread_should_stop && !self.server_channel->isEof()) {
             int n = 0;
 
             try {
-                n = self.server_channel->read(buff, sizeof(buff), 100);
+                n = self.server_channel->read(buff.data(), buff.size(), 100);
             } catch (...) {
                 break;
             }
 
-            for (int i = 0; i < n; i += 1) {
-                if (*osc_state == 0) {
-                    if (buff[i] == '\x07') {
-                        try {
-                            self.inbox.push(base64::from_base64(cur_msg));
-                        } catch (...) {}
-                        cur_msg.clear();
-                        osc_state = OSC_PATTERN;
-                    } else {
-                        cur_msg += buff[i];
-                    }
-                } else if (buff[i] == *osc_state) {
-                    osc_state += 1;
-                } else {
-                    osc_state = OSC_PATTERN;
+            bool received = false;
+
+            parser.feed(buff.data(), n, [&self, &received](std::string &&msg, Link_Channel channel) {
+                auto &inbox = channel == Link_Channel::BULK ? self.bulk_inbox : self.inbox;
+
+                /* Back off while the UI catches up, but never block a disconnect. */
+                while (!inbox.try_push(msg) && !self.read_thread_should_stop) {
+                    if (self.on_receive) { self.on_receive(); }
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
                 }
+
+                received = true;
+            });
+
+            if (received && self.on_receive) {
+                self.on_receive();
             }
         }
     }
@@ -170,6 +178,7 @@ public:
         this->session.reset(new ssh::Session);
 
         this->known_host = false;
+        this->caps = 0;
         this->error_string = "";
         default_fill_user_and_host();
         this->state = INIT;
@@ -254,12 +263,30 @@ public:
         this->state = ATTACHED;
     }
 
+    u32 supported_capabilities() const {
+        u32 caps = link_supported_capabilities();
+        if (!this->allow_binary_framing) { caps &= ~LINK_CAP_BINARY_FRAMING;        }
+        if (!this->allow_compression)    { caps &= ~(LINK_CAP_LZ4 | LINK_CAP_ZSTD); }
+        return caps;
+    }
+
+    void set_capabilities(u32 caps) {
+        this->caps = caps;
+    }
+
+    /* Sends a request message under a fresh id and returns the id; the reply will carry it. */
+    u32 request(Link_Op op, std::string_view payload = {}) {
+        u32 id = this->next_request_id++;
+        if (this->next_request_id == 0) { this->next_request_id = 1; }
+
+        this->send(link_message(op, payload, id));
+
+        return id;
+    }
+
     void send(std::string &&msg) {
-        std::string payload = "\033]9999;";
-        try {
-            payload += base64::to_base64(msg);
-        } catch (...) {}
-        payload += "\007\n";
+        std::string payload;
+        link_encode(payload, this->caps, std::move(msg), LINK_OSC_TO_SERVER, "\007\n");
 
         int n = payload.size();
         int t = 0;
@@ -280,8 +307,10 @@ public:
         }
     }
 
+    /* Control messages are handed out ahead of any bulk data that arrived before them. */
     std::optional<std::string> try_pull() {
-        return this->inbox.try_pop();
+        if (auto msg = this->inbox.try_pop()) { return msg; }
+        return this->bulk_inbox.try_pop();
     }
 
     void finish() {
@@ -3,6 +3,7 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <optional>
 #include <memory>
 #include <algorithm>
@@ -11,6 +12,8 @@
 #include <mutex>
 #include <climits>
 #include <cstring>
+#include <cctype>
+#include <cxxabi.h>
 
 #define GL_SILENCE_DEPRECATION
 #if defined(IMGUI_IMPL_OPENGL_ES2)
@@ -26,10 +29,14 @@
 #include "log.hpp"
 #include "ssh_link.hpp"
 #include "profile.hpp"
+#include "aggregate.hpp"
+#include "stack_trie.hpp"
 #include "topo.hpp"
 
 namespace {
 
+static const char *ui_glsl_version = NULL;
+
 GLFWwindow * setup_GLFW_and_ImGui() {
     // Initialize GLFW
     if (!glfwInit()) {
@@ -81,6 +88,8 @@ GLFWwindow * setup_GLFW_and_ImGui() {
     ImGui_ImplGlfw_InitForOpenGL(window, true);
     ImGui_ImplOpenGL3_Init(glsl_version);
 
+    ui_glsl_version = glsl_version;
+
     return window;
 }
 
@@ -97,45 +106,393 @@ struct UI_Widget_Base {
     virtual ~UI_Widget_Base() {}
 };
 
+/*
+ * The GL 2.0+ entry points the heat map shader needs. Everything GLFW's GL
+ * header doesn't declare is fetched through glfwGetProcAddress once a context
+ * is current, so this doesn't fight with the loader inside the imgui backend.
+ */
+#ifndef GL_R32F
+#define GL_R32F 0x822E
+#endif
+#ifndef GL_FRAGMENT_SHADER
+#define GL_FRAGMENT_SHADER 0x8B30
+#endif
+#ifndef GL_VERTEX_SHADER
+#define GL_VERTEX_SHADER 0x8B31
+#endif
+#ifndef GL_COMPILE_STATUS
+#define GL_COMPILE_STATUS 0x8B81
+#endif
+#ifndef GL_LINK_STATUS
+#define GL_LINK_STATUS 0x8B82
+#endif
+#ifndef GL_CLAMP_TO_EDGE
+#define GL_CLAMP_TO_EDGE 0x812F
+#endif
+#ifndef GL_UNPACK_ROW_LENGTH
+#define GL_UNPACK_ROW_LENGTH 0x0CF2
+#endif
+
+struct Heat_Map_GL {
+    GLuint (*CreateShader)(GLenum type);
+    void   (*ShaderSource)(GLuint shader, GLsizei count, const char *const *string, const GLint *length);
+    void   (*CompileShader)(GLuint shader);
+    void   (*GetShaderiv)(GLuint shader, GLenum pname, GLint *params);
+    void   (*DeleteShader)(GLuint shader);
+    GLuint (*CreateProgram)();
+    void   (*AttachShader)(GLuint program, GLuint shader);
+    void   (*LinkProgram)(GLuint program);
+    void   (*GetProgramiv)(GLuint program, GLenum pname, GLint *params);
+    void   (*UseProgram)(GLuint program);
+    GLint  (*GetUniformLocation)(GLuint program, const char *name);
+    GLint  (*GetAttribLocation)(GLuint program, const char *name);
+    void   (*Uniform1i)(GLint location, GLint v0);
+    void   (*Uniform1f)(GLint location, GLfloat v0);
+    void   (*UniformMatrix4fv)(GLint location, GLsizei count, GLboolean transpose, const GLfloat *value);
+    void   (*VertexAttribPointer)(GLuint index, GLint size, GLenum type, GLboolean normalized, GLsizei stride, const void *pointer);
+    void   (*EnableVertexAttribArray)(GLuint index);
+
+    GLuint program   = 0;
+    GLint  loc_proj  = -1;
+    GLint  loc_tex   = -1;
+    GLint  loc_max   = -1;
+    GLint  loc_pos   = -1;
+    GLint  loc_uv    = -1;
+    GLint  max_size  = 0;       /* GL_MAX_TEXTURE_SIZE, so the most heat map columns. */
+
+    template<typename F>
+    static bool load(F &fn, const char *name) {
+        fn = (F)glfwGetProcAddress(name);
+        return fn != NULL;
+    }
+
+    bool load_all() {
+        return load(this->CreateShader,            "glCreateShader")
+            && load(this->ShaderSource,            "glShaderSource")
+            && load(this->CompileShader,           "glCompileShader")
+            && load(this->GetShaderiv,             "glGetShaderiv")
+            && load(this->DeleteShader,            "glDeleteShader")
+            && load(this->CreateProgram,           "glCreateProgram")
+            && load(this->AttachShader,            "glAttachShader")
+            && load(this->LinkProgram,             "glLinkProgram")
+            && load(this->GetProgramiv,            "glGetProgramiv")
+            && load(this->UseProgram,              "glUseProgram")
+            && load(this->GetUniformLocation,      "glGetUniformLocation")
+            && load(this->GetAttribLocation,       "glGetAttribLocation")
+            && load(this->Uniform1i,               "glUniform1i")
+            && load(this->Uniform1f,               "glUniform1f")
+            && load(this->UniformMatrix4fv,        "glUniformMatrix4fv")
+            && load(this->VertexAttribPointer,     "glVertexAttribPointer")
+            && load(this->EnableVertexAttribArray, "glEnableVertexAttribArray");
+    }
+
+    GLuint compile(GLenum type, const char *source) {
+        const char *sources[] = { ui_glsl_version, "\n", source };
+        GLuint      shader    = this->CreateShader(type);
+        GLint       ok        = 0;
+
+        this->ShaderSource(shader, std::size(sources), sources, NULL);
+        this->CompileShader(shader);
+        this->GetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+
+        if (!ok) {
+            this->DeleteShader(shader);
+            return 0;
+        }
+
+        return shader;
+    }
+
+    bool build_program() {
+        static constexpr const char *vertex_source =
+            "uniform mat4 ProjMtx;\n"
+            "in vec2 Position;\n"
+            "in vec2 UV;\n"
+            "out vec2 Frag_UV;\n"
+            "void main() {\n"
+            "    Frag_UV     = UV;\n"
+            "    gl_Position = ProjMtx * vec4(Position.xy, 0, 1);\n"
+            "}\n";
+
+        /* Padding cells are negative and left undrawn. */
+        static constexpr const char *fragment_source =
+            "#ifdef GL_ES\n"
+            "precision mediump float;\n"
+            "#endif\n"
+            "uniform sampler2D Texture;\n"
+            "uniform float Max;\n"
+            "in vec2 Frag_UV;\n"
+            "out vec4 Out_Color;\n"
+            "void main() {\n"
+            "    float v = texture(Texture, Frag_UV).r;\n"
+            "    if (v < 0.0) { discard; }\n"
+            "    float t = clamp(v / Max, 0.0, 1.0);\n"
+            "    Out_Color = vec4(1.0, 1.0 - t, 1.0 - t, 1.0);\n"
+            "}\n";
+
+        if (!this->load_all()) { return false; }
+
+        GLuint vs = this->compile(GL_VERTEX_SHADER, vertex_source);
+        GLuint fs = this->compile(GL_FRAGMENT_SHADER, fragment_source);
+        GLint  ok = 0;
+
+        if (vs && fs) {
+            this->program = this->CreateProgram();
+            this->AttachShader(this->program, vs);
+            this->AttachShader(this->program, fs);
+            this->LinkProgram(this->program);
+            this->GetProgramiv(this->program, GL_LINK_STATUS, &ok);
+        }
+
+        if (vs) { this->DeleteShader(vs); }
+        if (fs) { this->DeleteShader(fs); }
+
+        if (!ok) {
+            this->program = 0;
+            return false;
+        }
+
+        this->loc_proj = this->GetUniformLocation(this->program, "ProjMtx");
+        this->loc_tex  = this->GetUniformLocation(this->program, "Texture");
+        this->loc_max  = this->GetUniformLocation(this->program, "Max");
+        this->loc_pos  = this->GetAttribLocation(this->program, "Position");
+        this->loc_uv   = this->GetAttribLocation(this->program, "UV");
+
+        glGetIntegerv(GL_MAX_TEXTURE_SIZE, &this->max_size);
+
+        return this->loc_pos >= 0 && this->loc_uv >= 0;
+    }
+
+    /* NULL if this GL can't do it (ES 2, no float textures), and the caller draws cells itself. */
+    static Heat_Map_GL *get() {
+#if defined(IMGUI_IMPL_OPENGL_ES2)
+        return NULL;
+#else
+        static Heat_Map_GL gl;
+        static bool        ok = gl.build_program();
+
+        return ok ? &gl : NULL;
+#endif
+    }
+
+    /*
+     * Draw list callback: switches the backend's state over to our program for
+     * the image quad that follows. The backend resets its own state after.
+     */
+    static void begin_draw(const ImDrawList *list, const ImDrawCmd *cmd) {
+        Heat_Map_GL *gl   = get();
+        float        max  = *(float*)cmd->UserCallbackData;
+        ImDrawData  *draw = ImGui::GetDrawData();
+
+        float L = draw->DisplayPos.x;
+        float R = draw->DisplayPos.x + draw->DisplaySize.x;
+        float T = draw->DisplayPos.y;
+        float B = draw->DisplayPos.y + draw->DisplaySize.y;
+
+        const float proj[4][4] = {
+            { 2.0f / (R - L),    0.0f,              0.0f, 0.0f },
+            { 0.0f,              2.0f / (T - B),    0.0f, 0.0f },
+            { 0.0f,              0.0f,             -1.0f, 0.0f },
+            { (R + L) / (L - R), (T + B) / (B - T), 0.0f, 1.0f },
+        };
+
+        gl->UseProgram(gl->program);
+        gl->UniformMatrix4fv(gl->loc_proj, 1, GL_FALSE, &proj[0][0]);
+        gl->Uniform1i(gl->loc_tex, 0);
+        gl->Uniform1f(gl->loc_max, max);
+
+        gl->EnableVertexAttribArray(gl->loc_pos);
+        gl->EnableVertexAttribArray(gl->loc_uv);
+        gl->VertexAttribPointer(gl->loc_pos, 2, GL_FLOAT, GL_FALSE, sizeof(ImDrawVert), (void*)offsetof(ImDrawVert, pos));
+        gl->VertexAttribPointer(gl->loc_uv,  2, GL_FLOAT, GL_FALSE, sizeof(ImDrawVert), (void*)offsetof(ImDrawVert, uv));
+    }
+};
+
+/*
+ * Cells go down ROWS at a time, then across. With a GL that can do it, the
+ * values live in a float texture (one texel per cell, a texture row per heat
+ * map column) and a shader colors them, so drawing costs the same at 100k
+ * cells as at 10. set_data() only re-uploads the columns that changed.
+ */
 struct UI_SSO_Heat_Map_Widget : UI_Widget_Base {
     static constexpr int    ROWS = 10;
     static constexpr ImVec2 SIZE = { 16, 16 };
 
-    std::vector<float> data;
-    float              max;
+    std::string              title;
+    std::vector<std::string> labels;
+    std::vector<float>       data;
+    std::vector<float>       confidence;
+    float                    max;
+
+private:
+    GLuint                   texture       = 0;
+    size_t                   tex_columns   = 0;     /* Allocated texture rows. */
+    size_t                   dirty_begin   = 0;     /* Columns to upload before the next draw. */
+    size_t                   dirty_end     = 0;
+
+    size_t columns() const { return (this->data.size() + ROWS - 1) / ROWS; }
+
+    void upload(size_t max_columns) {
+        size_t n_columns = this->columns();
+
+        if (n_columns > this->tex_columns) {
+            if (this->texture == 0) {
+                glGenTextures(1, &this->texture);
+            }
+
+            this->tex_columns = std::min(std::max(n_columns, 2 * this->tex_columns), max_columns);
+            this->dirty_begin = 0;
+            this->dirty_end   = n_columns;
+
+            glBindTexture(GL_TEXTURE_2D, this->texture);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, ROWS, this->tex_columns, 0, GL_RED, GL_FLOAT, NULL);
+        }
+
+        if (this->dirty_begin >= this->dirty_end) { return; }
+
+        size_t first = this->dirty_begin * ROWS;
+        size_t last  = std::min(this->dirty_end * ROWS, this->data.size());
+
+        std::vector<float> texels(this->data.begin() + first, this->data.begin() + last);
+        texels.resize((this->dirty_end - this->dirty_begin) * ROWS, -1.0f);
+
+        glBindTexture(GL_TEXTURE_2D, this->texture);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, this->dirty_begin, ROWS, this->dirty_end - this->dirty_begin, GL_RED, GL_FLOAT, texels.data());
+
+        this->dirty_begin = this->dirty_end = 0;
+    }
+
+    void tooltip(int i) {
+        if (i >= (int)this->labels.size()) { return; }
+
+        float x = this->data[i];
+
+        if (i < (int)this->confidence.size() && this->confidence[i] < 1.0f) {
+            ImGui::SetTooltip("%s: ~%.0f (measured %.0f%% of the time)", this->labels[i].c_str(), x, 100.0f * this->confidence[i]);
+        } else {
+            ImGui::SetTooltip("%s: %.0f", this->labels[i].c_str(), x);
+        }
+    }
+
+    /* Without the shader: a rectangle per cell. */
+    void draw_cells(ImDrawList *draw_list, ImVec2 origin, ImVec2 cell, int hovered) {
+        for (size_t i = 0; i < this->data.size(); i += 1) {
+            ImVec2 p0 = { origin.x + (i / ROWS) * cell.x, origin.y + (i % ROWS) * cell.y };
+            ImVec2 p1 = { p0.x + cell.x, p0.y + cell.y };
+
+            int   c   = 255 - (int)((this->data[i] / this->max) * 255.0);
+            ImU32 col = (int)i == hovered ? IM_COL32(255, 0, 255, 255) : IM_COL32(255, c, c, 255);
+
+            draw_list->AddRectFilled(p0, p1, col);
+        }
+    }
+
+public:
+    UI_SSO_Heat_Map_Widget() {}
+
+    UI_SSO_Heat_Map_Widget(const UI_SSO_Heat_Map_Widget&)            = delete;
+    UI_SSO_Heat_Map_Widget& operator=(const UI_SSO_Heat_Map_Widget&) = delete;
+
+    ~UI_SSO_Heat_Map_Widget() {
+        if (this->texture) {
+            glDeleteTextures(1, &this->texture);
+        }
+    }
 
     void _imgui_frame() override {
         if (this->data.size()) {
             ImGui::BeginChild("heatmap", {}, ImGuiChildFlags_AutoResizeY);
 
-                ImGui::PlotLines("##", this->data.data(), this->data.size(), 0, NULL, FLT_MAX, FLT_MAX, { SIZE.x * (this->data.size() / this->ROWS), 2 * SIZE.y });
+                if (!this->title.empty()) {
+                    ImGui::Text("%s", this->title.c_str());
+                }
+
+                size_t n_columns = this->columns();
+                ImVec2 cell      = SIZE;
+
+                /* Shrink cells to fit rather than lay out thousands of columns off-screen. */
+                cell.x = std::clamp(ImGui::GetContentRegionAvail().x / n_columns, 1.0f, SIZE.x);
+
+                ImVec2 size = { cell.x * n_columns, cell.y * ROWS };
 
-                float left = ImGui::GetCursorPosX();
-                float top  = ImGui::GetCursorPosY();
+                ImGui::PlotLines("##", this->data.data(), this->data.size(), 0, NULL, FLT_MAX, FLT_MAX, { size.x, 2 * SIZE.y });
 
-                int i = 0;
-                for (float x : this->data) {
-                    ImGui::SetCursorPosY(top + ((i % ROWS) * SIZE.y));
-                    ImGui::SetCursorPosX(left + ((i / ROWS) * SIZE.x));
+                ImVec2 origin = ImGui::GetCursorScreenPos();
 
-                    ImGui::Dummy(SIZE);
+                ImGui::Dummy(size);
 
-                    ImVec2 p0 = ImGui::GetItemRectMin();
-                    ImVec2 p1 = ImGui::GetItemRectMax();
+                int hovered = -1;
 
-                    int c = 255 - (int)((x / this->max) * 255.0);
-                    ImU32 col = ImGui::IsItemHovered() ? IM_COL32(255, 0, 255, 255) : IM_COL32(255, c, c, 255);
+                if (ImGui::IsItemHovered()) {
+                    ImVec2 mouse  = ImGui::GetMousePos();
+                    int    column = (int)((mouse.x - origin.x) / cell.x);
+                    int    row    = (int)((mouse.y - origin.y) / cell.y);
+                    int    i      = column * ROWS + row;
 
-                    ImDrawList* draw_list = ImGui::GetWindowDrawList();
-                    draw_list->AddRectFilled(p0, p1, col);
+                    if (column >= 0 && row >= 0 && row < ROWS && i < (int)this->data.size()) {
+                        hovered = i;
+                        this->tooltip(i);
+                    }
+                }
+
+                ImDrawList  *draw_list = ImGui::GetWindowDrawList();
+                Heat_Map_GL *gl        = Heat_Map_GL::get();
+
+                if (gl && n_columns <= (size_t)gl->max_size) {
+                    this->upload(gl->max_size);
 
-                    i += 1;
+                    /* The texture's rows are the heat map's columns, so the quad's UVs are transposed. */
+                    float  v   = (float)n_columns / this->tex_columns;
+                    ImVec2 p1  = origin;
+                    ImVec2 p2  = { origin.x + size.x, origin.y };
+                    ImVec2 p3  = { origin.x + size.x, origin.y + size.y };
+                    ImVec2 p4  = { origin.x,          origin.y + size.y };
+
+                    draw_list->AddCallback(Heat_Map_GL::begin_draw, &this->max, sizeof(this->max));
+                    draw_list->AddImageQuad((ImTextureID)this->texture, p1, p2, p3, p4, { 0, 0 }, { 0, v }, { 1, v }, { 1, 0 });
+                    draw_list->AddCallback(ImDrawCallback_ResetRenderState, NULL);
+
+                    if (hovered >= 0) {
+                        ImVec2 p0 = { origin.x + (hovered / ROWS) * cell.x, origin.y + (hovered % ROWS) * cell.y };
+                        draw_list->AddRectFilled(p0, { p0.x + cell.x, p0.y + cell.y }, IM_COL32(255, 0, 255, 255));
+                    }
+                } else {
+                    this->draw_cells(draw_list, origin, cell, hovered);
                 }
+
             ImGui::EndChild();
         }
     }
 
     void set_data(std::vector<float> &&data) {
+        size_t begin = 0;
+        size_t end   = data.size();
+
+        /* Only the columns that differ from what's uploaded need to go again. */
+        if (data.size() == this->data.size()) {
+            while (begin < end && data[begin] == this->data[begin])     { begin += 1; }
+            while (end > begin && data[end - 1] == this->data[end - 1]) { end   -= 1; }
+        }
+
+        if (begin < end) {
+            size_t first = begin / ROWS;
+            size_t last  = (end + ROWS - 1) / ROWS;
+
+            if (this->dirty_begin < this->dirty_end) {
+                first = std::min(first, this->dirty_begin);
+                last  = std::max(last, this->dirty_end);
+            }
+
+            this->dirty_begin = first;
+            this->dirty_end   = last;
+        }
+
         this->data = std::move(data);
 
         this->max = FLT_MIN;
@@ -146,63 +503,520 @@ struct UI_SSO_Heat_Map_Widget : UI_Widget_Base {
     }
 };
 
+/*
+ * Per-event totals across all CPU threads, as a scrolling plot fed by the live
+ * monitor. With server-side buckets, each point is a bucket's mean tick, and
+ * the latest bucket's per-thread range (and median/p99, with histograms) is
+ * shown next to the plot.
+ *
+ * A thread whose counter group was rotated out for a tick (or a whole bucket)
+ * has no value for it; its last measured value is carried forward instead of
+ * dipping to zero, and hovering such a point says how much of it was measured,
+ * as the heat map's tooltip does.
+ */
+struct UI_Live_Monitor_Widget : UI_Widget_Base {
+    static constexpr size_t HISTORY = 4096;
+
+    struct Bucket_Stats {
+        u64 min = 0;
+        u64 max = 0;
+        u64 p50 = 0;
+        u64 p99 = 0;
+    };
+
+    Monitor_Stream_Header             header;
+    std::vector<std::vector<float>>   history;     /* One per event. */
+    std::vector<std::vector<float>>   measured;    /* Same shape; the mean confidence over the threads. */
+    std::vector<u64>                  last;        /* Per series, the last measured value. */
+    std::vector<Bucket_Stats>         latest;      /* One per event, from the last aggregate bucket. */
+    u64                               ticks     = 0;
+    u64                               missed    = 0;
+    u64                               bucket_ns = 0;
+    bool                              have_hist = false;
+
+    void _imgui_frame() override {
+        if (this->bucket_ns) {
+            ImGui::Text("%zu threads, every %.1f ms in %.1f ms buckets, %llu buckets (%llu ticks missed)",
+                        this->header.threads.size(), this->header.interval_ns / 1e6, this->bucket_ns / 1e6,
+                        (unsigned long long)this->ticks, (unsigned long long)this->missed);
+        } else {
+            ImGui::Text("%zu threads, every %.1f ms, %llu ticks (%llu missed)",
+                        this->header.threads.size(), this->header.interval_ns / 1e6,
+                        (unsigned long long)this->ticks, (unsigned long long)this->missed);
+        }
+
+        for (size_t e = 0; e < this->history.size(); e += 1) {
+            auto  &h     = this->history[e];
+            float  width = ImGui::GetContentRegionAvail().x * 0.8f;
+
+            ImGui::PlotLines(this->header.events[e].c_str(), h.data(), h.size(), 0, NULL, FLT_MAX, FLT_MAX, { width, 80 });
+
+            if (ImGui::IsItemHovered() && h.size() > 1) {
+                this->tooltip(e, ImGui::GetItemRectMin().x, width);
+            }
+
+            if (this->bucket_ns) {
+                auto &stats = this->latest[e];
+                ImGui::Text("    per tick and thread: min %llu, max %llu",
+                            (unsigned long long)stats.min, (unsigned long long)stats.max);
+                if (this->have_hist) {
+                    ImGui::SameLine();
+                    ImGui::Text(", median >= %llu, p99 >= %llu",
+                                (unsigned long long)stats.p50, (unsigned long long)stats.p99);
+                }
+            }
+        }
+    }
+
+    /* Replaces PlotLines' own tooltip when the hovered point wasn't fully measured. */
+    void tooltip(size_t e, float x, float width) {
+        auto  &h   = this->history[e];
+        auto  &m   = this->measured[e];
+        float  pad = ImGui::GetStyle().FramePadding.x;
+        float  t   = std::clamp((ImGui::GetIO().MousePos.x - x - pad) / (width - 2 * pad), 0.0f, 0.9999f);
+        size_t i   = (size_t)(t * (h.size() - 1));
+
+        if (m[i] < 1.0f) {
+            ImGui::SetTooltip("%zu: ~%.0f (measured %.0f%% of the time)", i, h[i], 100.0f * m[i]);
+        }
+    }
+
+    void trim(size_t e) {
+        for (auto *v : { &this->history[e], &this->measured[e] }) {
+            if (v->size() > HISTORY) {
+                v->erase(v->begin(), v->end() - HISTORY);
+            }
+        }
+    }
+
+    void add_batch(const Monitor_Stream_Batch &batch) {
+        size_t n_events  = this->header.events.size();
+        size_t n_threads = this->header.threads.size();
+        size_t n_ticks   = batch.n_ticks();
+
+        if (batch.values.size() != n_ticks * n_events * n_threads || batch.confidence.size() != batch.values.size()) { return; }
+
+        for (size_t e = 0; e < n_events; e += 1) {
+            auto  &h     = this->history[e];
+            auto  &m     = this->measured[e];
+            size_t first = h.size();
+
+            h.resize(first + n_ticks, 0.0f);
+            m.resize(first + n_ticks, 0.0f);
+
+            for (size_t t = 0; t < n_threads; t += 1) {
+                size_t     series     = t * n_events + e;
+                const u64 *values     = batch.series(series);
+                const f32 *confidence = batch.confidence.data() + series * n_ticks;
+
+                for (size_t i = 0; i < n_ticks; i += 1) {
+                    if (confidence[i] > 0) { this->last[series] = values[i]; }
+
+                    h[first + i] += this->last[series];
+                    m[first + i] += confidence[i] / n_threads;
+                }
+            }
+
+            this->trim(e);
+        }
+
+        this->ticks  += n_ticks;
+        this->missed += batch.missed;
+    }
+
+    void add_aggregate(const Monitor_Aggregate_Batch &batch) {
+        size_t n_events  = this->header.events.size();
+        size_t n_threads = this->header.threads.size();
+        size_t n_cells   = n_events * n_threads * batch.n_buckets;
+
+        if (batch.sum.size() != n_cells || batch.count.size() != n_cells || batch.n_buckets == 0) { return; }
+
+        bool hist = batch.hist_offsets.size() == n_cells + 1;
+        u32  last = batch.n_buckets - 1;
+
+        for (size_t e = 0; e < n_events; e += 1) {
+            auto  &h     = this->history[e];
+            auto  &m     = this->measured[e];
+            size_t first = h.size();
+
+            h.resize(first + batch.n_buckets, 0.0f);
+            m.resize(first + batch.n_buckets, 0.0f);
+
+            Bucket_Stats       stats;
+            bool               seen = false;
+            std::map<u16, u64> bins;
+            u64                n    = 0;
+
+            for (size_t t = 0; t < n_threads; t += 1) {
+                size_t series = t * n_events + e;
+
+                for (size_t b = 0; b < batch.n_buckets; b += 1) {
+                    size_t c = batch.cell(series, b);
+                    if (batch.count[c]) {
+                        this->last[series]  = batch.sum[c] / batch.count[c];
+                        m[first + b]       += 1.0f / n_threads;
+                    }
+                    h[first + b] += this->last[series];
+                }
+
+                size_t c = batch.cell(series, last);
+                if (batch.count[c] == 0) { continue; }
+
+                stats.min = seen ? std::min(stats.min, batch.min[c]) : batch.min[c];
+                stats.max = seen ? std::max(stats.max, batch.max[c]) : batch.max[c];
+                seen      = true;
+
+                if (hist) {
+                    for (u32 i = batch.hist_offsets[c]; i < batch.hist_offsets[c + 1]; i += 1) {
+                        bins[batch.hist_bins[i]] += batch.hist_counts[i];
+                        n                        += batch.hist_counts[i];
+                    }
+                }
+            }
+
+            /* Quantiles as the lower bound of the bin they fall into. */
+            u64 acc = 0;
+            for (auto &[bin, count] : bins) {
+                u64 lower = Log_Linear_Histogram::lower_bound(bin);
+                u64 next  = acc + count;
+
+                if (acc <= n / 2 && next > n / 2)                 { stats.p50 = lower; }
+                if (acc <= n * 99 / 100 && next > n * 99 / 100)   { stats.p99 = lower; }
+
+                acc = next;
+            }
+
+            if (seen) { this->latest[e] = stats; }
+
+            this->trim(e);
+        }
+
+        this->bucket_ns  = batch.bucket_ns;
+        this->have_hist  = hist;
+        this->ticks     += batch.n_buckets;
+        this->missed    += batch.missed;
+    }
+
+    UI_Live_Monitor_Widget(Monitor_Stream_Header &&header) : header(std::move(header)) {
+        this->history.resize(this->header.events.size());
+        this->measured.resize(this->header.events.size());
+        this->latest.resize(this->header.events.size());
+        this->last.resize(this->header.events.size() * this->header.threads.size(), 0);
+    }
+};
+
+/*
+ * The modules and symbols the server has interned for this connection, which
+ * it sends once each inside stack deltas. Names are demangled the first time
+ * they are displayed.
+ */
+struct Symbol_Store {
+    std::vector<std::string> module_path;
+    std::vector<std::string> module_build_id;
+    std::vector<u32>         symbol_module;
+    std::vector<u64>         symbol_addr;
+    std::vector<std::string> symbol_name;
+    std::vector<bool>        demangled;
+
+    /* Returns false if the delta doesn't continue what we have. */
+    bool add(const Stack_Trie_Delta &delta) {
+        if (delta.first_module != this->module_path.size() || delta.first_symbol != this->symbol_name.size()) {
+            return false;
+        }
+
+        this->module_path.insert(this->module_path.end(), delta.module_path.begin(), delta.module_path.end());
+        this->module_build_id.insert(this->module_build_id.end(), delta.module_build_id.begin(), delta.module_build_id.end());
+        this->symbol_module.insert(this->symbol_module.end(), delta.symbol_module.begin(), delta.symbol_module.end());
+        this->symbol_addr.insert(this->symbol_addr.end(), delta.symbol_addr.begin(), delta.symbol_addr.end());
+        this->symbol_name.insert(this->symbol_name.end(), delta.symbol_name.begin(), delta.symbol_name.end());
+        this->demangled.resize(this->symbol_name.size(), false);
+
+        return true;
+    }
+
+    const std::string &name(u32 id) {
+        if (!this->demangled[id]) {
+            int   status = 0;
+            char *out    = abi::__cxa_demangle(this->symbol_name[id].c_str(), NULL, NULL, &status);
+
+            if (status == 0 && out) {
+                this->symbol_name[id] = out;
+            }
+            free(out);
+
+            this->demangled[id] = true;
+        }
+
+        return this->symbol_name[id];
+    }
+
+    const std::string &module(u32 id) const { return this->module_path[this->symbol_module[id]]; }
+};
+
+/*
+ * Icicle-style flame graph of the callchain trie streamed by the server:
+ * processes on the top row, callers above callees, each frame as wide as the
+ * samples at or below it.
+ */
+struct UI_Flame_Graph_Widget : UI_Widget_Base {
+    static constexpr float ROW_HEIGHT = 18.0f;
+    static constexpr float MIN_WIDTH  = 1.0f;
+
+    Symbol_Store                 &symbols;
+    Stack_Trie                    trie;
+    std::vector<u64>              total;
+    std::vector<u32>              depth     = { 0 };
+    std::vector<std::vector<u32>> children  = { {} };
+    std::vector<u32>              symbol    = { NO_SYMBOL };
+    std::map<u32, std::string>    process_names;
+    u32                           max_depth = 0;
+    u64                           lost      = 0;
+
+    std::string frame_label(u32 node) const {
+        char buff[32];
+
+        if (this->depth[node] == 1) {
+            auto it = this->process_names.find(node);
+            snprintf(buff, sizeof(buff), " [%llu]", (unsigned long long)this->trie.ip[node]);
+            return (it != this->process_names.end() ? it->second : "pid") + buff;
+        }
+
+        if (this->symbol[node] != NO_SYMBOL) {
+            return this->symbols.name(this->symbol[node]);
+        }
+
+        snprintf(buff, sizeof(buff), "0x%llx", (unsigned long long)this->trie.ip[node]);
+
+        return buff;
+    }
+
+    void draw_node(ImDrawList *draw_list, ImVec2 origin, u32 node, float x, float width) {
+        ImVec2 p0 = { origin.x + x,         origin.y + (this->depth[node] - 1) * ROW_HEIGHT };
+        ImVec2 p1 = { origin.x + x + width, p0.y + ROW_HEIGHT - 1 };
+
+        bool hovered = ImGui::IsMouseHoveringRect(p0, p1);
+        u32  hue     = (u32)(this->trie.ip[node] * 0x9E3779B1u) >> 24;
+
+        draw_list->AddRectFilled(p0, p1, hovered ? IM_COL32(255, 0, 255, 255) : IM_COL32(200 + hue % 56, 80 + hue % 120, 40, 255));
+
+        std::string label = this->frame_label(node);
+
+        if (width > ImGui::CalcTextSize(label.c_str()).x + 4) {
+            draw_list->PushClipRect(p0, p1, true);
+            draw_list->AddText({ p0.x + 2, p0.y + 1 }, IM_COL32(0, 0, 0, 255), label.c_str());
+            draw_list->PopClipRect();
+        }
+
+        if (hovered) {
+            u32 sym = this->symbol[node];
+            ImGui::SetTooltip("%s%s%s\n%llu samples (%.1f%%), %llu in this frame", label.c_str(),
+                              sym != NO_SYMBOL ? "\nin " : "", sym != NO_SYMBOL ? this->symbols.module(sym).c_str() : "",
+                              (unsigned long long)this->total[node], 100.0 * this->total[node] / this->total[0],
+                              (unsigned long long)this->trie.count[node]);
+        }
+
+        for (u32 child : this->children[node]) {
+            float w = width * this->total[child] / this->total[node];
+            if (w >= MIN_WIDTH) {
+                this->draw_node(draw_list, origin, child, x, w);
+            }
+            x += w;
+        }
+    }
+
+    void _imgui_frame() override {
+        ImGui::Text("%llu samples, %zu distinct frames, %llu lost", (unsigned long long)(this->total.empty() ? 0 : this->total[0]),
+                    this->trie.size() - 1, (unsigned long long)this->lost);
+
+        if (this->total.empty() || this->total[0] == 0) { return; }
+
+        ImVec2 origin = ImGui::GetCursorScreenPos();
+        float  width  = ImGui::GetContentRegionAvail().x;
+
+        this->draw_node(ImGui::GetWindowDrawList(), origin, 0, 0, width);
+
+        ImGui::Dummy({ width, this->max_depth * ROW_HEIGHT });
+    }
+
+    /* Returns false if the delta doesn't continue what we have. */
+    bool add_delta(const Stack_Trie_Delta &delta) {
+        if (!this->trie.apply(delta)) { return false; }
+
+        size_t process = 0;
+
+        for (u32 i = delta.first_node; i < this->trie.size(); i += 1) {
+            u32 parent = this->trie.parent[i];
+            u32 k      = i - delta.first_node;
+
+            this->depth.push_back(this->depth[parent] + 1);
+            this->children.emplace_back();
+            this->children[parent].push_back(i);
+            this->symbol.push_back(k < delta.symbol.size() ? delta.symbol[k] : NO_SYMBOL);
+            this->max_depth = std::max(this->max_depth, this->depth[i]);
+
+            if (parent == 0 && process < delta.process_name.size()) {
+                if (!delta.process_name[process].empty()) {
+                    this->process_names[i] = delta.process_name[process];
+                }
+                process += 1;
+            }
+        }
+
+        this->trie.inclusive(this->total);
+        this->lost += delta.lost;
+
+        return true;
+    }
+
+    UI_Flame_Graph_Widget(Symbol_Store &symbols) : symbols(symbols) {}
+};
+
+/*
+ * The machine as nested boxes. The boxes are laid out once per topology and
+ * window size and drawn straight into the draw list, without an imgui item
+ * per node.
+ */
 struct UI_Topology_Widget : UI_Widget_Base {
     const Topology &topo;
 
+private:
     #define CHERRY_BRIGHT(v) ImVec4(0.502f, 0.075f, 0.256f, v)
     #define CHERRY_MID(v)    ImVec4(0.455f, 0.198f, 0.301f, v)
     #define CHERRY_DARK(v)   ImVec4(0.232f, 0.201f, 0.271f, v)
     #define BLACK(v)         ImVec4(0.0f, 0.0f, 0.0f, v)
 
-    void push_node_color(const Topology_Node &node) {
-        ImVec4 color;
-        switch (node.type) {
-            case Resource_Type::CPU_CORE:
-                color = CHERRY_BRIGHT(1.0f);
-                break;
-            case Resource_Type::CPU_THREAD:
-                color = CHERRY_MID(1.0f);
-                break;
-            case Resource_Type::UNKNOWN:
-                color = CHERRY_DARK(1.0f);
-                break;
-            default:
-                color = BLACK(1.0f);
-                break;
+    static constexpr float PAD     = 4.0f;
+    static constexpr float MIN_BOX = 12.0f;     /* Narrower children are collapsed into their parent. */
+
+    /* One box per laid out node, parents before children. */
+    std::vector<u32>         nodes;
+    std::vector<ImVec2>      mins;              /* Relative to the widget's origin. */
+    std::vector<ImVec2>      maxs;
+    std::vector<ImU32>       colors;
+    std::vector<std::string> labels;
+    std::vector<u8>          show_label;
+    ImVec2                   laid_out_for = { -1, -1 };
+
+    static ImU32 node_color(Resource_Type type) {
+        switch (type) {
+            case Resource_Type::CPU_CORE:   return ImGui::GetColorU32(CHERRY_BRIGHT(1.0f));
+            case Resource_Type::CPU_THREAD: return ImGui::GetColorU32(CHERRY_MID(1.0f));
+            case Resource_Type::UNKNOWN:    return ImGui::GetColorU32(CHERRY_DARK(1.0f));
+            default:                        return ImGui::GetColorU32(BLACK(1.0f));
+        }
+    }
+
+    /*
+     * Children split their parent's width evenly below its label. When that
+     * would make them narrower than MIN_BOX, the parent is drawn alone with a
+     * thread count instead, so a machine with hundreds of threads still shows
+     * sockets and caches rather than a smear of slivers.
+     */
+    void layout(ImVec2 size) {
+        const Flat_Topology &flat   = this->topo.flat;
+        float                line_h = ImGui::GetTextLineHeight();
+        std::vector<s32>     box(flat.size(), -1);
+
+        this->nodes.clear();
+        this->mins.clear();
+        this->maxs.clear();
+        this->colors.clear();
+        this->labels.clear();
+        this->show_label.clear();
+
+        this->laid_out_for = size;
+
+        if (flat.size() == 0) { return; }
+
+        for (u32 i = 0; i < flat.size(); i += 1) {
+            ImVec2 inner_min, inner_max;
+
+            if (i == 0) {
+                /* The root isn't drawn; its children share the whole area. */
+                inner_min = { 0, 0 };
+                inner_max = size;
+            } else if (box[i] >= 0) {
+                inner_min = { this->mins[box[i]].x + PAD, this->mins[box[i]].y + line_h + 2 * PAD };
+                inner_max = { this->maxs[box[i]].x - PAD, this->maxs[box[i]].y - PAD };
+            } else {
+                continue;
+            }
+
+            u32   n = flat.n_children[i];
+            float w = n ? (inner_max.x - inner_min.x - (n - 1) * PAD) / n : 0.0f;
+
+            if (n == 0) { continue; }
+
+            if (w < MIN_BOX || inner_max.y - inner_min.y < MIN_BOX) {
+                if (i > 0) {
+                    this->labels[box[i]] += " (" + std::to_string(flat.n_threads[i]) + " threads)";
+                }
+                continue;
+            }
+
+            for (u32 j = 0; j < n; j += 1) {
+                u32    c  = flat.first_child[i] + j;
+                ImVec2 p0 = { inner_min.x + j * (w + PAD), inner_min.y };
+                ImVec2 p1 = { p0.x + w, inner_max.y };
+
+                box[c] = this->nodes.size();
+
+                this->nodes.push_back(c);
+                this->mins.push_back(p0);
+                this->maxs.push_back(p1);
+                this->colors.push_back(node_color(flat.type[c]));
+                this->labels.push_back(flat.name(c));
+                this->show_label.push_back(0);
+            }
+        }
+
+        for (size_t b = 0; b < this->nodes.size(); b += 1) {
+            float room = this->maxs[b].x - this->mins[b].x - 2 * PAD;
+            this->show_label[b] = ImGui::CalcTextSize(this->labels[b].c_str()).x <= room;
         }
-        ImGui::PushStyleColor(ImGuiCol_ChildBg, color);
     }
 
-    void pop_node_color() {
-        ImGui::PopStyleColor();
+public:
+    void topology_changed() {
+        this->laid_out_for = { -1, -1 };
     }
 
     void _imgui_frame() override {
-        std::function<void(const Topology_Node&, ImVec2&, bool)> topo_node;
-
-        topo_node = [&](const Topology_Node &node, ImVec2 &size, bool first) {
-            if (!first) ImGui::SameLine();
-            push_node_color(node);
-            ImGui::BeginChild(node.name.c_str(), size, ImGuiChildFlags_Borders, 0);
-            ImGui::Text("%s", node.name.c_str());
-            ImVec2 newsize(size.x / node.subnodes.size(), size.y);
-            bool firstchild = true;
-            for (auto &pair : node.subnodes) {
-                topo_node(pair.second, newsize, firstchild);
-                if (firstchild) firstchild = false;
+        ImVec2 size = ImGui::GetContentRegionAvail();
+
+        if (size.x != this->laid_out_for.x || size.y != this->laid_out_for.y) {
+            this->layout(size);
+        }
+
+        ImVec2      origin    = ImGui::GetCursorScreenPos();
+        ImDrawList *draw_list = ImGui::GetWindowDrawList();
+        ImU32       border    = ImGui::GetColorU32(ImGuiCol_Border);
+        ImU32       text      = ImGui::GetColorU32(ImGuiCol_Text);
+
+        ImGui::Dummy(size);
+
+        for (size_t b = 0; b < this->nodes.size(); b += 1) {
+            ImVec2 p0 = { origin.x + this->mins[b].x, origin.y + this->mins[b].y };
+            ImVec2 p1 = { origin.x + this->maxs[b].x, origin.y + this->maxs[b].y };
+
+            draw_list->AddRectFilled(p0, p1, this->colors[b]);
+            draw_list->AddRect(p0, p1, border);
+
+            if (this->show_label[b]) {
+                draw_list->AddText({ p0.x + PAD, p0.y + PAD }, text, this->labels[b].c_str());
             }
-            ImGui::EndChild();
-            pop_node_color();
-        };
+        }
+
+        if (ImGui::IsItemHovered()) {
+            ImVec2 mouse = ImGui::GetMousePos();
 
-        /* Call the topo_node lambda for each subnode of the root */
-        ImVec2 avail_size = ImGui::GetContentRegionAvail();
-        ImVec2 size(avail_size.x / this->topo.subnodes.size(), avail_size.y);
-        bool first = true;
-        for (auto &pair : this->topo.subnodes) {
-            topo_node(pair.second, size, first);
-            if (first) {
-                first = false;
+            /* Children come after their parents, so the last box under the mouse is the innermost. */
+            for (size_t b = this->nodes.size(); b-- > 0;) {
+                if (mouse.x >= origin.x + this->mins[b].x && mouse.x < origin.x + this->maxs[b].x
+                &&  mouse.y >= origin.y + this->mins[b].y && mouse.y < origin.y + this->maxs[b].y) {
+                    ImGui::SetTooltip("%s", this->labels[b].c_str());
+                    break;
+                }
             }
         }
     }
@@ -356,41 +1170,288 @@ struct SSH_Connection_Window : UI_Float_Window_Base {
     SSH_Connection_Window(SSH_Link_Client &ssh_link) : UI_Float_Window_Base("Connect to Server"), ssh_link(ssh_link) {}
 };
 
+/*
+ * Only the lines that are on screen are laid out, so the cost of a frame
+ * doesn't grow with the length of the session.
+ */
 struct Log_Window : UI_Float_Window_Base {
-    std::vector<std::string> items;
+    Log_Ring     ring;
+    Log_Filter   filter;
+    int          min_severity = (int)Log_Severity::INFO;
+    std::string  query;
 
     void _imgui_frame() override {
-        for (auto &item : this->items) {
-            ImGui::Text("%s", item.c_str());
+        static constexpr ImU32 colors[] = {
+            IM_COL32(150, 150, 150, 255),
+            IM_COL32(255, 255, 255, 255),
+            IM_COL32(255, 200,   0, 255),
+            IM_COL32(255,  80,  80, 255),
+        };
+
+        ImGui::SetNextItemWidth(100);
+        ImGui::Combo("##severity", &this->min_severity, log_severity_names, std::size(log_severity_names));
+        ImGui::SameLine();
+        ImGui::SetNextItemWidth(-80);
+        ImGui::InputTextWithHint("##search", "search", &this->query);
+        ImGui::SameLine();
+        if (ImGui::Button("Clear")) {
+            this->ring.clear();
         }
+
+        this->filter.update(this->ring, (Log_Severity)this->min_severity, this->query);
+
+        ImGui::BeginChild("lines", {}, ImGuiChildFlags_None, ImGuiWindowFlags_HorizontalScrollbar);
+
+            bool at_bottom = ImGui::GetScrollY() >= ImGui::GetScrollMaxY();
+
+            ImGuiListClipper clipper;
+            clipper.Begin(this->filter.matches.size());
+            while (clipper.Step()) {
+                for (int i = clipper.DisplayStart; i < clipper.DisplayEnd; i += 1) {
+                    u64              seq  = this->filter.matches[i];
+                    std::string_view text = this->ring.text(seq);
+
+                    ImGui::PushStyleColor(ImGuiCol_Text, colors[(int)this->ring.line(seq).severity]);
+                    ImGui::TextUnformatted(text.data(), text.data() + text.size());
+                    ImGui::PopStyleColor();
+                }
+            }
+            clipper.End();
+
+            /* Follow new lines unless scrolled back. */
+            if (at_bottom) {
+                ImGui::SetScrollHereY(1.0f);
+            }
+
+        ImGui::EndChild();
     }
 
     Log_Window() : UI_Float_Window_Base("Log") {}
 };
 
+/*
+ * Every event of every source in one sorted, flat table, with the names
+ * lowercased once up front and a trigram index over them: a query of three
+ * characters or more only looks at the events that have its rarest trigram.
+ */
+struct Event_Index {
+    std::vector<std::string> names;
+    std::vector<u32>         source;        /* Into source_names. */
+    std::vector<std::string> source_names;
+
+private:
+    std::string                                 lower;          /* All lowercase names back to back. */
+    std::vector<u32>                            lower_end;
+    std::unordered_map<u32, std::vector<u32>>   trigrams;       /* Sorted event ids per trigram. */
+
+    static u32 trigram(const char *p) { return (u32)(u8)p[0] | (u32)(u8)p[1] << 8 | (u32)(u8)p[2] << 16; }
+
+    static std::string to_lower(std::string_view s) {
+        std::string out(s);
+        for (char &c : out) { c = std::tolower((unsigned char)c); }
+        return out;
+    }
+
+public:
+    size_t size() const { return this->names.size(); }
+
+    std::string_view lower_name(u32 i) const {
+        u32 begin = i ? this->lower_end[i - 1] : 0;
+        return std::string_view(this->lower).substr(begin, this->lower_end[i] - begin);
+    }
+
+    void build(const Profile_Config &config) {
+        this->names.clear();
+        this->source.clear();
+        this->source_names.clear();
+        this->lower.clear();
+        this->lower_end.clear();
+        this->trigrams.clear();
+
+        /* The maps are already sorted by source, then name. */
+        for (auto &[source_name, src] : config.sources) {
+            this->source_names.push_back(source_name);
+
+            for (auto &[name, event] : src.events) {
+                u32 id = this->names.size();
+
+                this->names.push_back(name);
+                this->source.push_back(this->source_names.size() - 1);
+
+                this->lower += to_lower(name);
+                this->lower_end.push_back(this->lower.size());
+
+                std::string_view l = this->lower_name(id);
+                for (size_t j = 0; j + 3 <= l.size(); j += 1) {
+                    auto &ids = this->trigrams[trigram(l.data() + j)];
+                    if (ids.empty() || ids.back() != id) {
+                        ids.push_back(id);
+                    }
+                }
+            }
+        }
+    }
+
+    /*
+     * The events whose name contains query, ignoring case. within, if given,
+     * must hold every match (e.g. the matches of a shorter query); the smaller
+     * of it and the rarest trigram's events is what gets checked.
+     */
+    void filter(std::string_view query, std::vector<u32> &out, const std::vector<u32> *within = NULL) const {
+        std::string             q          = to_lower(query);
+        const std::vector<u32> *candidates = within;
+        std::vector<u32>        all;
+
+        out.clear();
+
+        if (q.size() >= 3) {
+            for (size_t j = 0; j + 3 <= q.size(); j += 1) {
+                auto it = this->trigrams.find(trigram(q.data() + j));
+                if (it == this->trigrams.end()) { return; }
+
+                if (candidates == NULL || it->second.size() < candidates->size()) {
+                    candidates = &it->second;
+                }
+            }
+        }
+
+        if (candidates == NULL) {
+            all.resize(this->size());
+            for (u32 i = 0; i < all.size(); i += 1) { all[i] = i; }
+            candidates = &all;
+        }
+
+        for (u32 i : *candidates) {
+            if (this->lower_name(i).find(q) != std::string_view::npos) {
+                out.push_back(i);
+            }
+        }
+    }
+};
+
 struct Profile_Config_Window : UI_Float_Window_Base {
-    const Profile_Config &config;
+    const Profile_Config       &config;
+    Event_Index                 events;
+    std::vector<u8>             selected;   /* Per event of the index. */
+    std::string                 query;
+    std::string                 filtered_query;
+    std::vector<u32>            matches;    /* The events shown, for filtered_query. */
+    int                         counters_per_group = 4;
+    int                         time_slice_ms      = 10;
+    int                         monitor_interval_ms = 10;
+    int                         monitor_bucket_ms   = 0;
+    bool                        monitor_histograms  = false;
+    int                         rollup_level        = 0;
+    int                         profile_frequency   = 999;
+
+    void refilter() {
+        std::vector<u32> out;
+        bool             narrower = this->query.find(this->filtered_query) != std::string::npos;
+
+        this->events.filter(this->query, out, narrower ? &this->matches : NULL);
+
+        this->matches        = std::move(out);
+        this->filtered_query = this->query;
+    }
 
     void _imgui_frame() override {
-        for (auto &pair: this->config.sources) {
-            const auto &source = pair.second;
-            if (ImGui::TreeNode(source.name.c_str())) {
-                auto item_fn = [](void *data, int idx) -> const char* {
-                    const Profile_Data_Source *source = (Profile_Data_Source*)data;
-                    auto it = source->events.begin();
-                    std::advance(it, idx);
-                    return it->second.name.c_str();
-                };
+        /* With more events than counters the server takes turns between groups of this size. */
+        ImGui::SliderInt("Counters per group", &this->counters_per_group, 1, 8);
+        ImGui::SliderInt("Time slice (ms)",    &this->time_slice_ms,      1, 100);
+        ImGui::SliderInt("Live monitor interval (ms)", &this->monitor_interval_ms, 1, 1000);
+        /* Non-zero: the server reduces ticks into buckets this wide and only sends those. */
+        ImGui::SliderInt("Live monitor bucket (ms)",   &this->monitor_bucket_ms,   0, 10000);
+        ImGui::Checkbox("Bucket histograms", &this->monitor_histograms);
+        ImGui::Combo("Heat map cells", &this->rollup_level, "CPU threads\0Cores\0Shared caches\0Sockets\0Machine\0");
+        ImGui::SliderInt("Stack samples per second", &this->profile_frequency, 1, 10000);
+
+        size_t n_selected = std::count(this->selected.begin(), this->selected.end(), 1);
+
+        ImGui::SetNextItemWidth(-FLT_MIN);
+        if (ImGui::InputTextWithHint("##events", "filter events", &this->query)) {
+            this->refilter();
+        }
+        ImGui::Text("%zu of %zu events, %zu selected", this->matches.size(), this->events.size(), n_selected);
+
+        if (ImGui::BeginChild("events", { -FLT_MIN, ImGui::GetTextLineHeightWithSpacing() * 16 }, ImGuiChildFlags_FrameStyle)) {
+            ImGuiSelectionExternalStorage storage;
+
+            storage.UserData = (void*)this;
+            storage.AdapterSetItemSelected = [](ImGuiSelectionExternalStorage *self, int idx, bool on) {
+                Profile_Config_Window *win = (Profile_Config_Window*)self->UserData;
+                win->selected[win->matches[idx]] = on;
+            };
+
+            ImGuiMultiSelectIO *ms = ImGui::BeginMultiSelect(ImGuiMultiSelectFlags_ClearOnEscape | ImGuiMultiSelectFlags_BoxSelect1d,
+                                                             n_selected, this->matches.size());
+            storage.ApplyRequests(ms);
+
+            ImGuiListClipper clipper;
+            clipper.Begin(this->matches.size());
+            if (ms->RangeSrcItem != -1) {
+                clipper.IncludeItemByIndex((int)ms->RangeSrcItem);
+            }
+            while (clipper.Step()) {
+                for (int i = clipper.DisplayStart; i < clipper.DisplayEnd; i += 1) {
+                    u32 e = this->matches[i];
+
+                    ImGui::PushID(i);
+                    ImGui::SetNextItemSelectionUserData(i);
+                    ImGui::Selectable(this->events.names[e].c_str(), this->selected[e]);
+                    if (this->events.source_names.size() > 1 && ImGui::IsItemHovered()) {
+                        ImGui::SetTooltip("%s", this->events.source_names[this->events.source[e]].c_str());
+                    }
+                    ImGui::PopID();
+                }
+            }
+
+            ms = ImGui::EndMultiSelect();
+            storage.ApplyRequests(ms);
+        }
+        ImGui::EndChild();
+    }
+
+    /* Keeps the selected events selected, by name. */
+    void config_changed() {
+        std::vector<std::string> keep;
+
+        for (size_t i = 0; i < this->selected.size(); i += 1) {
+            if (this->selected[i]) { keep.push_back(this->events.names[i]); }
+        }
 
-                int cur_item = 0;
-                ImGui::ListBox("", &cur_item, item_fn, (void*)&source, source.events.size());
+        this->events.build(this->config);
+        this->selected.assign(this->events.size(), 0);
 
-                ImGui::TreePop();
+        for (auto &name : keep) {
+            auto it = std::find(this->events.names.begin(), this->events.names.end(), name);
+            if (it != this->events.names.end()) {
+                this->selected[it - this->events.names.begin()] = 1;
             }
         }
+
+        this->filtered_query.clear();
+        this->events.filter(this->query, this->matches);
+        this->filtered_query = this->query;
     }
 
-    Profile_Config_Window(const Profile_Config &config) : UI_Float_Window_Base("Profile Config"), config(config) {}
+    Monitor_Request monitor_request() const {
+        Monitor_Request out;
+
+        out.counters_per_group = this->counters_per_group;
+        out.time_slice_ms      = this->time_slice_ms;
+
+        for (size_t i = 0; i < this->selected.size(); i += 1) {
+            if (this->selected[i]) {
+                out.events.push_back(this->events.names[i]);
+            }
+        }
+
+        return out;
+    }
+
+    Profile_Config_Window(const Profile_Config &config) : UI_Float_Window_Base("Profile Config"), config(config) {
+        this->config_changed();
+    }
 };
 
 struct UI_Main_Tab {
@@ -424,20 +1485,177 @@ struct UI {
         this->connected = con;
     }
 
-    void set_heatmap(std::vector<float> &&data) {
-        UI_Main_Tab &tab = this->tabs["Profile"];
+    void set_heatmap(Monitor_Data &&monitor) {
+        this->heatmap = std::move(monitor);
+        this->show_heatmap(this->get_profile_config_win()->rollup_level);
+    }
+
+    /*
+     * One heat map per event, with a cell per CPU thread, or per core, cache
+     * or socket with the thread values rolled up along the topology.
+     */
+    void show_heatmap(int level) {
+        static constexpr Resource_Type level_types[] = {
+            Resource_Type::CPU_THREAD,
+            Resource_Type::CPU_CORE,
+            Resource_Type::SHARED_CACHE,
+            Resource_Type::SOCKET,
+            Resource_Type::ROOT,
+        };
+
+        UI_Main_Tab        &tab      = this->tabs["Profile"];
+        const Monitor_Data &monitor  = this->heatmap;
+        size_t              n_events = monitor.events.size();
+
+        /* Same events at the same level: update the widgets in place, so their textures only get what changed. */
+        bool reuse = level == this->heatmap_level && monitor.events == this->heatmap_events
+                  && this->heatmap_widgets.size() == n_events;
+
+        if (!reuse) {
+            tab.clear();
+            this->heatmap_widgets.clear();
+
+            for (size_t e = 0; e < n_events; e += 1) {
+                auto h = std::make_unique<UI_SSO_Heat_Map_Widget>();
+
+                h->title = monitor.events[e];
+
+                this->heatmap_widgets.push_back(h.get());
+                tab.widgets.push_back(std::move(h));
+            }
+
+            this->heatmap_level  = level;
+            this->heatmap_events = monitor.events;
+        }
+
+        if (level <= 0 || level >= (int)std::size(level_types)) {
+            for (size_t e = 0; e < n_events; e += 1) {
+                UI_SSO_Heat_Map_Widget *h = this->heatmap_widgets[e];
+
+                std::vector<float> data;
+                h->confidence.clear();
+                for (size_t t = 0; t < monitor.threads.size(); t += 1) {
+                    data.push_back(monitor.at(t, e));
+                    h->confidence.push_back(monitor.confidence_at(t, e));
+                }
+
+                h->labels = monitor.threads;
+                h->set_data(std::move(data));
+            }
+            return;
+        }
+
+        if (monitor.values.size() != monitor.cpus.size() * n_events) { return; }
+
+        const Flat_Topology &flat = this->topo.flat;
+        std::vector<s32>     rows = flat.rows_for(monitor.cpus);
+        std::vector<u64>     values;
+        std::vector<f32>     confidence;
+        std::vector<u32>     present(monitor.cpus.size(), 1);
+        std::vector<u32>     monitored;
+
+        flat.roll_up(monitor.values.data(), n_events, rows, values);
+        flat.roll_up(monitor.confidence.data(), n_events, rows, confidence);
+
+        /* Confidence is averaged over the threads that were monitored, not all the threads below a node. */
+        flat.roll_up(present.data(), 1, rows, monitored);
+
+        std::vector<u32> cells = flat.of_type(level_types[level]);
+
+        for (size_t e = 0; e < n_events; e += 1) {
+            UI_SSO_Heat_Map_Widget *h = this->heatmap_widgets[e];
+
+            std::vector<float> data;
+            h->confidence.clear();
+            h->labels.clear();
+            for (u32 i : cells) {
+                u32 n = monitored[i];
+
+                data.push_back(values[i * n_events + e]);
+                h->confidence.push_back(n ? confidence[i * n_events + e] / n : 0.0f);
+                h->labels.push_back(flat.name(i));
+            }
+
+            h->set_data(std::move(data));
+        }
+    }
+
+    void start_live_monitor(Monitor_Stream_Header &&header) {
+        UI_Main_Tab &tab = this->tabs["Live"];
 
         tab.clear();
 
-        auto h = std::make_unique<UI_SSO_Heat_Map_Widget>();
+        auto w = std::make_unique<UI_Live_Monitor_Widget>(std::move(header));
+
+        this->live_monitor = w.get();
+
+        tab.widgets.push_back(std::move(w));
+    }
+
+    void add_live_monitor_batch(Monitor_Stream_Batch &&batch) {
+        if (this->live_monitor) {
+            this->live_monitor->add_batch(batch);
+        }
+    }
+
+    void add_live_monitor_aggregate(Monitor_Aggregate_Batch &&batch) {
+        if (this->live_monitor) {
+            this->live_monitor->add_aggregate(batch);
+        }
+    }
+
+    /* The first delta of a session starts a fresh flame graph. */
+    void add_stack_delta(Stack_Trie_Delta &&delta) {
+        if (delta.seq == 0 || this->flame_graph == NULL) {
+            UI_Main_Tab &tab = this->tabs["Stacks"];
 
-        h->set_data(std::move(data));
+            tab.clear();
 
-        tab.widgets.push_back(std::move(h));
+            auto w = std::make_unique<UI_Flame_Graph_Widget>(this->symbols);
+
+            this->flame_graph = w.get();
+
+            tab.widgets.push_back(std::move(w));
+        }
+
+        if (!this->symbols.add(delta) || !this->flame_graph->add_delta(delta)) {
+            this->log(Log_Severity::ERROR, "stack profile out of sync at delta " + std::to_string(delta.seq), true);
+        }
+    }
+
+    /*
+     * Blocks until there is input, a message from the server (the link posts
+     * an empty event), or a timeout, then lets a few frames through: imgui
+     * often needs a frame after the one that saw an event to settle (hover
+     * states, windows appearing). An idle client wakes only for the caret
+     * blink or a pending tooltip, and otherwise about once a second.
+     */
+    void wait_for_events() {
+        static constexpr int    SETTLE_FRAMES = 3;
+        static constexpr double IDLE_TIMEOUT  = 1.0;
+        static constexpr double BLINK_TIMEOUT = 0.5;
+        static constexpr double HOVER_TIMEOUT = 0.1;
+
+        if (this->frames_pending > 0) {
+            this->frames_pending -= 1;
+            glfwPollEvents();
+            return;
+        }
+
+        double timeout = IDLE_TIMEOUT;
+
+        if (this->imgui_io.WantTextInput)  { timeout = BLINK_TIMEOUT; }
+        if (ImGui::IsAnyItemHovered())     { timeout = HOVER_TIMEOUT; }
+
+        glfwWaitEventsTimeout(timeout);
+
+        this->frames_pending = SETTLE_FRAMES - 1;
     }
 
     void frame() {
-        glfwPollEvents();
+        if (!this->heatmap.events.empty() && this->get_profile_config_win()->rollup_level != this->heatmap_level) {
+            this->show_heatmap(this->get_profile_config_win()->rollup_level);
+        }
 
         // Start ImGui frame
         ImGui_ImplOpenGL3_NewFrame();
@@ -457,7 +1675,36 @@ struct UI {
                 }
                 if (ImGui::BeginMenu("Request")) {
                     if (ImGui::MenuItem("Profile data")) {
-                        this->ssh_link.send("REQUEST/HEATMAP-DATA");
+                        this->ssh_link.request(Link_Op::HEATMAP_REQUEST, this->get_profile_config_win()->monitor_request().to_serialized());
+                    }
+                    if (ImGui::MenuItem("Start live monitor")) {
+                        Monitor_Stream_Request request;
+
+                        request.counters    = this->get_profile_config_win()->monitor_request();
+                        request.interval_us = this->get_profile_config_win()->monitor_interval_ms * 1000;
+                        request.bucket_ns   = (u64)this->get_profile_config_win()->monitor_bucket_ms * 1000000;
+                        request.histograms  = this->get_profile_config_win()->monitor_histograms;
+
+                        this->ssh_link.request(Link_Op::MONITOR_START, request.to_serialized());
+                    }
+                    if (ImGui::MenuItem("Stop live monitor")) {
+                        this->ssh_link.request(Link_Op::MONITOR_STOP);
+                    }
+                    if (ImGui::MenuItem("Start stack profile")) {
+                        Stack_Profile_Request request;
+                        Monitor_Request       events = this->get_profile_config_win()->monitor_request();
+
+                        /* The first selected event, if any; otherwise the server picks. */
+                        if (!events.events.empty()) {
+                            request.event = events.events[0];
+                        }
+                        request.frequency = this->get_profile_config_win()->profile_frequency;
+
+                        this->ssh_link.request(Link_Op::PROFILE_START, request.to_serialized());
+                        this->focus_tab("Stacks");
+                    }
+                    if (ImGui::MenuItem("Stop stack profile")) {
+                        this->ssh_link.request(Link_Op::PROFILE_STOP);
                     }
                     ImGui::EndMenu();
                 }
@@ -484,23 +1731,38 @@ struct UI {
 
                     ImGui::BeginChild("Left-Top", { -FLT_MIN, top_height }, 0);
 
-                    std::function<void(const Topology_Node&)> topo_node;
-                    topo_node = [&](const Topology_Node &node) {
+                    const Flat_Topology &flat = this->topo.flat;
+
+                    /* Pre-order, so a closed node's subtree is the run of deeper entries after it. */
+                    int open = 0;
+                    for (size_t k = 0; k < this->tree_nodes.size(); k += 1) {
+                        u32 i     = this->tree_nodes[k];
+                        int depth = this->tree_depth[k];
+
+                        if (depth > open) { continue; }
+
+                        for (; open > depth; open -= 1) {
+                            ImGui::TreePop();
+                        }
+
                         ImGuiTreeNodeFlags tree_node_flags = ImGuiTreeNodeFlags_OpenOnDoubleClick |
                                                              ImGuiTreeNodeFlags_OpenOnArrow |
                                                              ImGuiTreeNodeFlags_NavLeftJumpsBackHere;
-                        if (node.subnodes.empty()) {
-                            tree_node_flags |= ImGuiTreeNodeFlags_Leaf;
+                        if (flat.n_children[i] == 0) {
+                            tree_node_flags |= ImGuiTreeNodeFlags_Leaf | ImGuiTreeNodeFlags_NoTreePushOnOpen;
                         }
-                        if (ImGui::TreeNodeEx(node.name.c_str(), tree_node_flags)) {
-                            for (auto &pair : node.subnodes) {
-                                topo_node(pair.second);
-                            }
-                            ImGui::TreePop();
-                        }
-                    };
 
-                    topo_node(this->topo);
+                        ImGui::PushID(i);
+                        bool is_open = ImGui::TreeNodeEx(flat.name(i).c_str(), tree_node_flags);
+                        ImGui::PopID();
+
+                        if (is_open && flat.n_children[i] > 0) {
+                            open = depth + 1;
+                        }
+                    }
+                    for (; open > 0; open -= 1) {
+                        ImGui::TreePop();
+                    }
 
                     ImGui::EndChild();
 
@@ -565,13 +1827,52 @@ struct UI {
         return !!glfwWindowShouldClose(this->glfw_window);
     }
 
+    /* Without a severity, messages that pop the log up are warnings. */
     void log(std::string &&message, bool pop_up = false) {
-        this->get_log()->items.push_back(message);
+        this->log(pop_up ? Log_Severity::WARNING : Log_Severity::INFO, std::move(message), pop_up);
+    }
+
+    void log(Log_Severity severity, std::string &&message, bool pop_up = false) {
+        this->get_log()->ring.add(severity, message);
         if (pop_up) {
             this->get_log()->show = true;
         }
     }
 
+    void config_changed() {
+        this->get_profile_config_win()->config_changed();
+    }
+
+    void topology_changed() {
+        const Flat_Topology &flat  = this->topo.flat;
+        std::vector<int>     depth(flat.size(), 0);
+        std::vector<u32>     stack;
+
+        /* Breadth-first, so parents come first. */
+        for (u32 i = 1; i < flat.size(); i += 1) {
+            depth[i] = depth[flat.parent[i]] + 1;
+        }
+
+        this->tree_nodes.clear();
+        this->tree_depth.clear();
+
+        if (flat.size()) { stack.push_back(0); }
+
+        while (!stack.empty()) {
+            u32 i = stack.back();
+            stack.pop_back();
+
+            this->tree_nodes.push_back(i);
+            this->tree_depth.push_back(depth[i]);
+
+            for (u32 c = flat.first_child[i] + flat.n_children[i]; c-- > flat.first_child[i];) {
+                stack.push_back(c);
+            }
+        }
+
+        this->topology_widget->topology_changed();
+    }
+
     void focus_tab(std::string tab_name) {
         this->tabs[tab_name].focus_requested = true;
     }
@@ -586,6 +1887,17 @@ private:
     std::map<std::string, UI_Main_Tab>                            tabs;
     std::map<std::string, std::unique_ptr<UI_Float_Window_Base>>  float_windows;
     bool                                                          connected = false;
+    UI_Live_Monitor_Widget                                       *live_monitor = NULL;
+    UI_Flame_Graph_Widget                                        *flame_graph  = NULL;
+    UI_Topology_Widget                                           *topology_widget = NULL;
+    std::vector<u32>                                              tree_nodes;   /* The sidebar tree, in pre-order. */
+    std::vector<int>                                              tree_depth;
+    Symbol_Store                                                  symbols;
+    Monitor_Data                                                  heatmap;
+    int                                                           heatmap_level = 0;
+    std::vector<std::string>                                      heatmap_events;     /* What heatmap_widgets show. */
+    std::vector<UI_SSO_Heat_Map_Widget*>                          heatmap_widgets;    /* One per event, owned by the "Profile" tab. */
+    int                                                           frames_pending = 0;
 
     UI(SSH_Link_Client &ssh_link, const Profile_Config &config, const Topology &topo)
             : ssh_link(ssh_link), config(config), topo(topo), imgui_io(ImGui::GetIO()) {
@@ -593,7 +1905,9 @@ private:
         ImGui::GetStyle().WindowRounding = 0.0f;
 
         UI_Main_Tab &dash = this->tabs["Dashboard"];
-        dash.add_widget(std::make_unique<UI_Topology_Widget>(this->topo));
+        auto topology_widget = std::make_unique<UI_Topology_Widget>(this->topo);
+        this->topology_widget = topology_widget.get();
+        dash.add_widget(std::move(topology_widget));
 
         this->float_windows["SSH Connection"] = std::make_unique<SSH_Connection_Window>(this->ssh_link);
         this->float_windows["Log"]            = std::make_unique<Log_Window>();
@@ -15,6 +15,23 @@ fi
 HWLOC_INCLUDE="${DIR}/hwloc/include"
 HWLOC_LIB="${DIR}/hwloc/hwloc/.libs/libhwloc.a"
 
+cd ${DIR}
+
+if ! [ -d lz4 ]; then
+    git clone https://github.com/lz4/lz4 || exit $?
+    make -C lz4/lib -j$(nproc) liblz4.a || exit $?
+fi
+
+if ! [ -d zstd ]; then
+    git clone https://github.com/facebook/zstd || exit $?
+    make -C zstd/lib -j$(nproc) libzstd.a || exit $?
+fi
+
+LZ4_INCLUDE="${DIR}/lz4/lib"
+LZ4_LIB="${DIR}/lz4/lib/liblz4.a"
+ZSTD_INCLUDE="${DIR}/zstd/lib"
+ZSTD_LIB="${DIR}/zstd/lib/libzstd.a"
+
 cd ${DIR}/..
 
 SRC=""
@@ -30,13 +47,13 @@ else
     fi
 fi
 
-CPP_FLAGS="--std=c++20 -Wall -Werror ${OPT} -fno-omit-frame-pointer -mno-omit-leaf-frame-pointer -Ishared -Iserver -I${HWLOC_INCLUDE}"
+CPP_FLAGS="--std=c++20 -Wall -Werror ${OPT} -fno-omit-frame-pointer -mno-omit-leaf-frame-pointer -Ishared -Iserver -I${HWLOC_INCLUDE} -I${LZ4_INCLUDE} -I${ZSTD_INCLUDE}"
 
 if [ $(uname) = "Darwin" ]; then
     CPP_FLAGS+=" -I/opt/homebrew/include"
 fi
 
-LD_FLAGS=" ${HWLOC_LIB}"
+LD_FLAGS=" ${HWLOC_LIB} ${LZ4_LIB} ${ZSTD_LIB}"
 if [ $(uname) = "Darwin" ]; then
     LD_FLAGS+=" -framework Foundation -framework IOKit"
 else
@@ -0,0 +1,316 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+
+#include "common.hpp"
+#include "profile.hpp"
+#include "link_protocol.hpp"
+#include "link_message.hpp"
+#include "perf_counters.hpp"
+#include "aggregate.hpp"
+
+namespace {
+
+/*
+ * Live monitor: samples its own counting engine on a fixed interval and hands
+ * columnar batches of ticks to a sink.
+ *
+ * Ticks come from a timerfd armed at an absolute deadline with a fixed period,
+ * so the sampling grid doesn't drift with the time spent reading counters; a
+ * tick that is overrun shows up as extra expirations and is reported as
+ * missed rather than silently stretching the interval.
+ *
+ * A batch is as many ticks as it takes for the fixed per-message cost (link
+ * and message headers, archive length prefixes) to stay under
+ * MAX_OVERHEAD_FRACTION of the bytes sent, but never older than
+ * MAX_BATCH_AGE, so a narrow stream still updates promptly.
+ *
+ * In aggregating mode the ticks never leave the server: they are reduced into
+ * buckets (sum/min/max/count, optionally a histogram, per series) and only
+ * closed buckets are sent, batched by the same rule, with the age cap
+ * stretched to one bucket when buckets are wider than MAX_BATCH_AGE.
+ */
+struct Monitor_Streamer {
+    using Sink           = std::function<void(Monitor_Stream_Batch &&batch)>;
+    using Aggregate_Sink = std::function<void(Monitor_Aggregate_Batch &&batch)>;
+
+    enum class Error {
+        NONE = 0,
+        TIMER,
+        COUNTERS,
+    };
+
+    static constexpr u32    MIN_INTERVAL_US       = 1000;
+    static constexpr f64    MAX_OVERHEAD_FRACTION = 0.02;
+    static constexpr auto   MAX_BATCH_AGE         = std::chrono::milliseconds(100);
+    static constexpr size_t BATCH_OVERHEAD        = LINK_FRAME_HEADER_SIZE + LINK_MESSAGE_HEADER_SIZE
+                                                  + 2 * sizeof(u64)     /* seq, missed        */
+                                                  + 3 * sizeof(u64);    /* vector size fields */
+    static constexpr size_t AGGREGATE_OVERHEAD    = LINK_FRAME_HEADER_SIZE + LINK_MESSAGE_HEADER_SIZE
+                                                  + 4 * sizeof(u64) + sizeof(u32)
+                                                  + 7 * sizeof(u64);
+
+private:
+    Perf_Counting_Engine          counters;
+    std::thread                   thr;
+    int                           timer_fd = -1;
+    int                           stop_fd  = -1;
+    u64                           interval_ns     = 0;
+    size_t                        ticks_per_batch = 1;
+    size_t                        buckets_per_batch = 1;
+    Sink                          sink;
+    Aggregate_Sink                aggregate_sink;
+    std::string                   _error_string;
+
+    /* Sampler thread only. */
+    std::vector<std::vector<u64>> series;
+    std::vector<std::vector<f32>> series_confidence;
+    std::vector<u64>              row;
+    std::vector<f32>              row_confidence;
+    Monitor_Stream_Batch          batch;
+    Bucket_Aggregator             aggregator;
+    Monitor_Aggregate_Batch       aggregate;
+
+    Error fail(Error error, std::string &&what) {
+        this->_error_string = what + ": " + strerror(errno);
+        this->close_fds();
+        this->counters.close();
+        return error;
+    }
+
+    void close_fds() {
+        if (this->timer_fd >= 0) { ::close(this->timer_fd); this->timer_fd = -1; }
+        if (this->stop_fd  >= 0) { ::close(this->stop_fd);  this->stop_fd  = -1; }
+    }
+
+    void flush() {
+        if (this->batch.n_ticks() == 0) { return; }
+
+        for (size_t s = 0; s < this->series.size(); s += 1) {
+            this->batch.values.insert(this->batch.values.end(), this->series[s].begin(), this->series[s].end());
+            this->batch.confidence.insert(this->batch.confidence.end(), this->series_confidence[s].begin(), this->series_confidence[s].end());
+            this->series[s].clear();
+            this->series_confidence[s].clear();
+        }
+
+        u64 seq = this->batch.seq;
+
+        this->sink(std::move(this->batch));
+
+        this->batch     = Monitor_Stream_Batch();
+        this->batch.seq = seq + 1;
+    }
+
+    void flush_aggregate(bool close_open) {
+        if (!this->aggregator.take(this->aggregate, close_open)) { return; }
+
+        u64 seq = this->aggregate.seq;
+
+        this->aggregate_sink(std::move(this->aggregate));
+
+        this->aggregate     = Monitor_Aggregate_Batch();
+        this->aggregate.seq = seq + 1;
+    }
+
+    static void sampler_thread(Monitor_Streamer &self) {
+        auto start = std::chrono::steady_clock::now();
+
+        struct pollfd fds[2] = {
+            { self.timer_fd, POLLIN, 0 },
+            { self.stop_fd,  POLLIN, 0 },
+        };
+
+        for (;;) {
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) { continue; }
+                break;
+            }
+
+            if (fds[1].revents & POLLIN) { break; }
+            if (!(fds[0].revents & POLLIN)) { continue; }
+
+            u64 expirations = 0;
+            if (read(self.timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) { continue; }
+
+            u64 &missed = self.aggregate_sink ? self.aggregate.missed : self.batch.missed;
+
+            missed += expirations - 1;
+
+            if (self.counters.read_deltas(self.row, self.row_confidence) != Perf_Counting_Engine::Error::NONE) {
+                missed += 1;
+                continue;
+            }
+
+            auto now     = std::chrono::steady_clock::now();
+            u64  time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - start).count();
+
+            if (self.aggregate_sink) {
+                self.aggregator.add_row(time_ns, self.row.data(), self.row_confidence.data());
+
+                if (self.aggregator.closed_buckets() >= self.buckets_per_batch) {
+                    self.flush_aggregate(false);
+                }
+                continue;
+            }
+
+            self.batch.time_ns.push_back(time_ns);
+
+            for (size_t s = 0; s < self.series.size(); s += 1) {
+                self.series[s].push_back(self.row[s]);
+                self.series_confidence[s].push_back(self.row_confidence[s]);
+            }
+
+            if (self.batch.n_ticks() >= self.ticks_per_batch) {
+                self.flush();
+            }
+        }
+
+        if (self.aggregate_sink) {
+            self.flush_aggregate(true);
+        } else {
+            self.flush();
+        }
+    }
+
+    Error open_counters(const std::vector<Perf_Event_Spec> &events, const std::vector<int> &cpus,
+                        const Perf_Counting_Engine::Options &options, u32 interval_us) {
+        this->stop();
+
+        this->_error_string.clear();
+
+        if (this->counters.open(events, cpus, options) != Perf_Counting_Engine::Error::NONE) {
+            this->_error_string = this->counters.error_string();
+            return Error::COUNTERS;
+        }
+
+        this->interval_ns    = (u64)std::max(interval_us, MIN_INTERVAL_US) * 1000;
+        this->sink           = Sink();
+        this->aggregate_sink = Aggregate_Sink();
+
+        return Error::NONE;
+    }
+
+    size_t n_series() const { return this->counters.cpus().size() * this->counters.get_events().size(); }
+
+public:
+    Monitor_Streamer()                                   = default;
+    Monitor_Streamer(const Monitor_Streamer&)            = delete;
+    Monitor_Streamer& operator=(const Monitor_Streamer&) = delete;
+
+    ~Monitor_Streamer() { this->stop(); }
+
+    bool                                is_running() const { return this->thr.joinable(); }
+    const std::string                  &error_string() const { return this->_error_string; }
+    const Perf_Counting_Engine         &get_counters() const { return this->counters; }
+    u64                                 get_interval_ns() const { return this->interval_ns; }
+    size_t                              get_ticks_per_batch() const { return this->ticks_per_batch; }
+    size_t                              get_buckets_per_batch() const { return this->buckets_per_batch; }
+
+    /*
+     * Starts sampling into the sink given to open(). Kept apart from open() so
+     * that whatever announces the stream (e.g. its header) can be sent first:
+     * the sink may be called as soon as this returns.
+     */
+    Error run() {
+        this->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        if (this->timer_fd < 0) { return this->fail(Error::TIMER, "timerfd_create"); }
+
+        this->stop_fd = eventfd(0, EFD_CLOEXEC);
+        if (this->stop_fd < 0) { return this->fail(Error::TIMER, "eventfd"); }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        u64 first = (u64)now.tv_sec * 1000000000ull + now.tv_nsec + this->interval_ns;
+
+        struct itimerspec spec;
+        spec.it_value.tv_sec     = first / 1000000000ull;
+        spec.it_value.tv_nsec    = first % 1000000000ull;
+        spec.it_interval.tv_sec  = this->interval_ns / 1000000000ull;
+        spec.it_interval.tv_nsec = this->interval_ns % 1000000000ull;
+
+        if (timerfd_settime(this->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+            return this->fail(Error::TIMER, "timerfd_settime");
+        }
+
+        this->thr = std::thread(sampler_thread, std::ref(*this));
+
+        return Error::NONE;
+    }
+
+    /* Opens the counters to stream every tick. */
+    Error open(const std::vector<Perf_Event_Spec> &events, const std::vector<int> &cpus,
+               const Perf_Counting_Engine::Options &options, u32 interval_us, Sink &&sink) {
+        Error err = this->open_counters(events, cpus, options, interval_us);
+        if (err != Error::NONE) { return err; }
+
+        this->sink = std::move(sink);
+
+        size_t n_series  = this->n_series();
+        size_t row_bytes = n_series * (sizeof(u64) + sizeof(f32)) + sizeof(u64);
+        size_t by_cost   = (size_t)(BATCH_OVERHEAD / (MAX_OVERHEAD_FRACTION * row_bytes)) + 1;
+        size_t by_age    = std::chrono::duration_cast<std::chrono::nanoseconds>(MAX_BATCH_AGE).count() / this->interval_ns;
+
+        this->ticks_per_batch = std::clamp(by_cost, (size_t)1, std::max(by_age, (size_t)1));
+
+        this->series.assign(n_series, {});
+        this->series_confidence.assign(n_series, {});
+        for (size_t s = 0; s < n_series; s += 1) {
+            this->series[s].reserve(this->ticks_per_batch);
+            this->series_confidence[s].reserve(this->ticks_per_batch);
+        }
+        this->batch = Monitor_Stream_Batch();
+
+        return Error::NONE;
+    }
+
+    /* Opens the counters to stream ticks reduced into buckets of bucket_ns (at least one interval). */
+    Error open(const std::vector<Perf_Event_Spec> &events, const std::vector<int> &cpus,
+               const Perf_Counting_Engine::Options &options, u32 interval_us,
+               u64 bucket_ns, bool histograms, Aggregate_Sink &&sink) {
+        Error err = this->open_counters(events, cpus, options, interval_us);
+        if (err != Error::NONE) { return err; }
+
+        this->aggregate_sink = std::move(sink);
+
+        bucket_ns = std::max(bucket_ns, this->interval_ns);
+
+        /* A histogram adds at least one bin (u16 + u32) and an offset per cell. */
+        size_t n_series     = this->n_series();
+        size_t bucket_bytes = n_series * (3 * sizeof(u64) + sizeof(u32) + (histograms ? 2 * sizeof(u32) + sizeof(u16) : 0));
+        size_t by_cost      = (size_t)(AGGREGATE_OVERHEAD / (MAX_OVERHEAD_FRACTION * bucket_bytes)) + 1;
+        u64    max_age      = std::max((u64)std::chrono::duration_cast<std::chrono::nanoseconds>(MAX_BATCH_AGE).count(), bucket_ns);
+        size_t by_age       = max_age / bucket_ns;
+
+        this->buckets_per_batch = std::clamp(by_cost, (size_t)1, std::max(by_age, (size_t)1));
+
+        this->aggregator.reset(n_series, bucket_ns, histograms);
+        this->aggregate = Monitor_Aggregate_Batch();
+
+        return Error::NONE;
+    }
+
+    /* Stops sampling; the ticks (or partial bucket) collected so far still go out as a final batch. */
+    void stop() {
+        if (this->thr.joinable()) {
+            u64 one = 1;
+            if (write(this->stop_fd, &one, sizeof(one)) < 0) {}
+            this->thr.join();
+        }
+
+        this->close_fds();
+        this->counters.close();
+    }
+};
+
+}
@@ -0,0 +1,533 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "common.hpp"
+
+namespace {
+
+/*
+ * Native counting through perf_event_open(2), so that sampling the counters
+ * costs a read() per CPU instead of a fork/exec of perf.
+ *
+ * Event names are resolved the way perf resolves them, minus the vendor JSON
+ * tables that are compiled into the perf binary: the generic hardware and
+ * software names, "pmu/term=value,.../" strings, and named events that a PMU
+ * publishes in sysfs.
+ */
+
+static constexpr const char *PERF_SYSFS_PMUS = "/sys/bus/event_source/devices/";
+
+struct Perf_Event_Spec {
+    std::string name;
+    u32         type    = 0;
+    u64         config  = 0;
+    u64         config1 = 0;
+    u64         config2 = 0;
+};
+
+struct Perf_Generic_Event {
+    const char *name;
+    u32         type;
+    u64         config;
+};
+
+static constexpr Perf_Generic_Event perf_generic_events[] = {
+    { "cycles",                  PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES              },
+    { "cpu-cycles",              PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES              },
+    { "instructions",            PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS            },
+    { "cache-references",        PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES        },
+    { "cache-misses",            PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES            },
+    { "branches",                PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS     },
+    { "branch-instructions",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS     },
+    { "branch-misses",           PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES           },
+    { "bus-cycles",              PERF_TYPE_HARDWARE, PERF_COUNT_HW_BUS_CYCLES              },
+    { "stalled-cycles-frontend", PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_FRONTEND },
+    { "idle-cycles-frontend",    PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_FRONTEND },
+    { "stalled-cycles-backend",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_BACKEND  },
+    { "idle-cycles-backend",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_BACKEND  },
+    { "ref-cycles",              PERF_TYPE_HARDWARE, PERF_COUNT_HW_REF_CPU_CYCLES          },
+    { "cpu-clock",               PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_CLOCK               },
+    { "task-clock",              PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK              },
+    { "page-faults",             PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS             },
+    { "faults",                  PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS             },
+    { "context-switches",        PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES        },
+    { "cs",                      PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES        },
+    { "cpu-migrations",          PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS          },
+    { "migrations",              PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS          },
+    { "minor-faults",            PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MIN         },
+    { "major-faults",            PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MAJ         },
+    { "alignment-faults",        PERF_TYPE_SOFTWARE, PERF_COUNT_SW_ALIGNMENT_FAULTS        },
+    { "emulation-faults",        PERF_TYPE_SOFTWARE, PERF_COUNT_SW_EMULATION_FAULTS        },
+};
+
+/* PMUs whose named events are tried for a bare event name, in order. */
+static constexpr const char *perf_core_pmus[] = { "cpu", "cpu_core", "cpu_atom", "armv8_pmuv3" };
+
+inline bool perf_read_sysfs(const std::string &path, std::string &out) {
+    std::ifstream f(path);
+    if (!f) { return false; }
+
+    std::getline(f, out);
+
+    return true;
+}
+
+/*
+ * Applies "term=value" to the spec using the PMU's format description, e.g.
+ * format/umask = "config:8-15". A field may be split over several bit ranges,
+ * which are filled from the value's low bits up.
+ */
+inline bool perf_apply_term(const std::string &pmu, const std::string &term, u64 value, Perf_Event_Spec &spec) {
+    std::string format;
+
+    if (!perf_read_sysfs(PERF_SYSFS_PMUS + pmu + "/format/" + term, format)) { return false; }
+
+    size_t colon = format.find(':');
+    if (colon == std::string::npos) { return false; }
+
+    std::string field = format.substr(0, colon);
+    u64        *dst;
+
+    if      (field == "config")  { dst = &spec.config;  }
+    else if (field == "config1") { dst = &spec.config1; }
+    else if (field == "config2") { dst = &spec.config2; }
+    else                         { return false;        }
+
+    std::stringstream ranges(format.substr(colon + 1));
+    std::string       range;
+    int               shift = 0;
+
+    while (std::getline(ranges, range, ',')) {
+        int lo = 0;
+        int hi = 0;
+
+        if (sscanf(range.c_str(), "%d-%d", &lo, &hi) == 1) { hi = lo; }
+        if (lo < 0 || hi > 63 || hi < lo) { return false; }
+
+        for (int bit = lo; bit <= hi; bit += 1, shift += 1) {
+            if ((value >> shift) & 1) { *dst |= 1ull << bit; }
+        }
+    }
+
+    return true;
+}
+
+/* Parses "a=0x1,b=2,c" (a missing value means 1). */
+inline bool perf_apply_terms(const std::string &pmu, const std::string &terms, Perf_Event_Spec &spec) {
+    std::stringstream ss(terms);
+    std::string       term;
+
+    while (std::getline(ss, term, ',')) {
+        if (term.empty()) { continue; }
+
+        size_t      eq    = term.find('=');
+        std::string name  = term.substr(0, eq);
+        u64         value = 1;
+
+        if (eq != std::string::npos) {
+            errno = 0;
+            value = strtoull(term.c_str() + eq + 1, NULL, 0);
+            if (errno) { return false; }
+        }
+
+        if (!perf_apply_term(pmu, name, value, spec)) {
+            /* Maybe it names one of the PMU's events, as in "cpu/mem-loads/". */
+            std::string alias;
+            if (eq != std::string::npos || !perf_read_sysfs(PERF_SYSFS_PMUS + pmu + "/events/" + name, alias)) {
+                return false;
+            }
+            if (!perf_apply_terms(pmu, alias, spec)) { return false; }
+        }
+    }
+
+    return true;
+}
+
+inline bool perf_resolve_pmu_event(const std::string &pmu, const std::string &terms, Perf_Event_Spec &spec) {
+    std::string type;
+
+    if (!perf_read_sysfs(PERF_SYSFS_PMUS + pmu + "/type", type)) { return false; }
+
+    spec.type    = strtoul(type.c_str(), NULL, 10);
+    spec.config  = 0;
+    spec.config1 = 0;
+    spec.config2 = 0;
+
+    return perf_apply_terms(pmu, terms, spec);
+}
+
+inline bool perf_resolve_event(const std::string &name, Perf_Event_Spec &spec) {
+    spec      = {};
+    spec.name = name;
+
+    for (auto &generic : perf_generic_events) {
+        if (name == generic.name) {
+            spec.type   = generic.type;
+            spec.config = generic.config;
+            return true;
+        }
+    }
+
+    /* "pmu/terms/" */
+    if (size_t slash = name.find('/'); slash != std::string::npos) {
+        size_t end = name.find('/', slash + 1);
+        if (end == std::string::npos) { return false; }
+
+        return perf_resolve_pmu_event(name.substr(0, slash), name.substr(slash + 1, end - slash - 1), spec);
+    }
+
+    std::string terms;
+    for (const char *pmu : perf_core_pmus) {
+        if (perf_read_sysfs(std::string(PERF_SYSFS_PMUS) + pmu + "/events/" + name, terms)) {
+            return perf_resolve_pmu_event(pmu, terms, spec);
+        }
+    }
+
+    return false;
+}
+
+/* All events are system-wide on one CPU, i.e. pid == -1. */
+inline int perf_event_open(struct perf_event_attr *attr, int cpu, int group_fd) {
+    return syscall(SYS_perf_event_open, attr, -1, cpu, group_fd, PERF_FLAG_FD_CLOEXEC);
+}
+
+/*
+ * Counting with more events than the PMU has counters.
+ *
+ * The requested events are packed into groups of at most counters_per_group
+ * events that can share a PMU. Every CPU gets the same set of groups, each
+ * read with one PERF_FORMAT_GROUP read(). Software events need no hardware
+ * counter and stay enabled. If more than one hardware group is needed, a
+ * rotation thread enables them one at a time for time_slice each.
+ *
+ * Each read reports, per CPU and event:
+ * - the count scaled up to the whole interval (count * wall / time_running);
+ * - the confidence, i.e. the fraction of the interval the event was counted.
+ *
+ * An event a CPU can't count (e.g. on the other core type of a hybrid part)
+ * is left out of that CPU's group and reads as zero with zero confidence.
+ */
+struct Perf_Counting_Engine {
+    enum class Error {
+        NONE = 0,
+        NO_EVENTS,
+        OPEN,
+        ENABLE,
+        READ,
+    };
+
+    struct Options {
+        size_t                    counters_per_group = 4;
+        std::chrono::milliseconds time_slice         = std::chrono::milliseconds(10);
+    };
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    /* A set of events scheduled together; the same on every CPU. */
+    struct Schedule_Slot {
+        std::vector<int> events;
+        bool             rotates;
+    };
+
+    struct Group {
+        int              row;            /* Index of the CPU in cpus.                   */
+        size_t           slot;
+        std::vector<int> fds;            /* fds[0] is the leader.                       */
+        std::vector<int> members;        /* Event index of each group member.           */
+        std::vector<u64> last;           /* Previous raw value of each member.          */
+        u64              last_running = 0;
+    };
+
+    std::vector<Perf_Event_Spec> events;
+    std::vector<Schedule_Slot>   slots;
+    std::vector<int>             rotating;   /* Indices of the slots that take turns. */
+    std::vector<int>             _cpus;
+    std::vector<Group>           groups;
+    std::vector<u64>             read_buffer;
+    std::vector<std::string>     _unavailable;
+    std::string                  _error_string;
+    Options                      options;
+    Clock::time_point            last_read;
+
+    std::thread                  rotator;
+    std::mutex                   rotator_mtx;
+    std::condition_variable      rotator_cv;
+    bool                         rotator_stop = false;
+
+    Error fail(Error error, std::string &&what) {
+        this->_error_string = what + ": " + strerror(errno);
+        this->close();
+        return error;
+    }
+
+    /* Events on the core PMU can share a group whichever way they were named. */
+    static u32 pmu_key(const Perf_Event_Spec &spec) {
+        switch (spec.type) {
+            case PERF_TYPE_HARDWARE:
+            case PERF_TYPE_HW_CACHE:
+            case PERF_TYPE_RAW:
+                return PERF_TYPE_RAW;
+            default:
+                return spec.type;
+        }
+    }
+
+    void pack(size_t counters_per_group) {
+        std::vector<u32> keys;
+
+        this->slots.clear();
+        this->rotating.clear();
+
+        for (size_t e = 0; e < this->events.size(); e += 1) {
+            bool software = this->events[e].type == PERF_TYPE_SOFTWARE;
+            u32  key      = pmu_key(this->events[e]);
+            bool placed   = false;
+
+            for (size_t s = 0; s < this->slots.size() && !placed; s += 1) {
+                if (keys[s] != key) { continue; }
+                if (!software && this->slots[s].events.size() >= counters_per_group) { continue; }
+
+                this->slots[s].events.push_back(e);
+                placed = true;
+            }
+
+            if (!placed) {
+                this->slots.push_back({ { (int)e }, !software });
+                keys.push_back(key);
+            }
+        }
+
+        for (size_t s = 0; s < this->slots.size(); s += 1) {
+            if (this->slots[s].rotates) {
+                this->rotating.push_back(s);
+            }
+        }
+
+        /* A single hardware group has the counters to itself. */
+        if (this->rotating.size() == 1) {
+            this->slots[this->rotating[0]].rotates = false;
+            this->rotating.clear();
+        }
+    }
+
+    void set_slot_enabled(size_t slot, bool enabled) {
+        for (auto &group : this->groups) {
+            if (group.slot == slot) {
+                ioctl(group.fds[0], enabled ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+            }
+        }
+    }
+
+    static void rotator_thread(Perf_Counting_Engine &self) {
+        size_t current = 0;
+
+        std::unique_lock<std::mutex> lock(self.rotator_mtx);
+
+        self.set_slot_enabled(self.rotating[current], true);
+
+        while (!self.rotator_cv.wait_for(lock, self.options.time_slice, [&self] { return self.rotator_stop; })) {
+            self.set_slot_enabled(self.rotating[current], false);
+            current = (current + 1) % self.rotating.size();
+            self.set_slot_enabled(self.rotating[current], true);
+        }
+
+        self.set_slot_enabled(self.rotating[current], false);
+    }
+
+public:
+    Perf_Counting_Engine()                                       = default;
+    Perf_Counting_Engine(const Perf_Counting_Engine&)            = delete;
+    Perf_Counting_Engine& operator=(const Perf_Counting_Engine&) = delete;
+
+    ~Perf_Counting_Engine() { this->close(); }
+
+    const std::vector<Perf_Event_Spec> &get_events() const { return this->events; }
+    const std::string                  &error_string() const { return this->_error_string; }
+    const std::vector<std::string>     &unavailable() const { return this->_unavailable; }
+    bool                                is_open() const { return !this->groups.empty(); }
+    size_t                              n_groups() const { return this->slots.size(); }
+    size_t                              n_rotating() const { return this->rotating.size(); }
+
+    /* CPUs in the order rows are returned by read_deltas(). */
+    const std::vector<int>             &cpus() const { return this->_cpus; }
+
+    Error open(const std::vector<Perf_Event_Spec> &events, const std::vector<int> &cpus) {
+        return this->open(events, cpus, Options());
+    }
+
+    Error open(const std::vector<Perf_Event_Spec> &events, const std::vector<int> &cpus, const Options &options) {
+        this->close();
+
+        if (events.empty() || cpus.empty()) { return Error::NO_EVENTS; }
+
+        this->events  = events;
+        this->_cpus   = cpus;
+        this->options = options;
+
+        this->pack(std::max(options.counters_per_group, (size_t)1));
+
+        std::vector<bool> opened(events.size(), false);
+        size_t            max_members = 0;
+
+        for (size_t row = 0; row < cpus.size(); row += 1) {
+            for (size_t s = 0; s < this->slots.size(); s += 1) {
+                Group group;
+
+                group.row  = row;
+                group.slot = s;
+
+                for (int e : this->slots[s].events) {
+                    struct perf_event_attr attr;
+
+                    memset(&attr, 0, sizeof(attr));
+                    attr.size        = sizeof(attr);
+                    attr.type        = events[e].type;
+                    attr.config      = events[e].config;
+                    attr.config1     = events[e].config1;
+                    attr.config2     = events[e].config2;
+                    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+                    attr.disabled    = group.fds.empty();
+
+                    int fd = perf_event_open(&attr, cpus[row], group.fds.empty() ? -1 : group.fds[0]);
+                    if (fd < 0) {
+                        if (errno == EACCES || errno == EPERM) {
+                            return this->fail(Error::OPEN, "perf_event_open(" + events[e].name + ", cpu " + std::to_string(cpus[row]) + ")");
+                        }
+                        continue;
+                    }
+
+                    group.fds.push_back(fd);
+                    group.members.push_back(e);
+                    opened[e] = true;
+                }
+
+                if (!group.fds.empty()) {
+                    group.last.assign(group.members.size(), 0);
+                    max_members = std::max(max_members, group.members.size());
+                    this->groups.push_back(std::move(group));
+                }
+            }
+        }
+
+        if (this->groups.empty()) {
+            errno = ENOENT;
+            return this->fail(Error::OPEN, "none of the events could be opened");
+        }
+
+        for (size_t e = 0; e < events.size(); e += 1) {
+            if (!opened[e]) {
+                this->_unavailable.push_back(events[e].name);
+            }
+        }
+
+        this->read_buffer.resize(3 + max_members);
+
+        for (size_t s = 0; s < this->slots.size(); s += 1) {
+            if (this->slots[s].rotates) { continue; }
+            for (auto &group : this->groups) {
+                if (group.slot == s && ioctl(group.fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) < 0) {
+                    return this->fail(Error::ENABLE, "PERF_EVENT_IOC_ENABLE");
+                }
+            }
+        }
+
+        this->last_read = Clock::now();
+
+        if (!this->rotating.empty()) {
+            this->rotator_stop = false;
+            this->rotator      = std::thread(rotator_thread, std::ref(*this));
+        }
+
+        return Error::NONE;
+    }
+
+    void close() {
+        if (this->rotator.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(this->rotator_mtx);
+                this->rotator_stop = true;
+            }
+            this->rotator_cv.notify_one();
+            this->rotator.join();
+        }
+
+        for (auto &group : this->groups) {
+            for (int fd : group.fds) {
+                ::close(fd);
+            }
+        }
+        this->groups.clear();
+        this->slots.clear();
+        this->rotating.clear();
+        this->events.clear();
+        this->_cpus.clear();
+        this->_unavailable.clear();
+    }
+
+    /*
+     * Fills values with one row per CPU and one column per event: the count
+     * since the previous call (or since open()), scaled to the full interval.
+     * confidence has the same shape and holds the fraction of the interval
+     * each estimate was actually measured for.
+     */
+    Error read_deltas(std::vector<u64> &values, std::vector<f32> &confidence) {
+        size_t n_events = this->events.size();
+        auto   now      = Clock::now();
+        u64    wall     = std::chrono::duration_cast<std::chrono::nanoseconds>(now - this->last_read).count();
+
+        this->last_read = now;
+
+        values.assign(this->_cpus.size() * n_events, 0);
+        confidence.assign(this->_cpus.size() * n_events, 0.0f);
+
+        for (auto &group : this->groups) {
+            size_t size = (3 + group.fds.size()) * sizeof(u64);
+
+            /* { nr, time_enabled, time_running, value[nr] } */
+            ssize_t n = read(group.fds[0], this->read_buffer.data(), size);
+            if (n != (ssize_t)size) {
+                this->_error_string = "read(cpu " + std::to_string(this->_cpus[group.row]) + "): " + strerror(errno);
+                return Error::READ;
+            }
+
+            u64 running = this->read_buffer[2] - group.last_running;
+            u64 nr      = std::min<u64>(this->read_buffer[0], group.members.size());
+
+            group.last_running = this->read_buffer[2];
+
+            for (u64 i = 0; i < nr; i += 1) {
+                u64    v     = this->read_buffer[3 + i];
+                u64    delta = v - group.last[i];
+                size_t at    = group.row * n_events + group.members[i];
+
+                group.last[i] = v;
+
+                if (running == 0 || wall == 0) { continue; }
+
+                values[at]     = (u64)((f64)delta * ((f64)wall / (f64)running));
+                confidence[at] = std::min(1.0f, (f32)((f64)running / (f64)wall));
+            }
+        }
+
+        return Error::NONE;
+    }
+};
+
+}
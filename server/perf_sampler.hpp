@@ -0,0 +1,304 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+
+#include "common.hpp"
+#include "profile.hpp"
+#include "perf_counters.hpp"
+
+namespace {
+
+/*
+ * Sample-mode perf events, one per CPU, each with its own mmap'd ring buffer.
+ *
+ * The kernel appends records at data_head and we consume them from data_tail,
+ * decoding straight out of the shared mapping into a Profile_Sample_Batch.
+ * Only a record that straddles the end of the ring is copied (into a scratch
+ * buffer owned by the ring), so the common case touches each byte once.
+ */
+
+static constexpr u64 PERF_SAMPLE_FIELDS = PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME | PERF_SAMPLE_PERIOD;
+
+/* Callchains are capped by the kernel (perf_event_max_stack, 127 by default). */
+static constexpr size_t PERF_MAX_CALLCHAIN = 512;
+
+struct Perf_Sample_Ring {
+private:
+    int                          fd        = -1;
+    void                        *base      = MAP_FAILED;
+    size_t                       map_size  = 0;
+    struct perf_event_mmap_page *meta      = NULL;
+    const char                  *data      = NULL;
+    u64                          data_size = 0;
+    bool                         chains    = false;
+    std::vector<char>            scratch;
+    std::vector<u64>             frames;
+
+    /* Returns the record at offset, copied out only if it wraps. */
+    const char *record_at(u64 offset, u16 size) {
+        u64 start = offset & (this->data_size - 1);
+
+        if (start + size <= this->data_size) {
+            return this->data + start;
+        }
+
+        u64 first = this->data_size - start;
+
+        memcpy(this->scratch.data(),         this->data + start, first);
+        memcpy(this->scratch.data() + first, this->data,         size - first);
+
+        return this->scratch.data();
+    }
+
+public:
+    int  cpu = -1;
+
+    Perf_Sample_Ring()                                   = default;
+    Perf_Sample_Ring(const Perf_Sample_Ring&)            = delete;
+    Perf_Sample_Ring& operator=(const Perf_Sample_Ring&) = delete;
+
+    Perf_Sample_Ring(Perf_Sample_Ring &&other) { *this = std::move(other); }
+
+    Perf_Sample_Ring& operator=(Perf_Sample_Ring &&other) {
+        std::swap(this->fd,        other.fd);
+        std::swap(this->base,      other.base);
+        std::swap(this->map_size,  other.map_size);
+        std::swap(this->meta,      other.meta);
+        std::swap(this->data,      other.data);
+        std::swap(this->data_size, other.data_size);
+        std::swap(this->chains,    other.chains);
+        std::swap(this->scratch,   other.scratch);
+        std::swap(this->frames,    other.frames);
+        std::swap(this->cpu,       other.cpu);
+        return *this;
+    }
+
+    ~Perf_Sample_Ring() { this->close(); }
+
+    int get_fd() const { return this->fd; }
+
+    /* data_pages must be a power of two. */
+    bool open(struct perf_event_attr &attr, int cpu, size_t data_pages) {
+        size_t page = sysconf(_SC_PAGESIZE);
+
+        this->cpu    = cpu;
+        this->chains = attr.sample_type & PERF_SAMPLE_CALLCHAIN;
+        this->fd     = perf_event_open(&attr, cpu, -1);
+        if (this->fd < 0) { return false; }
+
+        this->map_size = (1 + data_pages) * page;
+        this->base     = mmap(NULL, this->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, this->fd, 0);
+        if (this->base == MAP_FAILED) {
+            this->close();
+            return false;
+        }
+
+        this->meta = (struct perf_event_mmap_page*)this->base;
+
+        /* data_offset/data_size are zero on kernels that predate them. */
+        u64 offset      = this->meta->data_offset ? this->meta->data_offset : page;
+        this->data_size = this->meta->data_size   ? this->meta->data_size   : data_pages * page;
+        this->data      = (const char*)this->base + offset;
+
+        this->scratch.resize(1 << 16);
+        this->frames.reserve(PERF_MAX_CALLCHAIN);
+
+        return true;
+    }
+
+    void close() {
+        if (this->base != MAP_FAILED) {
+            munmap(this->base, this->map_size);
+            this->base = MAP_FAILED;
+        }
+        if (this->fd >= 0) {
+            ::close(this->fd);
+            this->fd = -1;
+        }
+        this->meta = NULL;
+    }
+
+    bool enable() { return ioctl(this->fd, PERF_EVENT_IOC_ENABLE, 0) == 0; }
+
+    /* Appends every complete record in the ring to batch. Returns the number of samples added. */
+    size_t drain(Profile_Sample_Batch &batch) {
+        u64    head  = __atomic_load_n(&this->meta->data_head, __ATOMIC_ACQUIRE);
+        u64    tail  = this->meta->data_tail;
+        size_t added = 0;
+
+        batch.cpu = this->cpu;
+
+        while (tail < head) {
+            struct perf_event_header header;
+
+            memcpy(&header, this->record_at(tail, sizeof(header)), sizeof(header));
+
+            if (header.size < sizeof(header) || tail + header.size > head) { break; }
+
+            const char *rec = this->record_at(tail, header.size) + sizeof(header);
+
+            switch (header.type) {
+                case PERF_RECORD_SAMPLE: {
+                    /* Field order is fixed by the kernel for PERF_SAMPLE_FIELDS, then the callchain. */
+                    u64 ip;
+                    u32 pid_tid[2];
+                    u64 time;
+                    u64 period;
+
+                    memcpy(&ip,      rec,      sizeof(ip));
+                    memcpy(pid_tid,  rec + 8,  sizeof(pid_tid));
+                    memcpy(&time,    rec + 16, sizeof(time));
+                    memcpy(&period,  rec + 24, sizeof(period));
+
+                    batch.push(ip, pid_tid[0], pid_tid[1], time, period);
+                    added += 1;
+
+                    if (this->chains) {
+                        u64 nr   = 0;
+                        u64 room = (header.size - sizeof(header) - 40) / sizeof(u64);
+
+                        if (header.size >= sizeof(header) + 40) {
+                            memcpy(&nr, rec + 32, sizeof(nr));
+                            nr = std::min(nr, room);
+                        }
+
+                        /* Drop the PERF_CONTEXT_* markers that separate kernel and user frames. */
+                        this->frames.clear();
+                        for (u64 i = 0; i < nr; i += 1) {
+                            u64 frame;
+                            memcpy(&frame, rec + 40 + i * sizeof(u64), sizeof(frame));
+                            if (frame < (u64)PERF_CONTEXT_MAX) {
+                                this->frames.push_back(frame);
+                            }
+                        }
+
+                        batch.push_chain(this->frames.data(), this->frames.size());
+                    }
+                    break;
+                }
+                case PERF_RECORD_LOST: {
+                    /* { u64 id; u64 lost; } */
+                    u64 lost;
+                    memcpy(&lost, rec + 8, sizeof(lost));
+                    batch.lost += lost;
+                    break;
+                }
+                default:
+                    break;
+            }
+
+            tail += header.size;
+        }
+
+        __atomic_store_n(&this->meta->data_tail, tail, __ATOMIC_RELEASE);
+
+        return added;
+    }
+};
+
+struct Perf_Sampler {
+    enum class Error {
+        NONE = 0,
+        NO_CPUS,
+        OPEN,
+        ENABLE,
+    };
+
+    struct Options {
+        u64    frequency  = 0;      /* Samples per second; used if non-zero. */
+        u64    period     = 100000; /* Otherwise, one sample every `period` events. */
+        size_t data_pages = 256;    /* Per-CPU ring size, a power of two. */
+        bool   callchain  = false;  /* Record the stack of every sample (frame-pointer unwinding). */
+    };
+
+private:
+    std::vector<Perf_Sample_Ring> rings;
+    std::vector<struct pollfd>    pollfds;
+    std::string                   _error_string;
+
+    Error fail(Error error, std::string &&what) {
+        this->_error_string = what + ": " + strerror(errno);
+        this->close();
+        return error;
+    }
+
+public:
+    const std::string &error_string() const { return this->_error_string; }
+    bool               is_open() const { return !this->rings.empty(); }
+    size_t             n_rings() const { return this->rings.size(); }
+
+    Error open(const Perf_Event_Spec &event, const std::vector<int> &cpus, const Options &options) {
+        this->close();
+
+        if (cpus.empty()) { return Error::NO_CPUS; }
+
+        struct perf_event_attr attr;
+
+        memset(&attr, 0, sizeof(attr));
+        attr.size             = sizeof(attr);
+        attr.type             = event.type;
+        attr.config           = event.config;
+        attr.config1          = event.config1;
+        attr.config2          = event.config2;
+        attr.sample_type      = PERF_SAMPLE_FIELDS | (options.callchain ? PERF_SAMPLE_CALLCHAIN : 0);
+        attr.disabled         = 1;
+        attr.freq             = options.frequency != 0;
+        attr.sample_freq      = options.frequency ? options.frequency : options.period;
+        /* Wake poll() up once a quarter of the ring is filled rather than per sample. */
+        attr.watermark        = 1;
+        attr.wakeup_watermark = options.data_pages * sysconf(_SC_PAGESIZE) / 4;
+
+        for (int cpu : cpus) {
+            Perf_Sample_Ring ring;
+
+            if (!ring.open(attr, cpu, options.data_pages)) {
+                return this->fail(Error::OPEN, "perf_event_open(" + event.name + ", cpu " + std::to_string(cpu) + ")");
+            }
+
+            this->pollfds.push_back({ ring.get_fd(), POLLIN, 0 });
+            this->rings.push_back(std::move(ring));
+        }
+
+        for (auto &ring : this->rings) {
+            if (!ring.enable()) {
+                return this->fail(Error::ENABLE, "PERF_EVENT_IOC_ENABLE");
+            }
+        }
+
+        return Error::NONE;
+    }
+
+    void close() {
+        this->rings.clear();
+        this->pollfds.clear();
+    }
+
+    /* Waits until some ring crosses its watermark. Returns false on timeout. */
+    bool wait(int timeout_ms) {
+        return poll(this->pollfds.data(), this->pollfds.size(), timeout_ms) > 0;
+    }
+
+    /* batches[i] receives the samples of the i-th CPU passed to open(). */
+    size_t drain(std::vector<Profile_Sample_Batch> &batches) {
+        size_t total = 0;
+
+        batches.resize(this->rings.size());
+
+        for (size_t i = 0; i < this->rings.size(); i += 1) {
+            total += this->rings[i].drain(batches[i]);
+        }
+
+        return total;
+    }
+};
+
+}
@@ -0,0 +1,244 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <future>
+
+#include "hwloc.h"
+#include "common.hpp"
+#include "profile.hpp"
+#include "perf_sampler.hpp"
+
+namespace {
+
+/*
+ * One collector thread per locality domain (a package, or a NUMA node where
+ * packages are split into several). Each collector is bound to its domain's
+ * CPUs and memory before it opens anything, so the perf rings it drains and
+ * the batches it fills all live on the local node; nothing crosses the
+ * interconnect until collect() merges the finished batches.
+ */
+struct Sampler_Pool {
+    enum class Error {
+        NONE = 0,
+        NO_DOMAINS,
+        OPEN,
+    };
+
+    /* Samples a collector may hold before collect() picks them up; beyond that they count as lost. */
+    static constexpr size_t MAX_PENDING_SAMPLES = 1 << 20;
+    static constexpr int    WAIT_TIMEOUT_MS     = 100;
+
+private:
+    struct Collector {
+        std::string                       name;
+        hwloc_bitmap_t                    cpuset  = NULL;
+        hwloc_bitmap_t                    nodeset = NULL;
+        std::vector<int>                  cpus;
+        std::thread                       thr;
+
+        std::mutex                        mtx;
+        std::vector<Profile_Sample_Batch> pending;
+        size_t                            n_pending = 0;
+
+        ~Collector() {
+            if (this->cpuset)  { hwloc_bitmap_free(this->cpuset);  }
+            if (this->nodeset) { hwloc_bitmap_free(this->nodeset); }
+        }
+    };
+
+    hwloc_topology_t                        topo = NULL;
+    std::vector<std::unique_ptr<Collector>> collectors;
+    std::atomic<bool>                       should_stop { false };
+    std::string                             _error_string;
+
+    /* Hands a drained batch over to collect(), appending to what is already waiting. */
+    static void publish(Collector &c, size_t i, Profile_Sample_Batch &local) {
+        std::lock_guard<std::mutex> lock(c.mtx);
+
+        Profile_Sample_Batch &out = c.pending[i];
+
+        out.cpu   = local.cpu;
+        out.lost += local.lost;
+
+        if (c.n_pending + local.size() > MAX_PENDING_SAMPLES) {
+            out.lost += local.size();
+            return;
+        }
+
+        out.ip.insert(out.ip.end(),         local.ip.begin(),     local.ip.end());
+        out.pid.insert(out.pid.end(),       local.pid.begin(),    local.pid.end());
+        out.tid.insert(out.tid.end(),       local.tid.begin(),    local.tid.end());
+        out.time.insert(out.time.end(),     local.time.begin(),   local.time.end());
+        out.period.insert(out.period.end(), local.period.begin(), local.period.end());
+
+        if (local.has_chains()) {
+            u32 base = out.chain_ips.size();
+            for (u32 end : local.chain_end) {
+                out.chain_end.push_back(base + end);
+            }
+            out.chain_ips.insert(out.chain_ips.end(), local.chain_ips.begin(), local.chain_ips.end());
+        }
+
+        c.n_pending += local.size();
+    }
+
+    static void collector_thread(Sampler_Pool &pool, Collector &c, Perf_Event_Spec event, Perf_Sampler::Options options, std::promise<std::string> opened) {
+        /* Bind first: everything below is allocated and first touched on this domain. */
+        hwloc_set_cpubind(pool.topo, c.cpuset, HWLOC_CPUBIND_THREAD);
+        hwloc_set_membind(pool.topo, c.nodeset, HWLOC_MEMBIND_BIND, HWLOC_MEMBIND_THREAD);
+
+        Perf_Sampler                      sampler;
+        std::vector<Profile_Sample_Batch> local(c.cpus.size());
+
+        if (sampler.open(event, c.cpus, options) != Perf_Sampler::Error::NONE) {
+            opened.set_value(c.name + ": " + sampler.error_string());
+            return;
+        }
+
+        for (auto &batch : local) {
+            batch.reserve(4096);
+        }
+
+        opened.set_value("");
+
+        while (!pool.should_stop.load(std::memory_order_relaxed)) {
+            sampler.wait(WAIT_TIMEOUT_MS);
+
+            if (sampler.drain(local) == 0) { continue; }
+
+            for (size_t i = 0; i < local.size(); i += 1) {
+                publish(c, i, local[i]);
+                local[i].clear();
+            }
+        }
+
+        /* Whatever arrived after the last wakeup. */
+        sampler.drain(local);
+        for (size_t i = 0; i < local.size(); i += 1) {
+            publish(c, i, local[i]);
+        }
+    }
+
+    void add_domain(hwloc_obj_t obj, const char *kind) {
+        auto c = std::make_unique<Collector>();
+
+        c->name    = std::string(kind) + "#" + std::to_string(obj->os_index);
+        c->cpuset  = hwloc_bitmap_dup(obj->cpuset);
+        c->nodeset = hwloc_bitmap_dup(obj->nodeset);
+
+        unsigned cpu;
+        hwloc_bitmap_foreach_begin(cpu, obj->cpuset) {
+            c->cpus.push_back(cpu);
+        } hwloc_bitmap_foreach_end();
+
+        if (c->cpus.empty()) { return; }
+
+        c->pending.resize(c->cpus.size());
+
+        this->collectors.push_back(std::move(c));
+    }
+
+public:
+    Sampler_Pool()                               = default;
+    Sampler_Pool(const Sampler_Pool&)            = delete;
+    Sampler_Pool& operator=(const Sampler_Pool&) = delete;
+
+    ~Sampler_Pool() { this->stop(); }
+
+    const std::string &error_string() const { return this->_error_string; }
+    bool               is_running() const { return !this->collectors.empty() && this->collectors[0]->thr.joinable(); }
+    size_t             n_collectors() const { return this->collectors.size(); }
+
+    /* Splits the machine into domains. The topology must outlive the pool. */
+    void init(hwloc_topology_t topo) {
+        this->stop();
+        this->collectors.clear();
+        this->topo = topo;
+
+        int n_packages = hwloc_get_nbobjs_by_type(topo, HWLOC_OBJ_PACKAGE);
+        int n_numa     = hwloc_get_nbobjs_by_type(topo, HWLOC_OBJ_NUMANODE);
+
+        /* Sub-NUMA clustering splits a package; follow the finer split. */
+        hwloc_obj_type_t type = (n_numa > n_packages) ? HWLOC_OBJ_NUMANODE : HWLOC_OBJ_PACKAGE;
+        const char      *kind = (n_numa > n_packages) ? "NUMANode"         : "Package";
+
+        for (int i = 0; i < hwloc_get_nbobjs_by_type(topo, type); i += 1) {
+            this->add_domain(hwloc_get_obj_by_type(topo, type, i), kind);
+        }
+
+        if (this->collectors.empty()) {
+            this->add_domain(hwloc_get_root_obj(topo), "Machine");
+        }
+    }
+
+    Error start(const Perf_Event_Spec &event, const Perf_Sampler::Options &options) {
+        this->stop();
+
+        if (this->collectors.empty()) { return Error::NO_DOMAINS; }
+
+        std::vector<std::future<std::string>> opened;
+
+        this->should_stop = false;
+
+        for (auto &c : this->collectors) {
+            std::promise<std::string> promise;
+            opened.push_back(promise.get_future());
+            c->thr = std::thread(collector_thread, std::ref(*this), std::ref(*c), event, options, std::move(promise));
+        }
+
+        this->_error_string.clear();
+        for (auto &f : opened) {
+            std::string err = f.get();
+            if (!err.empty() && this->_error_string.empty()) {
+                this->_error_string = err;
+            }
+        }
+
+        if (!this->_error_string.empty()) {
+            this->stop();
+            return Error::OPEN;
+        }
+
+        return Error::NONE;
+    }
+
+    void stop() {
+        this->should_stop = true;
+
+        for (auto &c : this->collectors) {
+            if (c->thr.joinable()) {
+                c->thr.join();
+            }
+        }
+    }
+
+    /* The merge step: moves every collector's pending batches into out, one batch per CPU. */
+    size_t collect(Profile_Data &out) {
+        size_t total = 0;
+
+        for (auto &c : this->collectors) {
+            std::lock_guard<std::mutex> lock(c->mtx);
+
+            for (auto &batch : c->pending) {
+                if (batch.size() == 0 && batch.lost == 0) { continue; }
+
+                total += batch.size();
+                out.batches.push_back(std::move(batch));
+
+                /* The collector refills it, so the new buffers are allocated on its node. */
+                batch = Profile_Sample_Batch();
+            }
+
+            c->n_pending = 0;
+        }
+
+        return total;
+    }
+};
+
+}
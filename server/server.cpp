@@ -1,9 +1,18 @@
 #include <string>
 #include <cstdarg>
+#include <cstring>
 #include <alloca.h>
+#include <algorithm>
+#include <sstream>
+#include <chrono>
 
 #include "ssh_link.hpp"
+#include "link_message.hpp"
 #include "profile.hpp"
+#include "perf_counters.hpp"
+#include "sampler_pool.hpp"
+#include "monitor_stream.hpp"
+#include "stack_profile.hpp"
 #include "topo.hpp"
 #include "base64.hpp"
 #include "hwloc.h"
@@ -12,37 +21,84 @@
 
 using json = nlohmann::json;
 
-static SSH_Link_Server *ssh_link;
-static Profile_Config   config;
-static Topology         topo;
+enum Send_Key {
+    SEND_KEY_HEATMAP,
+};
+
+static SSH_Link_Server      *ssh_link;
+static Profile_Config        config;
+static Topology              topo;
+static Perf_Counting_Engine  counters;
+static hwloc_topology_t      hwloc_topo;
+static Sampler_Pool          samplers;
+static Monitor_Streamer      streamer;
+static Stack_Profiler        stacks(samplers);
+static Monitor_Data          monitor;
+
+static Monitor_Request       counter_request;
+
+static std::chrono::steady_clock::time_point monitor_last;
+
 
 static void report_warning(const char *fmt, ...);
 static void build_config();
 static void build_topo();
-static void send_config();
-static void send_topo();
-static void send_heatmap();
+static void handle_link_caps_request(SSH_Link_Server &link, const Link_Message &msg);
+static void handle_topology_request(SSH_Link_Server &link, const Link_Message &msg);
+static void handle_config_request(SSH_Link_Server &link, const Link_Message &msg);
+static void handle_heatmap_request(SSH_Link_Server &link, const Link_Message &msg);
+static void handle_monitor_start(SSH_Link_Server &link, const Link_Message &msg);
+static void handle_monitor_stop(SSH_Link_Server &link, const Link_Message &msg);
+static void handle_profile_start(SSH_Link_Server &link, const Link_Message &msg);
+static void handle_profile_stop(SSH_Link_Server &link, const Link_Message &msg);
+
+static const Link_Dispatcher<SSH_Link_Server> dispatcher = {
+    { Link_Op::LINK_CAPS_REQUEST, handle_link_caps_request },
+    { Link_Op::TOPOLOGY_REQUEST,  handle_topology_request  },
+    { Link_Op::CONFIG_REQUEST,    handle_config_request    },
+    { Link_Op::HEATMAP_REQUEST,   handle_heatmap_request   },
+    { Link_Op::MONITOR_START,     handle_monitor_start     },
+    { Link_Op::MONITOR_STOP,      handle_monitor_stop      },
+    { Link_Op::PROFILE_START,     handle_profile_start     },
+    { Link_Op::PROFILE_STOP,      handle_profile_stop      },
+};
 
 int main(void) {
-    build_config();
-    build_topo();
-
+    /* Set up the link first; building the config can already report warnings. */
     ssh_link = &SSH_Link_Server::get();
     ssh_link->start();
 
-    printf("Server started. Reaching out to client.\n");
+    build_config();
+    build_topo();
 
-    ssh_link->send("SERVER-CONNECT");
+    /* stdout belongs to the link's writer thread; diagnostics go to stderr. */
+    fprintf(stderr, "Server started. Reaching out to client.\n");
+
+    ssh_link->send(link_message(Link_Op::SERVER_CONNECT, link_u32_payload(ssh_link->supported_capabilities())));
+    ssh_link->flush();
 
     while (auto m = ssh_link->pull_next()) {
-        std::string &message = *m;
+        Link_Message msg;
+
+        switch (dispatcher.dispatch(*ssh_link, *m, msg)) {
+            case Link_Dispatcher<SSH_Link_Server>::Result::OK:
+                fprintf(stderr, "%s\n", link_op_name(msg.op));
+                break;
+            case Link_Dispatcher<SSH_Link_Server>::Result::MALFORMED:
+                report_warning("malformed message (%zu bytes)", m->size());
+                break;
+            case Link_Dispatcher<SSH_Link_Server>::Result::UNHANDLED:
+                report_warning("unexpected message %s", link_op_name(msg.op));
+                break;
+        }
+    }
 
-        printf("%s\n", message.c_str());
+    streamer.stop();
+    stacks.stop();
+    samplers.stop();
+    hwloc_topology_destroy(hwloc_topo);
 
-        if      (message == "REQUEST/TOPOLOGY")     { send_topo();    }
-        else if (message == "REQUEST/CONFIG")       { send_config();  }
-        else if (message == "REQUEST/HEATMAP-DATA") { send_heatmap(); }
-    }
+    ssh_link->finish();
 
     return 0;
 }
@@ -60,12 +116,10 @@ static void report_warning(const char *fmt, ...) {
     vsnprintf(buff, size + 1, fmt, va);
     va_end(va);
 
-    printf("WARNING: %s\n", buff);
-
-    std::string message = "SERVER-WARNING;";
-    message += buff;
+    fprintf(stderr, "WARNING: %s\n", buff);
 
-    ssh_link->send(std::move(message));
+    ssh_link->send(link_message(Link_Op::SERVER_WARNING, buff));
+    ssh_link->flush();
 }
 
 static void build_config() {
@@ -158,6 +212,7 @@ static void topo_from_hwloc(hwloc_obj_t obj, Topology_Node *parent) {
     } else {
         /* Create a new node under the current parent */
         Topology_Node &sub = parent->get_subnode(node_name, hwloc_type_to_type(obj));
+        sub.os_index = (obj->os_index != (unsigned) -1) ? (s32)obj->os_index : -1;
         new_parent = &sub;
     }
 
@@ -173,34 +228,264 @@ static void topo_from_hwloc(hwloc_obj_t obj, Topology_Node *parent) {
 }
 
 static void build_topo() {
-    hwloc_topology_t t;
+    hwloc_topology_init(&hwloc_topo);
+    hwloc_topology_load(hwloc_topo);
 
-    hwloc_topology_init(&t);
-    hwloc_topology_load(t);
-
-    hwloc_obj_t root = hwloc_get_root_obj(t);
+    hwloc_obj_t root = hwloc_get_root_obj(hwloc_topo);
 
     topo_from_hwloc(root, &topo);
+    topo.flat.build(topo);
+
+    /* The collectors keep using the hwloc topology for their cpusets. */
+    samplers.init(hwloc_topo);
+}
+
+static void handle_config_request(SSH_Link_Server &link, const Link_Message &msg) {
+    link.send(link_reply(msg, Link_Op::CONFIG, config.to_serialized()), Link_Channel::BULK);
+}
+
+static void handle_topology_request(SSH_Link_Server &link, const Link_Message &msg) {
+    link.send(link_reply(msg, Link_Op::TOPOLOGY, topo.to_serialized()), Link_Channel::BULK);
+}
+
+static std::vector<int> topo_cpus() {
+    return topo.flat.cpus();
+}
+
+static void apply_default_events(Monitor_Request &request) {
+    if (request.events.empty()) {
+        request.events = { "cycles", "instructions" };
+    }
+}
+
+static std::vector<Perf_Event_Spec> resolve_events(Monitor_Request &request) {
+    std::vector<Perf_Event_Spec> specs;
+
+    apply_default_events(request);
+
+    for (auto &name : request.events) {
+        Perf_Event_Spec spec;
+        if (perf_resolve_event(name, spec)) {
+            specs.push_back(std::move(spec));
+        } else {
+            report_warning("unknown event '%s'", name.c_str());
+        }
+    }
+
+    return specs;
+}
+
+static Perf_Counting_Engine::Options counter_options(const Monitor_Request &request) {
+    Perf_Counting_Engine::Options options;
+
+    options.counters_per_group = std::max(request.counters_per_group, (u32)1);
+    options.time_slice         = std::chrono::milliseconds(std::max(request.time_slice_ms, (u32)1));
+
+    return options;
+}
+
+/*
+ * (Re)opens the counters if the requested events changed, setting `opened`.
+ * Returns false if nothing can be counted.
+ */
+static bool open_counters(Monitor_Request &&request, bool &opened) {
+    apply_default_events(request);
+
+    opened = false;
+
+    if (counters.is_open() && request == counter_request) { return true; }
+
+    counter_request = request;
+
+    monitor = Monitor_Data();
+
+    if (counters.open(resolve_events(request), topo_cpus(), counter_options(request)) != Perf_Counting_Engine::Error::NONE) {
+        if (!counters.error_string().empty()) {
+            report_warning("failed to open counters: %s", counters.error_string().c_str());
+        }
+        return false;
+    }
+
+    for (auto &name : counters.unavailable()) {
+        report_warning("event '%s' is not supported on any CPU", name.c_str());
+    }
+
+    for (auto &spec : counters.get_events()) {
+        monitor.events.push_back(spec.name);
+    }
+    for (int cpu : counters.cpus()) {
+        monitor.threads.push_back("PU#" + std::to_string(cpu));
+        monitor.cpus.push_back(cpu);
+    }
+
+    monitor.values.assign(monitor.cpus.size() * monitor.events.size(), 0);
+    monitor.confidence.assign(monitor.values.size(), 0);
+
+    monitor_last = std::chrono::steady_clock::now();
+    opened       = true;
+
+    return true;
+}
+
+/* The payload is a Monitor_Request; an empty one means the defaults. */
+static void handle_heatmap_request(SSH_Link_Server &link, const Link_Message &msg) {
+    Monitor_Request request;
+
+    if (!msg.payload.empty()) {
+        try {
+            request = Monitor_Request::from_serialized(msg.payload);
+        } catch (...) {
+            report_warning("malformed counter request");
+            return;
+        }
+    }
+
+    bool opened;
+
+    if (!open_counters(std::move(request), opened)) { return; }
+
+    /*
+     * Counting has only just started: the first frame is empty (interval 0)
+     * and the next request reports everything counted since now.
+     */
+    if (!opened) {
+        if (counters.read_deltas(monitor.values, monitor.confidence) != Perf_Counting_Engine::Error::NONE) {
+            report_warning("failed to read counters: %s", counters.error_string().c_str());
+            return;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+
+        monitor.interval_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - monitor_last).count();
+        monitor_last        = now;
+    }
 
-    hwloc_topology_destroy(t);
+    /*
+     * Only the latest frame matters if the client falls behind. A frame that
+     * gets replaced answers more than one request, so it goes out unsolicited
+     * rather than as the reply to any one of them.
+     */
+    link.send(link_message(Link_Op::HEATMAP_DATA, monitor.to_serialized()),
+              Link_Channel::BULK, SSH_Link_Server::Send_Policy::COALESCE, SEND_KEY_HEATMAP);
 }
 
-static void send_config() {
-    std::string message = "CONFIG;" + config.to_serialized();
-    ssh_link->send(std::move(message));
+static void handle_monitor_start(SSH_Link_Server &link, const Link_Message &msg) {
+    Monitor_Stream_Request request;
+
+    try {
+        request = Monitor_Stream_Request::from_serialized(msg.payload);
+    } catch (...) {
+        report_warning("malformed monitor request");
+        return;
+    }
+
+    auto specs = resolve_events(request.counters);
+
+    Monitor_Streamer::Error err;
+
+    if (request.bucket_ns > 0) {
+        auto sink = [&link](Monitor_Aggregate_Batch &&batch) {
+            link.send(link_message(Link_Op::MONITOR_AGGREGATE, batch.to_serialized()), Link_Channel::BULK);
+        };
+
+        err = streamer.open(specs, topo_cpus(), counter_options(request.counters), request.interval_us,
+                            request.bucket_ns, request.histograms, sink);
+    } else {
+        auto sink = [&link](Monitor_Stream_Batch &&batch) {
+            link.send(link_message(Link_Op::MONITOR_BATCH, batch.to_serialized()), Link_Channel::BULK);
+        };
+
+        err = streamer.open(specs, topo_cpus(), counter_options(request.counters), request.interval_us, sink);
+    }
+
+    if (err != Monitor_Streamer::Error::NONE) {
+        report_warning("failed to start the monitor: %s", streamer.error_string().c_str());
+        return;
+    }
+
+    for (auto &name : streamer.get_counters().unavailable()) {
+        report_warning("event '%s' is not supported on any CPU", name.c_str());
+    }
+
+    Monitor_Stream_Header header;
+
+    for (auto &spec : streamer.get_counters().get_events()) {
+        header.events.push_back(spec.name);
+    }
+    for (int cpu : streamer.get_counters().cpus()) {
+        header.threads.push_back("PU#" + std::to_string(cpu));
+        header.cpus.push_back(cpu);
+    }
+    header.interval_ns = streamer.get_interval_ns();
+
+    /*
+     * Queued on the bulk channel before the sampler thread exists, so the
+     * first batch can't overtake it.
+     */
+    link.send(link_reply(msg, Link_Op::MONITOR_STARTED, header.to_serialized()), Link_Channel::BULK);
+
+    if (streamer.run() != Monitor_Streamer::Error::NONE) {
+        report_warning("failed to start the monitor: %s", streamer.error_string().c_str());
+    }
+}
+
+static void handle_monitor_stop(SSH_Link_Server &link, const Link_Message &msg) {
+    streamer.stop();
+}
+
+/* Deltas go out on the bulk channel in order; the client rebuilds the trie from them. */
+static void handle_profile_start(SSH_Link_Server &link, const Link_Message &msg) {
+    Stack_Profile_Request request;
+
+    try {
+        request = Stack_Profile_Request::from_serialized(msg.payload);
+    } catch (...) {
+        report_warning("malformed profile request");
+        return;
+    }
+
+    /* Like perf record: cycles, falling back to a software clock where there is no PMU. */
+    std::vector<std::string> candidates = { request.event };
+    if (request.event.empty()) {
+        candidates = { "cycles", "cpu-clock" };
+    }
+
+    auto sink = [&link](Stack_Trie_Delta &&delta) {
+        link.send(link_message(Link_Op::STACK_DELTA, delta.to_serialized()), Link_Channel::BULK);
+    };
+
+    for (auto &name : candidates) {
+        Perf_Event_Spec spec;
+
+        if (!perf_resolve_event(name, spec)) {
+            report_warning("unknown event '%s'", name.c_str());
+            continue;
+        }
+
+        if (stacks.start(spec, std::max(request.frequency, (u64)1), sink) == Stack_Profiler::Error::NONE) {
+            return;
+        }
+    }
+
+    report_warning("failed to start the profiler: %s", stacks.error_string().c_str());
 }
 
-static void send_topo() {
-    std::string message = "TOPOLOGY;" + topo.to_serialized();
-    ssh_link->send(std::move(message));
+static void handle_profile_stop(SSH_Link_Server &link, const Link_Message &msg) {
+    stacks.stop();
 }
 
-static void send_heatmap() {
-    std::string out = "HEATMAP-DATA";
-    for (int i = 0; i < 500; i += 1) {
-        out += ";";
-        int n = random() % 100000;
-        out += std::to_string(n);
+static void handle_link_caps_request(SSH_Link_Server &link, const Link_Message &msg) {
+    u32 requested = 0;
+
+    if (!link_read_u32(msg.payload, requested)) {
+        report_warning("bad link capabilities payload (%zu bytes)", msg.payload.size());
+        return;
     }
-    ssh_link->send(std::move(out));
+
+    u32 agreed = requested & link.supported_capabilities();
+
+    /* The reply goes out with the old framing; the client switches when it sees it. */
+    link.send(link_reply(msg, Link_Op::LINK_CAPS, link_u32_payload(agreed)));
+    link.flush();
+    link.set_capabilities(agreed);
 }
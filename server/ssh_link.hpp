@@ -2,19 +2,261 @@
 
 #include <string>
 #include <optional>
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/uio.h>
 
-#include "ssh_link_inbox.hpp"
-#include "base64.hpp"
+#include "link_protocol.hpp"
 
 namespace {
 
 struct SSH_Link_Server {
+    /* What send() does when the outgoing queue is full. */
+    enum class Send_Policy {
+        BLOCK,    /* Wait for the writer to make room.                                  */
+        DROP,     /* Discard the message.                                               */
+        COALESCE, /* Replace a still-queued message with the same key, i.e. keep only
+                     the latest one (e.g. heatmap frames). Otherwise wait like BLOCK.
+                     Only for unsolicited messages: a replaced reply's id is lost.      */
+    };
+
 private:
-    SSH_Link_Inbox inbox;
+    /* Filled and drained on the main thread only, so a plain queue will do. */
+    std::deque<std::string> inbox;
+    Link_Stream_Parser      parser { LINK_OSC_TO_SERVER };
+    u32                     caps        = 0;
+    std::vector<char>       read_buffer = std::vector<char>(LINK_DEFAULT_READ_BUFFER_SIZE);
+
+    /*
+     * The writer thread owns stdout. Senders only enqueue; the writer encodes
+     * (and compresses) each message with the capabilities in effect when it
+     * was sent, coalesces the results and writes them with a single writev()
+     * once the batch is big enough or old enough, or when asked to flush.
+     *
+     * Control messages always go first. A bulk message is put on the wire one
+     * fragment at a time, and the control queue is drained again between
+     * fragments, so a large transfer never holds up a small reply.
+     */
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr size_t QUEUE_CAPACITY = 1024;
+    static constexpr size_t FLUSH_BYTES    = 64 * 1024;
+    static constexpr auto   FLUSH_WINDOW   = std::chrono::milliseconds(1);
+    static constexpr int    MAX_IOV        = 64;
+
+    struct Outgoing {
+        std::string msg;
+        u32         caps;
+        int         key;
+    };
+
+    struct Bulk_Transfer {
+        bool        active = false;
+        std::string payload;
+        Link_Codec  codec  = Link_Codec::NONE;
+        size_t      offset = 0;
+    };
+
+    std::mutex               out_mtx;
+    std::condition_variable  out_cv;
+    std::condition_variable  space_cv;
+    std::deque<Outgoing>     control_queue;
+    std::deque<Outgoing>     bulk_queue;
+    bool                     flush_requested = false;
+    bool                     writer_stop     = false;
+    std::thread              writer;
+
+    /* Writer thread only. Views point into out_owned or the current bulk payload. */
+    std::deque<std::string>       out_owned;
+    std::vector<std::string_view> out_views;
+    size_t                        out_bytes = 0;
+    Bulk_Transfer                 bulk;
+
+    std::deque<Outgoing> &queue_for(Link_Channel channel) {
+        return channel == Link_Channel::BULK ? this->bulk_queue : this->control_queue;
+    }
+
+    void add_owned(std::string &&part) {
+        this->out_owned.push_back(std::move(part));
+        this->out_views.push_back(this->out_owned.back());
+        this->out_bytes += this->out_owned.back().size();
+    }
+
+    void add_view(std::string_view part) {
+        this->out_views.push_back(part);
+        this->out_bytes += part.size();
+    }
+
+    void add_message(Outgoing &&out) {
+        std::vector<std::string> parts;
+
+        link_encode_parts(parts, out.caps, std::move(out.msg), LINK_OSC_TO_CLIENT, "\007");
+
+        for (auto &part : parts) {
+            this->add_owned(std::move(part));
+        }
+    }
+
+    void begin_bulk(Outgoing &&out) {
+        /* Without binary framing there is nothing to interleave with; send it whole. */
+        if (!(out.caps & LINK_CAP_BINARY_FRAMING)) {
+            this->add_message(std::move(out));
+            return;
+        }
+
+        this->bulk.active  = true;
+        this->bulk.codec   = link_compress_in_place(out.caps, out.msg);
+        this->bulk.payload = std::move(out.msg);
+        this->bulk.offset  = 0;
+    }
+
+    void add_bulk_fragment() {
+        size_t len  = std::min(LINK_BULK_FRAGMENT_SIZE, this->bulk.payload.size() - this->bulk.offset);
+        bool   more = this->bulk.offset + len < this->bulk.payload.size();
+
+        std::string header;
+        link_put_frame_header(header, len, this->bulk.codec, LINK_FRAME_BULK | (more ? LINK_FRAME_MORE : 0));
+
+        this->add_owned(std::move(header));
+        this->add_view(std::string_view(this->bulk.payload).substr(this->bulk.offset, len));
+
+        this->bulk.offset += len;
+        this->bulk.active  = more;
+    }
+
+    void write_parts() {
+        size_t part   = 0;
+        size_t offset = 0;
 
-    static constexpr const char *OSC_PATTERN = "\033]9999;";
+        while (part < this->out_views.size()) {
+            struct iovec iov[MAX_IOV];
+            int          n_iov = 0;
+
+            for (size_t i = part; i < this->out_views.size() && n_iov < MAX_IOV; i += 1) {
+                size_t skip = (i == part) ? offset : 0;
+
+                iov[n_iov].iov_base  = (void*)(this->out_views[i].data() + skip);
+                iov[n_iov].iov_len   = this->out_views[i].size() - skip;
+                n_iov               += 1;
+            }
+
+            errno = 0;
+            ssize_t w = writev(STDOUT_FILENO, iov, n_iov);
+
+            if (w < 0) {
+                if (errno == EINTR || errno == EAGAIN) { continue; }
+                break;
+            }
+
+            while (w > 0) {
+                size_t left = this->out_views[part].size() - offset;
+                if ((size_t)w >= left) {
+                    w      -= left;
+                    part   += 1;
+                    offset  = 0;
+                } else {
+                    offset += w;
+                    w       = 0;
+                }
+            }
+
+            /* Skip over any empty parts so the loop condition sees real progress. */
+            while (part < this->out_views.size() && this->out_views[part].size() == offset) {
+                part   += 1;
+                offset  = 0;
+            }
+        }
+
+        this->out_views.clear();
+        this->out_owned.clear();
+        this->out_bytes = 0;
+
+        if (!this->bulk.active) {
+            this->bulk.payload = std::string();
+        }
+    }
+
+    static void writer_thread(SSH_Link_Server &self) {
+        std::deque<Outgoing>    batch;
+        std::optional<Outgoing> next_bulk;
+        Clock::time_point       first = Clock::now();
+
+        for (;;) {
+            bool flush;
+            bool stop;
+
+            {
+                std::unique_lock<std::mutex> lock(self.out_mtx);
+
+                auto ready = [&self] {
+                    return !self.control_queue.empty() || !self.bulk_queue.empty()
+                        || self.flush_requested || self.writer_stop;
+                };
+
+                if (self.bulk.active) {
+                    /* Keep streaming the current bulk message; just pick up any control traffic. */
+                } else if (self.out_views.empty()) {
+                    self.out_cv.wait(lock, ready);
+                } else if (!self.out_cv.wait_until(lock, first + FLUSH_WINDOW, ready)) {
+                    /* The window closed with nothing new to add. */
+                    self.flush_requested = true;
+                }
+
+                batch.swap(self.control_queue);
+
+                if (!self.bulk.active && !self.bulk_queue.empty()) {
+                    next_bulk = std::move(self.bulk_queue.front());
+                    self.bulk_queue.pop_front();
+                }
+
+                flush                = self.flush_requested;
+                stop                 = self.writer_stop && self.control_queue.empty() && self.bulk_queue.empty();
+                self.flush_requested = false;
+            }
+
+            self.space_cv.notify_all();
+
+            for (auto &out : batch) {
+                if (self.out_views.empty()) {
+                    first = Clock::now();
+                }
+
+                self.add_message(std::move(out));
+
+                if (self.out_bytes >= FLUSH_BYTES) {
+                    self.write_parts();
+                }
+            }
+
+            batch.clear();
+
+            if (next_bulk) {
+                if (self.out_views.empty()) {
+                    first = Clock::now();
+                }
+                self.begin_bulk(std::move(*next_bulk));
+                next_bulk.reset();
+            }
+
+            if (self.bulk.active) {
+                self.add_bulk_fragment();
+                self.write_parts();
+                continue;
+            }
+
+            if (flush || stop || Clock::now() - first >= FLUSH_WINDOW) {
+                self.write_parts();
+            }
+
+            if (stop) { break; }
+        }
+    }
 
 public:
     static SSH_Link_Server& get() {
@@ -22,61 +264,100 @@ public:
         return server;
     }
 
-    void start() { }
+    ~SSH_Link_Server() {
+        this->finish();
+    }
 
-    void send(std::string &&msg) {
-        std::string payload = "\033]9998;";
-        try {
-            payload += base64::to_base64(msg);
-        } catch (...) {}
-        payload += "\007";
+    void start() {
+        if (!this->writer.joinable()) {
+            this->writer = std::thread(writer_thread, std::ref(*this));
+        }
+    }
 
-        int n = payload.size();
-        int t = 0;
-        int w = 0;
-        while (t < n) {
-            errno = 0;
-            w = write(STDOUT_FILENO, payload.c_str() + t, n - t);
+    /* Drains everything queued so far and stops the writer. */
+    void finish() {
+        if (!this->writer.joinable()) { return; }
 
-            if (w > 0) {
-                t += w;
-            } else if (w < 0 && (errno == EINTR || errno == EAGAIN)) {
-                continue;
-            } else {
-                break;
+        {
+            std::lock_guard<std::mutex> lock(this->out_mtx);
+            this->writer_stop = true;
+        }
+        this->out_cv.notify_one();
+
+        this->writer.join();
+    }
+
+    void set_read_buffer_size(size_t size) { this->read_buffer.resize(std::max(size, (size_t)1)); }
+
+    u32 supported_capabilities() const { return link_supported_capabilities(); }
+
+    void set_capabilities(u32 caps) {
+        std::lock_guard<std::mutex> lock(this->out_mtx);
+        this->caps = caps;
+    }
+
+    /*
+     * key (>= 0) identifies the messages that COALESCE may replace one another with.
+     * BULK is for large payloads (topology, config, heatmaps) that may be split up
+     * so they don't delay CONTROL replies queued behind them.
+     */
+    void send(std::string &&msg, Link_Channel channel = Link_Channel::CONTROL, Send_Policy policy = Send_Policy::BLOCK, int key = 0) {
+        std::unique_lock<std::mutex> lock(this->out_mtx);
+
+        auto &queue = this->queue_for(channel);
+
+        if (policy == Send_Policy::COALESCE) {
+            for (auto &out : queue) {
+                if (out.key == key) {
+                    out.msg  = std::move(msg);
+                    out.caps = this->caps;
+                    return;
+                }
             }
         }
+
+        if (queue.size() >= QUEUE_CAPACITY) {
+            if (policy == Send_Policy::DROP) { return; }
+
+            this->space_cv.wait(lock, [this, &queue] { return queue.size() < QUEUE_CAPACITY || this->writer_stop; });
+        }
+
+        bool wake = this->control_queue.empty() && this->bulk_queue.empty();
+
+        queue.push_back({ std::move(msg), this->caps, policy == Send_Policy::COALESCE ? key : -1 });
+
+        lock.unlock();
+
+        if (wake) {
+            this->out_cv.notify_one();
+        }
+    }
+
+    /* Ask the writer to put everything queued so far on the wire without waiting for the batch window. */
+    void flush() {
+        {
+            std::lock_guard<std::mutex> lock(this->out_mtx);
+            this->flush_requested = true;
+        }
+        this->out_cv.notify_one();
     }
 
     std::optional<std::string> pull_next() {
 
 check:;
-        if (auto msg = this->inbox.try_pop()) { return *msg; }
+        if (!this->inbox.empty()) {
+            std::string msg = std::move(this->inbox.front());
+            this->inbox.pop_front();
+            return msg;
+        }
 
-        static const char  *osc_state = OSC_PATTERN;
-        static std::string  cur_msg;
+        this->flush();
 
-        char buff[4096];
+        char *buff = this->read_buffer.data();
 
         int n = 0;
-        while (this->inbox.size() == 0 && (n = read(STDIN_FILENO, buff, sizeof(buff))) > 0) {
-            for (int i = 0; i < n; i += 1) {
-                if (*osc_state == 0) {
-                    if (buff[i] == '\x07') {
-                        try {
-                            this->inbox.push(base64::from_base64(cur_msg));
-                        } catch (...) {}
-                        cur_msg.clear();
-                        osc_state = OSC_PATTERN;
-                    } else {
-                        cur_msg += buff[i];
-                    }
-                } else if (buff[i] == *osc_state) {
-                    osc_state += 1;
-                } else {
-                    osc_state = OSC_PATTERN;
-                }
-            }
+        while (this->inbox.size() == 0 && (n = read(STDIN_FILENO, buff, this->read_buffer.size())) > 0) {
+            this->parser.feed(buff, n, [this](std::string &&msg, Link_Channel) { this->inbox.push_back(std::move(msg)); });
         }
 
         if (n > 0) { goto check; }
@@ -0,0 +1,187 @@
+#pragma once
+
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+
+#include "common.hpp"
+#include "profile.hpp"
+#include "stack_trie.hpp"
+#include "perf_counters.hpp"
+#include "sampler_pool.hpp"
+#include "symbolize.hpp"
+
+namespace {
+
+/*
+ * Callchain sampling through the sampler pool. Every FLUSH_INTERVAL the
+ * collected samples are merged into a Stack_Trie and only what changed in it
+ * goes to the sink, so a hot loop sampled a million times costs one node and
+ * a count, not a million stacks.
+ *
+ * New nodes are symbolized before they go out, so the client never sees an
+ * address it has to resolve itself.
+ */
+struct Stack_Profiler {
+    using Sink = std::function<void(Stack_Trie_Delta &&delta)>;
+
+    enum class Error {
+        NONE = 0,
+        SAMPLERS,
+    };
+
+    static constexpr auto FLUSH_INTERVAL = std::chrono::milliseconds(250);
+
+private:
+    Sampler_Pool            &pool;
+    Stack_Trie               trie;
+    Symbolizer               symbolizer;
+    std::vector<u32>         node_pid;      /* The process each trie node belongs to. */
+    Profile_Data             data;
+    u64                      lost = 0;
+    Sink                     sink;
+    std::thread              thr;
+    std::mutex               mtx;
+    std::condition_variable  cv;
+    bool                     should_stop = false;
+    std::string              _error_string;
+
+    static std::string process_name(u32 pid) {
+        if (pid == 0) { return "swapper"; }
+
+        std::ifstream in("/proc/" + std::to_string(pid) + "/comm");
+        std::string   name;
+
+        std::getline(in, name);
+
+        return name;
+    }
+
+    void symbolize(Stack_Trie_Delta &delta) {
+        std::vector<u32> pids;
+        std::vector<u64> ips;
+        std::vector<u32> frames;
+        std::vector<u32> ids;
+
+        delta.symbol.assign(delta.parent.size(), NO_SYMBOL);
+
+        for (size_t i = 0; i < delta.parent.size(); i += 1) {
+            u32 parent = delta.parent[i];
+
+            if (parent == 0) {
+                this->node_pid.push_back(delta.ip[i]);
+                delta.process_name.push_back(process_name(delta.ip[i]));
+                continue;
+            }
+
+            this->node_pid.push_back(this->node_pid[parent]);
+
+            pids.push_back(this->node_pid[parent]);
+            ips.push_back(delta.ip[i]);
+            frames.push_back(i);
+        }
+
+        this->symbolizer.resolve(pids, ips, ids);
+
+        for (size_t j = 0; j < frames.size(); j += 1) {
+            delta.symbol[frames[j]] = ids[j];
+        }
+
+        this->symbolizer.take_new(delta);
+    }
+
+    void flush() {
+        this->data.batches.clear();
+        this->pool.collect(this->data);
+
+        for (auto &batch : this->data.batches) {
+            this->lost += batch.lost;
+
+            for (size_t i = 0; i < batch.size(); i += 1) {
+                if (batch.has_chains() && batch.chain_end[i] > batch.chain_begin(i)) {
+                    u32 begin = batch.chain_begin(i);
+                    this->trie.insert(batch.pid[i], batch.chain_ips.data() + begin, batch.chain_end[i] - begin);
+                } else {
+                    this->trie.insert(batch.pid[i], &batch.ip[i], 1);
+                }
+            }
+        }
+
+        Stack_Trie_Delta delta;
+
+        if (this->trie.take_delta(delta)) {
+            this->symbolize(delta);
+
+            delta.lost = this->lost;
+            this->lost = 0;
+            this->sink(std::move(delta));
+        }
+    }
+
+    static void flusher_thread(Stack_Profiler &self) {
+        std::unique_lock<std::mutex> lock(self.mtx);
+
+        while (!self.should_stop) {
+            self.cv.wait_for(lock, FLUSH_INTERVAL, [&self] { return self.should_stop; });
+
+            lock.unlock();
+            self.flush();
+            lock.lock();
+        }
+    }
+
+public:
+    Stack_Profiler(Sampler_Pool &pool) : pool(pool) {}
+
+    Stack_Profiler(const Stack_Profiler&)            = delete;
+    Stack_Profiler& operator=(const Stack_Profiler&) = delete;
+
+    ~Stack_Profiler() { this->stop(); }
+
+    bool               is_running() const { return this->thr.joinable(); }
+    const std::string &error_string() const { return this->_error_string; }
+
+    Error start(const Perf_Event_Spec &event, u64 frequency, Sink &&sink) {
+        this->stop();
+
+        Perf_Sampler::Options options;
+
+        options.frequency = frequency;
+        options.callchain = true;
+
+        if (this->pool.start(event, options) != Sampler_Pool::Error::NONE) {
+            this->_error_string = this->pool.error_string();
+            return Error::SAMPLERS;
+        }
+
+        this->trie.clear();
+        this->node_pid    = { 0 };
+        this->symbolizer.forget_processes();
+        this->lost        = 0;
+        this->sink        = std::move(sink);
+        this->should_stop = false;
+        this->thr         = std::thread(flusher_thread, std::ref(*this));
+
+        return Error::NONE;
+    }
+
+    /* Stops sampling; whatever was sampled up to here still goes out as a last delta. */
+    void stop() {
+        if (!this->thr.joinable()) { return; }
+
+        {
+            std::lock_guard<std::mutex> lock(this->mtx);
+            this->should_stop = true;
+        }
+        this->cv.notify_one();
+        this->thr.join();
+
+        this->pool.stop();
+        this->flush();
+    }
+};
+
+}
@@ -0,0 +1,676 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.hpp"
+#include "profile.hpp"
+
+namespace {
+
+/*
+ * Functions of one binary (or of the kernel), sorted by address, keyed by
+ * build-id so that the same library mapped into many processes, or reached
+ * through different paths, is parsed and sent once.
+ */
+struct Symbol_Table {
+    struct Load {
+        u64 offset;
+        u64 vaddr;
+        u64 size;
+    };
+
+    std::string              path;
+    std::string              build_id;
+    std::vector<Load>        loads;       /* PT_LOAD segments, to turn file offsets into addresses. */
+    std::vector<u64>         addr;
+    std::vector<u64>         size;
+    std::vector<u32>         name_end;
+    std::string              names;
+
+    /* Filled in by the Symbolizer when first referenced. */
+    u32                      module_id = NO_SYMBOL;
+    std::vector<u32>         symbol_id;
+
+    size_t           n_symbols() const { return this->addr.size(); }
+    std::string_view name(size_t i) const {
+        u32 begin = i ? this->name_end[i - 1] : 0;
+        return std::string_view(this->names).substr(begin, this->name_end[i] - begin);
+    }
+
+    u64 vaddr_of(u64 file_offset) const {
+        for (auto &load : this->loads) {
+            if (file_offset >= load.offset && file_offset < load.offset + load.size) {
+                return file_offset - load.offset + load.vaddr;
+            }
+        }
+        return file_offset;
+    }
+
+    /* Index of the function containing vaddr, or -1. */
+    s64 find(u64 vaddr) const {
+        auto it = std::upper_bound(this->addr.begin(), this->addr.end(), vaddr);
+        if (it == this->addr.begin()) { return -1; }
+
+        size_t i = it - this->addr.begin() - 1;
+
+        /* Symbols without a size cover everything up to the next one. */
+        if (this->size[i] && vaddr >= this->addr[i] + this->size[i]) { return -1; }
+
+        return i;
+    }
+
+    /* Sorts (addr, size, name) triples collected in any order and drops duplicate addresses. */
+    void finish(std::vector<std::tuple<u64, u64, std::string_view>> &funcs) {
+        std::sort(funcs.begin(), funcs.end(), [](auto &a, auto &b) { return std::get<0>(a) < std::get<0>(b); });
+
+        for (auto &[addr, size, name] : funcs) {
+            if (!this->addr.empty() && this->addr.back() == addr) { continue; }
+
+            this->addr.push_back(addr);
+            this->size.push_back(size);
+            this->names.append(name);
+            this->name_end.push_back(this->names.size());
+        }
+
+        this->symbol_id.assign(this->n_symbols(), NO_SYMBOL);
+    }
+};
+
+inline std::string hex_string(const u8 *bytes, size_t n) {
+    static const char digits[] = "0123456789abcdef";
+    std::string out;
+
+    for (size_t i = 0; i < n; i += 1) {
+        out += digits[bytes[i] >> 4];
+        out += digits[bytes[i] & 0xF];
+    }
+
+    return out;
+}
+
+/* Scans an ELF note area for NT_GNU_BUILD_ID. */
+inline std::string elf_note_build_id(const u8 *p, size_t size) {
+    size_t off = 0;
+
+    while (off + sizeof(Elf64_Nhdr) <= size) {
+        Elf64_Nhdr nhdr;
+        memcpy(&nhdr, p + off, sizeof(nhdr));
+
+        size_t name_off = off + sizeof(nhdr);
+        size_t desc_off = name_off + ((nhdr.n_namesz + 3) & ~3u);
+        size_t next     = desc_off + ((nhdr.n_descsz + 3) & ~3u);
+
+        if (next > size) { break; }
+
+        if (nhdr.n_type == NT_GNU_BUILD_ID && nhdr.n_namesz == 4 && memcmp(p + name_off, "GNU", 4) == 0) {
+            return hex_string(p + desc_off, nhdr.n_descsz);
+        }
+
+        off = next;
+    }
+
+    return "";
+}
+
+/*
+ * Reads the function symbols of a 64-bit ELF file: .symtab if it has one,
+ * else .dynsym. Returns NULL for anything else. Separate debug info
+ * (.gnu_debuglink, debuginfod) is not looked up.
+ */
+inline std::shared_ptr<Symbol_Table> load_elf_symbols(const std::string &path, const std::string &display_path) {
+    std::shared_ptr<Symbol_Table> ret;
+
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) { return ret; }
+    DEFER { close(fd); };
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(Elf64_Ehdr)) { return ret; }
+
+    size_t size = st.st_size;
+    void  *map  = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) { return ret; }
+    DEFER { munmap(map, size); };
+
+    const u8   *base = (const u8*)map;
+    Elf64_Ehdr  ehdr;
+
+    memcpy(&ehdr, base, sizeof(ehdr));
+
+    if (memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0 || ehdr.e_ident[EI_CLASS] != ELFCLASS64) { return ret; }
+    if (ehdr.e_phoff + (u64)ehdr.e_phnum * sizeof(Elf64_Phdr) > size)                      { return ret; }
+    if (ehdr.e_shoff + (u64)ehdr.e_shnum * sizeof(Elf64_Shdr) > size)                      { return ret; }
+
+    ret = std::make_shared<Symbol_Table>();
+    ret->path = display_path;
+
+    for (u32 i = 0; i < ehdr.e_phnum; i += 1) {
+        Elf64_Phdr phdr;
+        memcpy(&phdr, base + ehdr.e_phoff + i * sizeof(phdr), sizeof(phdr));
+
+        if (phdr.p_type == PT_LOAD) {
+            ret->loads.push_back({ phdr.p_offset, phdr.p_vaddr, phdr.p_filesz });
+        } else if (phdr.p_type == PT_NOTE && ret->build_id.empty() && phdr.p_offset + phdr.p_filesz <= size) {
+            ret->build_id = elf_note_build_id(base + phdr.p_offset, phdr.p_filesz);
+        }
+    }
+
+    std::vector<Elf64_Shdr> shdrs(ehdr.e_shnum);
+    for (u32 i = 0; i < ehdr.e_shnum; i += 1) {
+        memcpy(&shdrs[i], base + ehdr.e_shoff + i * sizeof(Elf64_Shdr), sizeof(Elf64_Shdr));
+    }
+
+    const Elf64_Shdr *symtab = NULL;
+    for (auto &shdr : shdrs) {
+        if (shdr.sh_type == SHT_SYMTAB)                   { symtab = &shdr; break; }
+        if (shdr.sh_type == SHT_DYNSYM && symtab == NULL) { symtab = &shdr; }
+    }
+
+    std::vector<std::tuple<u64, u64, std::string_view>> funcs;
+
+    if (symtab && symtab->sh_link < shdrs.size() && symtab->sh_offset + symtab->sh_size <= size) {
+        const Elf64_Shdr &strtab = shdrs[symtab->sh_link];
+
+        if (strtab.sh_offset + strtab.sh_size <= size) {
+            const char *strs = (const char*)base + strtab.sh_offset;
+
+            for (u64 off = 0; off + sizeof(Elf64_Sym) <= symtab->sh_size; off += sizeof(Elf64_Sym)) {
+                Elf64_Sym sym;
+                memcpy(&sym, base + symtab->sh_offset + off, sizeof(sym));
+
+                int type = ELF64_ST_TYPE(sym.st_info);
+
+                if ((type != STT_FUNC && type != STT_GNU_IFUNC) || sym.st_shndx == SHN_UNDEF || sym.st_value == 0) { continue; }
+                if (sym.st_name >= strtab.sh_size) { continue; }
+
+                funcs.emplace_back(sym.st_value, sym.st_size, std::string_view(strs + sym.st_name, strnlen(strs + sym.st_name, strtab.sh_size - sym.st_name)));
+            }
+        }
+    }
+
+    ret->finish(funcs);
+
+    if (ret->build_id.empty()) {
+        /* No build-id: fall back to identifying the file by where it is and when it changed. */
+        ret->build_id = "file:" + display_path + ":" + std::to_string(st.st_mtime);
+    }
+
+    return ret;
+}
+
+/* /proc/kallsyms as one more table; kernel addresses need no mapping. */
+inline std::shared_ptr<Symbol_Table> load_kernel_symbols() {
+    auto          ret = std::make_shared<Symbol_Table>();
+    std::ifstream kallsyms("/proc/kallsyms");
+    std::string   line;
+
+    std::vector<std::string>                             names;
+    std::vector<std::tuple<u64, u64, std::string_view>>  funcs;
+
+    ret->path = "[kernel.kallsyms]";
+
+    while (std::getline(kallsyms, line)) {
+        std::istringstream ss(line);
+        std::string        addr;
+        char               type;
+        std::string        name;
+
+        if (!(ss >> addr >> type >> name)) { continue; }
+        if (type != 't' && type != 'T')     { continue; }
+
+        u64 value = strtoull(addr.c_str(), NULL, 16);
+
+        /* All zeros when kptr_restrict hides them. */
+        if (value == 0) { continue; }
+
+        names.push_back(std::move(name));
+        funcs.emplace_back(value, 0, std::string_view());
+    }
+
+    for (size_t i = 0; i < funcs.size(); i += 1) {
+        std::get<2>(funcs[i]) = names[i];
+    }
+
+    ret->finish(funcs);
+
+    std::ifstream notes("/sys/kernel/notes", std::ios::binary);
+    std::string   raw((std::istreambuf_iterator<char>(notes)), std::istreambuf_iterator<char>());
+
+    ret->build_id = elf_note_build_id((const u8*)raw.data(), raw.size());
+    if (ret->build_id.empty()) {
+        ret->build_id = "kernel";
+    }
+
+    return ret;
+}
+
+/*
+ * A fixed set of threads that run a function over index ranges. The caller
+ * takes chunks too, so run() also makes progress with no workers at all.
+ */
+struct Worker_Pool {
+private:
+    static constexpr size_t CHUNK = 16;
+
+    std::vector<std::thread>                 workers;
+    std::mutex                               mtx;
+    std::condition_variable                  cv;
+    std::condition_variable                  done_cv;
+    std::function<void(size_t, size_t)>      job;
+    size_t                                   n_items    = 0;
+    std::atomic<size_t>                      next       { 0 };
+    size_t                                   n_active   = 0;
+    u64                                      generation = 0;
+    bool                                     should_stop = false;
+
+    void work() {
+        for (;;) {
+            size_t begin = this->next.fetch_add(CHUNK);
+            if (begin >= this->n_items) { break; }
+            this->job(begin, std::min(begin + CHUNK, this->n_items));
+        }
+    }
+
+    static void worker_thread(Worker_Pool &pool) {
+        u64 seen = 0;
+
+        std::unique_lock<std::mutex> lock(pool.mtx);
+
+        for (;;) {
+            pool.cv.wait(lock, [&] { return pool.should_stop || pool.generation != seen; });
+            if (pool.should_stop) { break; }
+
+            seen           = pool.generation;
+            pool.n_active += 1;
+
+            lock.unlock();
+            pool.work();
+            lock.lock();
+
+            pool.n_active -= 1;
+            if (pool.n_active == 0) {
+                pool.done_cv.notify_all();
+            }
+        }
+    }
+
+public:
+    Worker_Pool(size_t n_threads) {
+        for (size_t i = 0; i < n_threads; i += 1) {
+            this->workers.emplace_back(worker_thread, std::ref(*this));
+        }
+    }
+
+    Worker_Pool(const Worker_Pool&)            = delete;
+    Worker_Pool& operator=(const Worker_Pool&) = delete;
+
+    ~Worker_Pool() {
+        {
+            std::lock_guard<std::mutex> lock(this->mtx);
+            this->should_stop = true;
+        }
+        this->cv.notify_all();
+
+        for (auto &t : this->workers) {
+            t.join();
+        }
+    }
+
+    /* Calls fn(begin, end) over [0, n) in chunks and returns when all of them are done. */
+    void run(size_t n, std::function<void(size_t, size_t)> &&fn) {
+        {
+            std::unique_lock<std::mutex> lock(this->mtx);
+
+            /*
+             * A worker that only woke up for the previous job after the caller
+             * had finished it may still be looking at job and n_items.
+             */
+            this->done_cv.wait(lock, [this] { return this->n_active == 0; });
+
+            this->job         = std::move(fn);
+            this->n_items     = n;
+            this->next        = 0;
+            this->generation += 1;
+        }
+        this->cv.notify_all();
+
+        this->work();
+
+        std::unique_lock<std::mutex> lock(this->mtx);
+        this->done_cv.wait(lock, [this] { return this->n_active == 0; });
+    }
+};
+
+/*
+ * Turns (pid, ip) into interned symbol ids.
+ *
+ * A process's executable mappings come from /proc/<pid>/maps and are read
+ * again only when an address falls outside all of them, at most once per
+ * resolve() and outside the maps lock; a process whose maps can't be read is
+ * remembered as such and not tried again. Binaries are opened
+ * through /proc/<pid>/root so processes in other mount namespaces resolve
+ * too. Every cache lives as long as the Symbolizer, i.e. across profiling
+ * sessions; only the modules and symbols not sent yet go into a delta.
+ */
+struct Symbolizer {
+private:
+    struct Mapping {
+        u64                           start;
+        u64                           end;
+        u64                           offset;
+        std::string                   path;
+        std::shared_ptr<Symbol_Table> table;                /* Valid once has_table; null if the binary can't be loaded. */
+        bool                          has_table = false;
+    };
+
+    struct Process_Maps {
+        std::vector<Mapping> list;
+        bool                 readable = true;
+    };
+
+    using Table_Future = std::shared_future<std::shared_ptr<Symbol_Table>>;
+
+    Worker_Pool                                  pool;
+
+    std::mutex                                   maps_mtx;
+    std::map<u32, Process_Maps>                  maps;
+
+    std::mutex                                   tables_mtx;
+    std::map<std::string, Table_Future>          by_file;      /* dev:inode:mtime -> table */
+    std::map<std::string, std::shared_ptr<Symbol_Table>> by_build_id;
+    Table_Future                                 kernel;
+
+    /* Interning, under ids_mtx. */
+    std::mutex                                   ids_mtx;
+    std::vector<std::shared_ptr<Symbol_Table>>   modules;
+    std::vector<std::pair<u32, u32>>             symbols;       /* (module, index in its table) */
+    u32                                          sent_modules = 0;
+    u32                                          sent_symbols = 0;
+
+    /* Returns false if the maps can't be read, e.g. the process is gone. */
+    static bool read_maps(u32 pid, std::vector<Mapping> &out) {
+        std::ifstream in("/proc/" + std::to_string(pid) + "/maps");
+        std::string   line;
+
+        if (!in) { return false; }
+
+        while (std::getline(in, line)) {
+            Mapping m;
+            char    perms[8];
+            int     path_at = 0;
+
+            if (sscanf(line.c_str(), "%lx-%lx %7s %lx %*s %*s %n", &m.start, &m.end, perms, &m.offset, &path_at) < 4) { continue; }
+            if (perms[2] != 'x' || path_at <= 0 || line[path_at] != '/')                                               { continue; }
+            if (line.size() > 10 && line.compare(line.size() - 10, 10, " (deleted)") == 0)                          { continue; }
+
+            m.path = line.substr(path_at);
+            out.push_back(std::move(m));
+        }
+
+        std::sort(out.begin(), out.end(), [](auto &a, auto &b) { return a.start < b.start; });
+
+        return true;
+    }
+
+    void refresh_maps(u32 pid) {
+        Process_Maps p;
+
+        p.readable = read_maps(pid, p.list);
+
+        std::lock_guard<std::mutex> lock(this->maps_mtx);
+        this->maps.insert_or_assign(pid, std::move(p));
+    }
+
+    /*
+     * Looks in the cached maps only; `stale` says whether reading them again
+     * might find ip. The caller holds maps_mtx.
+     */
+    Mapping *find_mapping(u32 pid, u64 ip, bool &stale) {
+        auto it = this->maps.find(pid);
+        if (it == this->maps.end()) {
+            stale = true;
+            return NULL;
+        }
+
+        auto &list = it->second.list;
+        auto  m    = std::upper_bound(list.begin(), list.end(), ip, [](u64 ip, const Mapping &m) { return ip < m.start; });
+
+        if (m == list.begin() || ip >= (m - 1)->end) {
+            stale = it->second.readable;
+            return NULL;
+        }
+
+        return &*(m - 1);
+    }
+
+    std::shared_ptr<Symbol_Table> table_for(u32 pid, const std::string &path) {
+        std::string full = "/proc/" + std::to_string(pid) + "/root" + path;
+
+        struct stat st;
+        if (stat(full.c_str(), &st) < 0) { return NULL; }
+
+        std::string key = std::to_string(st.st_dev) + ":" + std::to_string(st.st_ino) + ":" + std::to_string(st.st_mtime);
+
+        std::promise<std::shared_ptr<Symbol_Table>> promise;
+        Table_Future                                future;
+
+        {
+            std::lock_guard<std::mutex> lock(this->tables_mtx);
+
+            auto [it, added] = this->by_file.try_emplace(key);
+            if (!added) {
+                future = it->second;
+                goto wait;
+            }
+            it->second = future = promise.get_future().share();
+        }
+
+        {
+            /* Parsed outside the lock; other workers wanting the same file wait on the future. */
+            auto table = load_elf_symbols(full, path);
+
+            if (table) {
+                std::lock_guard<std::mutex> lock(this->tables_mtx);
+
+                auto [it, added] = this->by_build_id.try_emplace(table->build_id, table);
+                table = it->second;
+            }
+
+            promise.set_value(table);
+        }
+
+wait:;
+        return future.get();
+    }
+
+    std::shared_ptr<Symbol_Table> kernel_table() {
+        std::promise<std::shared_ptr<Symbol_Table>> promise;
+        Table_Future                                future;
+        bool                                        load = false;
+
+        {
+            std::lock_guard<std::mutex> lock(this->tables_mtx);
+            if (!this->kernel.valid()) {
+                this->kernel = promise.get_future().share();
+                load         = true;
+            }
+            future = this->kernel;
+        }
+
+        if (load) {
+            promise.set_value(load_kernel_symbols());
+        }
+
+        return future.get();
+    }
+
+    u32 intern(const std::shared_ptr<Symbol_Table> &table, size_t index) {
+        std::lock_guard<std::mutex> lock(this->ids_mtx);
+
+        if (table->module_id == NO_SYMBOL) {
+            table->module_id = this->modules.size();
+            this->modules.push_back(table);
+        }
+
+        u32 &id = table->symbol_id[index];
+        if (id == NO_SYMBOL) {
+            id = this->symbols.size();
+            this->symbols.push_back({ table->module_id, (u32)index });
+        }
+
+        return id;
+    }
+
+    u32 resolve_one(u32 pid, u64 ip, bool &stale) {
+        stale = false;
+
+        if (ip >= KERNEL_START) {
+            auto table = this->kernel_table();
+            s64  i     = table->find(ip);
+            return i < 0 ? NO_SYMBOL : this->intern(table, i);
+        }
+
+        std::shared_ptr<Symbol_Table> table;
+        std::string                   path;
+        u64                           start;
+        u64                           file_offset;
+        bool                          has_table;
+
+        {
+            std::lock_guard<std::mutex> lock(this->maps_mtx);
+
+            Mapping *m = this->find_mapping(pid, ip, stale);
+            if (!m) { return NO_SYMBOL; }
+
+            start       = m->start;
+            file_offset = ip - m->start + m->offset;
+            has_table   = m->has_table;
+
+            if (has_table) {
+                table = m->table;
+            } else {
+                path = m->path;
+            }
+        }
+
+        /* Only the first address in a mapping stats its binary; the table stays on the mapping until the maps are read again. */
+        if (!has_table) {
+            table = this->table_for(pid, path);
+
+            std::lock_guard<std::mutex> lock(this->maps_mtx);
+
+            bool     s;
+            Mapping *m = this->find_mapping(pid, ip, s);
+
+            if (m && m->start == start && m->path == path) {
+                m->table     = table;
+                m->has_table = true;
+            }
+        }
+
+        if (!table) { return NO_SYMBOL; }
+
+        s64 i = table->find(table->vaddr_of(file_offset));
+
+        return i < 0 ? NO_SYMBOL : this->intern(table, i);
+    }
+
+public:
+    static constexpr u64 KERNEL_START = 0xFFFF800000000000ull;
+
+    Symbolizer(size_t n_threads = std::min(std::thread::hardware_concurrency(), 4u)) : pool(n_threads ? n_threads - 1 : 0) {}
+
+    /* out[i] is the symbol id of ips[i] in process pids[i], or NO_SYMBOL. */
+    void resolve(const std::vector<u32> &pids, const std::vector<u64> &ips, std::vector<u32> &out) {
+        std::vector<u8> stale(ips.size(), 0);
+
+        out.assign(ips.size(), NO_SYMBOL);
+
+        this->pool.run(ips.size(), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i += 1) {
+                bool s;
+                out[i]   = this->resolve_one(pids[i], ips[i], s);
+                stale[i] = s;
+            }
+        });
+
+        /* Misses against the cached maps: read each process's maps once, then try those addresses again. */
+        std::vector<size_t> retry;
+        std::vector<u32>    retry_pids;
+
+        for (size_t i = 0; i < ips.size(); i += 1) {
+            if (stale[i]) {
+                retry.push_back(i);
+                retry_pids.push_back(pids[i]);
+            }
+        }
+
+        if (retry.empty()) { return; }
+
+        std::sort(retry_pids.begin(), retry_pids.end());
+        retry_pids.erase(std::unique(retry_pids.begin(), retry_pids.end()), retry_pids.end());
+
+        this->pool.run(retry_pids.size(), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i += 1) {
+                this->refresh_maps(retry_pids[i]);
+            }
+        });
+
+        this->pool.run(retry.size(), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i += 1) {
+                bool s;
+                out[retry[i]] = this->resolve_one(pids[retry[i]], ips[retry[i]], s);
+            }
+        });
+    }
+
+    /* The modules and symbols interned since the last call. */
+    void take_new(Stack_Trie_Delta &delta) {
+        std::lock_guard<std::mutex> lock(this->ids_mtx);
+
+        delta.first_module = this->sent_modules;
+        for (size_t i = this->sent_modules; i < this->modules.size(); i += 1) {
+            delta.module_path.push_back(this->modules[i]->path);
+            delta.module_build_id.push_back(this->modules[i]->build_id);
+        }
+
+        delta.first_symbol = this->sent_symbols;
+        for (size_t i = this->sent_symbols; i < this->symbols.size(); i += 1) {
+            auto [module, index] = this->symbols[i];
+            auto &table          = *this->modules[module];
+
+            delta.symbol_module.push_back(module);
+            delta.symbol_addr.push_back(table.addr[index]);
+            delta.symbol_name.emplace_back(table.name(index));
+        }
+
+        this->sent_modules = this->modules.size();
+        this->sent_symbols = this->symbols.size();
+    }
+
+    /* Forgets the cached maps, e.g. between sessions; binaries stay cached. */
+    void forget_processes() {
+        std::lock_guard<std::mutex> lock(this->maps_mtx);
+        this->maps.clear();
+    }
+};
+
+}
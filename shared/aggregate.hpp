@@ -0,0 +1,222 @@
+#pragma once
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+#include "common.hpp"
+#include "profile.hpp"
+
+namespace {
+
+/*
+ * Log-linear bins: values below SUB get a bin each, above that every power of
+ * two is split into SUB equal bins, so a bin's width is at most 1/SUB of its
+ * lower bound. All of u64 fits in fewer than 500 bins.
+ */
+struct Log_Linear_Histogram {
+    static constexpr int SUB_BITS = 3;
+    static constexpr u64 SUB      = 1 << SUB_BITS;
+
+    static u16 bin(u64 v) {
+        if (v < SUB) { return v; }
+
+        int e   = 63 - __builtin_clzll(v);
+        u64 sub = (v >> (e - SUB_BITS)) & (SUB - 1);
+
+        return (e - SUB_BITS + 1) * SUB + sub;
+    }
+
+    /* Smallest value that falls into bin b. */
+    static u64 lower_bound(u16 b) {
+        if (b < SUB) { return b; }
+
+        int group = b / SUB;
+        u64 sub   = b % SUB;
+
+        return (SUB + sub) << (group - 1);
+    }
+};
+
+/*
+ * Reduces rows of series values (e.g. the counter ticks of the live monitor)
+ * into fixed-width time buckets. Buckets close as soon as a row lands in a
+ * later one; a bucket that gets no rows at all is still emitted, with
+ * count 0, so the buckets of a batch are always contiguous.
+ *
+ * A value with confidence 0 was not measured at all (its counter group was
+ * rotated out for the whole tick) and is left out, so count is the number of
+ * ticks in which the series was actually measured, not the number of rows.
+ */
+struct Bucket_Aggregator {
+private:
+    struct Cell {
+        u64              sum   = 0;
+        u64              min   = 0;
+        u64              max   = 0;
+        u32              count = 0;
+        std::vector<u16> bins;
+    };
+
+    size_t                                         n_series   = 0;
+    u64                                            bucket_ns  = 1;
+    bool                                           histograms = false;
+    bool                                           have_open  = false;
+    u64                                            open_bucket  = 0;
+    u64                                            first_closed = 0;
+    std::vector<Cell>                              cells;           /* The open bucket, one per series. */
+
+    /* Closed buckets, bucket-major until take() transposes them. */
+    size_t                                         n_closed = 0;
+    std::vector<u64>                               sum;
+    std::vector<u64>                               min;
+    std::vector<u64>                               max;
+    std::vector<u32>                               count;
+    std::vector<std::vector<std::pair<u16, u32>>>  hists;
+
+    void close_bucket() {
+        if (this->n_closed == 0) {
+            this->first_closed = this->open_bucket;
+        }
+
+        for (auto &cell : this->cells) {
+            this->sum.push_back(cell.sum);
+            this->min.push_back(cell.min);
+            this->max.push_back(cell.max);
+            this->count.push_back(cell.count);
+
+            if (this->histograms) {
+                std::vector<std::pair<u16, u32>> runs;
+
+                std::sort(cell.bins.begin(), cell.bins.end());
+                for (u16 b : cell.bins) {
+                    if (!runs.empty() && runs.back().first == b) {
+                        runs.back().second += 1;
+                    } else {
+                        runs.push_back({ b, 1 });
+                    }
+                }
+
+                this->hists.push_back(std::move(runs));
+            }
+
+            cell.sum   = 0;
+            cell.min   = 0;
+            cell.max   = 0;
+            cell.count = 0;
+            cell.bins.clear();
+        }
+
+        this->n_closed    += 1;
+        this->open_bucket += 1;
+    }
+
+public:
+    void reset(size_t n_series, u64 bucket_ns, bool histograms) {
+        this->n_series   = n_series;
+        this->bucket_ns  = std::max(bucket_ns, (u64)1);
+        this->histograms = histograms;
+        this->have_open  = false;
+        this->n_closed   = 0;
+
+        this->cells.assign(n_series, Cell());
+        this->sum.clear();
+        this->min.clear();
+        this->max.clear();
+        this->count.clear();
+        this->hists.clear();
+    }
+
+    size_t closed_buckets() const { return this->n_closed; }
+
+    void add_row(u64 time_ns, const u64 *values, const f32 *confidence) {
+        u64 bucket = time_ns / this->bucket_ns;
+
+        if (!this->have_open) {
+            this->open_bucket = bucket;
+            this->have_open   = true;
+        }
+
+        while (this->open_bucket < bucket) {
+            this->close_bucket();
+        }
+
+        for (size_t s = 0; s < this->n_series; s += 1) {
+            if (confidence[s] <= 0) { continue; }
+
+            Cell &cell = this->cells[s];
+            u64   v    = values[s];
+
+            cell.min    = cell.count ? std::min(cell.min, v) : v;
+            cell.max    = cell.count ? std::max(cell.max, v) : v;
+            cell.sum   += v;
+            cell.count += 1;
+
+            if (this->histograms) {
+                cell.bins.push_back(Log_Linear_Histogram::bin(v));
+            }
+        }
+    }
+
+    /*
+     * Moves the closed buckets into batch (series-major). With close_open, the
+     * bucket still being filled is closed first, as at the end of a stream.
+     * Returns false if there was nothing to take.
+     */
+    bool take(Monitor_Aggregate_Batch &batch, bool close_open = false) {
+        if (close_open && this->have_open && std::any_of(this->cells.begin(), this->cells.end(), [](const Cell &c) { return c.count > 0; })) {
+            this->close_bucket();
+        }
+
+        if (this->n_closed == 0) { return false; }
+
+        size_t nb = this->n_closed;
+        size_t ns = this->n_series;
+
+        batch.bucket_ns    = this->bucket_ns;
+        batch.first_bucket = this->first_closed;
+        batch.n_buckets    = nb;
+
+        batch.sum.resize(ns * nb);
+        batch.min.resize(ns * nb);
+        batch.max.resize(ns * nb);
+        batch.count.resize(ns * nb);
+
+        for (size_t b = 0; b < nb; b += 1) {
+            for (size_t s = 0; s < ns; s += 1) {
+                batch.sum[s * nb + b]   = this->sum[b * ns + s];
+                batch.min[s * nb + b]   = this->min[b * ns + s];
+                batch.max[s * nb + b]   = this->max[b * ns + s];
+                batch.count[s * nb + b] = this->count[b * ns + s];
+            }
+        }
+
+        batch.hist_offsets.clear();
+        batch.hist_bins.clear();
+        batch.hist_counts.clear();
+
+        if (this->histograms) {
+            batch.hist_offsets.push_back(0);
+            for (size_t s = 0; s < ns; s += 1) {
+                for (size_t b = 0; b < nb; b += 1) {
+                    for (auto &[bin, n] : this->hists[b * ns + s]) {
+                        batch.hist_bins.push_back(bin);
+                        batch.hist_counts.push_back(n);
+                    }
+                    batch.hist_offsets.push_back(batch.hist_bins.size());
+                }
+            }
+        }
+
+        this->n_closed = 0;
+        this->sum.clear();
+        this->min.clear();
+        this->max.clear();
+        this->count.clear();
+        this->hists.clear();
+
+        return true;
+    }
+};
+
+}
@@ -0,0 +1,418 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <stdexcept>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BASE64_SIMD_X86 1
+#endif
+
+#include "common.hpp"
+#include "base64.hpp"
+
+namespace {
+
+/*
+ * Vectorized base64 for the link payloads. The kernels below only ever
+ * process whole blocks that contain no padding; everything else (tails,
+ * padding, error reporting) goes through the scalar tables in base64.hpp,
+ * which remain the reference implementation.
+ *
+ * The encode kernels follow Muła & Lemire's pshufb/multiply formulation and
+ * the decode kernels do lookup-based validation so that any non-alphabet
+ * character stops the kernel and lets the scalar path raise the error.
+ */
+
+struct Base64_Kernels {
+    const char *name;
+    /* Return the number of input bytes consumed (a multiple of 3 or 4). */
+    size_t (*encode)(const u8 *in, size_t n, char *out);
+    size_t (*decode)(const char *in, size_t n, u8 *out);
+};
+
+inline void base64_scalar_encode_triples(const u8 *in, size_t n_triples, char *out) {
+    for (size_t i = 0; i < n_triples; i += 1) {
+        const u8 t1 = in[0];
+        const u8 t2 = in[1];
+        const u8 t3 = in[2];
+
+        out[0] = base64::detail::encode_table_0[t1];
+        out[1] = base64::detail::encode_table_1[((t1 & 0x03) << 4) | ((t2 >> 4) & 0x0F)];
+        out[2] = base64::detail::encode_table_1[((t2 & 0x0F) << 2) | ((t3 >> 6) & 0x03)];
+        out[3] = base64::detail::encode_table_1[t3];
+
+        in  += 3;
+        out += 4;
+    }
+}
+
+inline bool base64_scalar_decode_quads(const char *in, size_t n_quads, char *out) {
+    const u8 *bytes = (const u8*)in;
+
+    for (size_t i = 0; i < n_quads; i += 1) {
+        const u32 temp =   base64::detail::decode_table_0[bytes[0]]
+                         | base64::detail::decode_table_1[bytes[1]]
+                         | base64::detail::decode_table_2[bytes[2]]
+                         | base64::detail::decode_table_3[bytes[3]];
+
+        if (temp >= base64::detail::bad_char) { return false; }
+
+        const auto temp_bytes = base64::detail::bit_cast<std::array<char, 4>, u32>(temp);
+
+        out[0] = temp_bytes[base64::detail::decidx0];
+        out[1] = temp_bytes[base64::detail::decidx1];
+        out[2] = temp_bytes[base64::detail::decidx2];
+
+        bytes += 4;
+        out   += 3;
+    }
+
+    return true;
+}
+
+inline size_t base64_scalar_encode(const u8 *in, size_t n, char *out) {
+    base64_scalar_encode_triples(in, n / 3, out);
+    return n - (n % 3);
+}
+
+inline size_t base64_scalar_decode(const char *in, size_t n, u8 *out) {
+    size_t n_quads = n / 4;
+    return base64_scalar_decode_quads(in, n_quads, (char*)out) ? n_quads * 4 : 0;
+}
+
+#ifdef BASE64_SIMD_X86
+
+__attribute__((target("sse4.1")))
+inline __m128i base64_sse_encode_block(__m128i in) {
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+
+    const __m128i t0      = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    const __m128i t1      = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    const __m128i t2      = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    const __m128i t3      = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    const __m128i indices = _mm_or_si128(t1, t3);
+
+    const __m128i shift_lut = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                            '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                            '/' - 63, 'A', 0, 0);
+
+    __m128i result = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    __m128i less   = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+    result         = _mm_or_si128(result, _mm_and_si128(less, _mm_set1_epi8(13)));
+    result         = _mm_shuffle_epi8(shift_lut, result);
+
+    return _mm_add_epi8(result, indices);
+}
+
+__attribute__((target("sse4.1")))
+inline size_t base64_sse_encode(const u8 *in, size_t n, char *out) {
+    size_t i = 0;
+
+    /* Each step reads 16 bytes but only consumes 12. */
+    for (; i + 16 <= n; i += 12) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(in + i));
+        _mm_storeu_si128((__m128i*)out, base64_sse_encode_block(block));
+        out += 16;
+    }
+
+    return i;
+}
+
+__attribute__((target("sse4.1")))
+inline bool base64_sse_decode_block(__m128i in, __m128i *out) {
+    const __m128i lut_lo   = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                           0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m128i lut_hi   = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                           0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+                                           0,  0,  0, 0,   0,   0,   0,   0);
+    const __m128i mask_2f  = _mm_set1_epi8(0x2f);
+
+    const __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(in, 4), mask_2f);
+    const __m128i lo_nibbles = _mm_and_si128(in, mask_2f);
+    const __m128i lo         = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+    const __m128i hi         = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+
+    if (!_mm_testz_si128(lo, hi)) { return false; }
+
+    const __m128i eq_2f  = _mm_cmpeq_epi8(in, mask_2f);
+    const __m128i roll   = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles));
+    const __m128i values = _mm_add_epi8(in, roll);
+
+    const __m128i merge_ab_bc = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+    const __m128i merged      = _mm_madd_epi16(merge_ab_bc, _mm_set1_epi32(0x00011000));
+
+    *out = _mm_shuffle_epi8(merged, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+
+    return true;
+}
+
+__attribute__((target("sse4.1")))
+inline size_t base64_sse_decode(const char *in, size_t n, u8 *out) {
+    size_t i = 0;
+
+    /* Each step writes 16 bytes but only produces 12, so stay one block clear of the end. */
+    for (; i + 24 <= n; i += 16) {
+        __m128i block;
+        if (!base64_sse_decode_block(_mm_loadu_si128((const __m128i*)(in + i)), &block)) { break; }
+        _mm_storeu_si128((__m128i*)out, block);
+        out += 12;
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+inline size_t base64_avx2_encode(const u8 *in, size_t n, char *out) {
+    const __m256i shuf      = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+                                               1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+    const __m256i shift_lut = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                               '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                               '/' - 63, 'A', 0, 0,
+                                               'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                               '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                               '/' - 63, 'A', 0, 0);
+    size_t i = 0;
+
+    /* Each step reads 28 bytes (two overlapping 16-byte lanes) but only consumes 24. */
+    for (; i + 28 <= n; i += 24) {
+        __m256i block = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(in + i))),
+                                                _mm_loadu_si128((const __m128i*)(in + i + 12)), 1);
+
+        block = _mm256_shuffle_epi8(block, shuf);
+
+        const __m256i t0      = _mm256_and_si256(block, _mm256_set1_epi32(0x0fc0fc00));
+        const __m256i t1      = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+        const __m256i t2      = _mm256_and_si256(block, _mm256_set1_epi32(0x003f03f0));
+        const __m256i t3      = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+        const __m256i indices = _mm256_or_si256(t1, t3);
+
+        __m256i result = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+        __m256i less   = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+        result         = _mm256_or_si256(result, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+        result         = _mm256_shuffle_epi8(shift_lut, result);
+        result         = _mm256_add_epi8(result, indices);
+
+        _mm256_storeu_si256((__m256i*)out, result);
+        out += 32;
+    }
+
+    return i + base64_sse_encode(in + i, n - i, out);
+}
+
+__attribute__((target("avx2")))
+inline size_t base64_avx2_decode(const char *in, size_t n, u8 *out) {
+    const __m256i lut_lo   = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                              0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+                                              0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                              0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m256i lut_hi   = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                              0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                              0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                              0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+                                              0,  0,  0, 0,   0,   0,   0,   0,
+                                              0, 16, 19, 4, -65, -65, -71, -71,
+                                              0,  0,  0, 0,   0,   0,   0,   0);
+    const __m256i pack     = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                              2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m256i mask_2f  = _mm256_set1_epi8(0x2f);
+    size_t i = 0;
+
+    /* Each step writes 32 bytes but only produces 24, so stay clear of the end. */
+    for (; i + 48 <= n; i += 32) {
+        const __m256i block      = _mm256_loadu_si256((const __m256i*)(in + i));
+        const __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(block, 4), mask_2f);
+        const __m256i lo_nibbles = _mm256_and_si256(block, mask_2f);
+        const __m256i lo         = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+        const __m256i hi         = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+
+        if (!_mm256_testz_si256(lo, hi)) { return i; }
+
+        const __m256i eq_2f  = _mm256_cmpeq_epi8(block, mask_2f);
+        const __m256i roll   = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles));
+        const __m256i values = _mm256_add_epi8(block, roll);
+
+        const __m256i merge_ab_bc = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+        __m256i       merged      = _mm256_madd_epi16(merge_ab_bc, _mm256_set1_epi32(0x00011000));
+
+        merged = _mm256_shuffle_epi8(merged, pack);
+        merged = _mm256_permutevar8x32_epi32(merged, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1));
+
+        _mm256_storeu_si256((__m256i*)out, merged);
+        out += 24;
+    }
+
+    return i + base64_sse_decode(in + i, n - i, out);
+}
+
+#endif /* BASE64_SIMD_X86 */
+
+inline Base64_Kernels base64_select_kernels() {
+#ifdef BASE64_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return { "avx2", base64_avx2_encode, base64_avx2_decode };
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        return { "sse4.1", base64_sse_encode, base64_sse_decode };
+    }
+#endif
+    return { "scalar", base64_scalar_encode, base64_scalar_decode };
+}
+
+static const Base64_Kernels base64_kernels = base64_select_kernels();
+
+/* kernels is only ever overridden to test one kernel against the others. */
+inline std::string base64_encode(std::string_view data, const Base64_Kernels &kernels = base64_kernels) {
+    const u8 *in = (const u8*)data.data();
+    size_t    n  = data.size();
+
+    std::string out(((n + 2) / 3) * 4, base64::detail::padding_char);
+    char       *dst = out.data();
+
+    size_t done = kernels.encode(in, n, dst);
+    dst += (done / 3) * 4;
+
+    size_t triples = (n - done) / 3;
+    base64_scalar_encode_triples(in + done, triples, dst);
+    done += triples * 3;
+    dst  += triples * 4;
+
+    switch (n - done) {
+        case 1:
+            dst[0] = base64::detail::encode_table_0[in[done]];
+            dst[1] = base64::detail::encode_table_1[(in[done] & 0x03) << 4];
+            break;
+        case 2:
+            dst[0] = base64::detail::encode_table_0[in[done]];
+            dst[1] = base64::detail::encode_table_1[((in[done] & 0x03) << 4) | ((in[done + 1] >> 4) & 0x0F)];
+            dst[2] = base64::detail::encode_table_1[(in[done + 1] & 0x0F) << 2];
+            break;
+    }
+
+    return out;
+}
+
+/* Decode unpadded 4-character groups into 3-byte groups. Returns false on a bad character. */
+inline bool base64_decode_quads(const char *in, size_t n_quads, char *out, const Base64_Kernels &kernels = base64_kernels) {
+    size_t done = kernels.decode(in, n_quads * 4, (u8*)out);
+    return base64_scalar_decode_quads(in + done, n_quads - done / 4, out + (done / 4) * 3);
+}
+
+inline std::string base64_decode(std::string_view text, const Base64_Kernels &kernels = base64_kernels) {
+    if (text.empty()) { return {}; }
+
+    if ((text.size() & 3) != 0) {
+        throw std::runtime_error{"Invalid base64 encoded data - Size not divisible by 4"};
+    }
+
+    /* Only the last group may carry padding, so it takes the scalar path. */
+    size_t      n_quads = text.size() / 4 - 1;
+    std::string last    = base64::from_base64(text.substr(n_quads * 4));
+    std::string out(n_quads * 3 + last.size(), 0);
+
+    if (!base64_decode_quads(text.data(), n_quads, out.data(), kernels)) {
+        throw std::runtime_error{"Invalid base64 encoded data - Invalid character"};
+    }
+
+    memcpy(out.data() + n_quads * 3, last.data(), last.size());
+
+    return out;
+}
+
+/*
+ * Decodes a base64 stream as it arrives, straight into the output buffer, so
+ * that the encoded text never has to be held in full. The last complete
+ * group is always held back since it is the only one that may carry padding.
+ *
+ * Nothing says how long a message will be until its terminator arrives, so
+ * the output is reserved at the previous message's decoded size: a run of
+ * similar messages then costs one allocation each instead of a growth series.
+ */
+struct Base64_Stream_Decoder {
+private:
+    const Base64_Kernels *kernels;
+    std::string           out;
+    size_t                expected  = 0;    /* The previous message's decoded size. */
+    char                  pending[8];
+    int                   n_pending = 0;
+    bool                  ok        = true;
+
+    void decode(const char *in, size_t n_quads) {
+        if (n_quads == 0) { return; }
+
+        size_t old = this->out.size();
+
+        this->out.resize(old + n_quads * 3);
+
+        if (!base64_decode_quads(in, n_quads, this->out.data() + old, *this->kernels)) {
+            this->ok = false;
+        }
+    }
+
+public:
+    Base64_Stream_Decoder(const Base64_Kernels &kernels = base64_kernels) : kernels(&kernels) {}
+
+    void reset() {
+        this->out.clear();
+        this->out.reserve(this->expected);
+        this->n_pending = 0;
+        this->ok        = true;
+    }
+
+    void feed(const char *in, size_t n) {
+        if (!this->ok) { return; }
+
+        /* Complete the partial group left over from the previous feed. */
+        while (this->n_pending % 4 != 0 && n > 0) {
+            this->pending[this->n_pending++] = *in++;
+            n -= 1;
+        }
+
+        if (this->n_pending % 4 != 0) { return; }
+
+        if (n >= 4) {
+            size_t n_quads = n / 4 - 1;
+            size_t rest    = n - n_quads * 4;
+
+            this->decode(this->pending, this->n_pending / 4);
+            this->decode(in, n_quads);
+
+            memcpy(this->pending, in + n_quads * 4, rest);
+            this->n_pending = rest;
+        } else {
+            if (this->n_pending == 8) {
+                this->decode(this->pending, 1);
+                memmove(this->pending, this->pending + 4, 4);
+                this->n_pending = 4;
+            }
+
+            memcpy(this->pending + this->n_pending, in, n);
+            this->n_pending += n;
+        }
+    }
+
+    std::string finish() {
+        if (!this->ok) {
+            throw std::runtime_error{"Invalid base64 encoded data - Invalid character"};
+        }
+        if (this->n_pending != 0 && this->n_pending != 4) {
+            throw std::runtime_error{"Invalid base64 encoded data - Size not divisible by 4"};
+        }
+
+        if (this->n_pending == 4) {
+            this->out += base64::from_base64(std::string_view(this->pending, 4));
+            this->n_pending = 0;
+        }
+
+        this->expected = this->out.size();
+
+        return std::move(this->out);
+    }
+};
+
+}
@@ -1,6 +1,9 @@
 #pragma once
 
 #include <cstdint>
+#include <istream>
+#include <streambuf>
+#include <string_view>
 
 typedef uint8_t  u8;
 typedef uint16_t u16;
@@ -42,3 +45,15 @@ struct {
 #define TOKENPASTE(x, y) x ## y
 #define TOKENPASTE2(x, y) TOKENPASTE(x, y)
 #define DEFER auto TOKENPASTE2(__deferred_lambda_call, __COUNTER__) = deferrer << [&]
+
+/* Read-only istream over memory someone else owns, e.g. a message payload view. */
+struct View_Streambuf : std::streambuf {
+    View_Streambuf(std::string_view data) {
+        char *p = const_cast<char*>(data.data());
+        this->setg(p, p, p + data.size());
+    }
+};
+
+struct View_Istream : private View_Streambuf, public std::istream {
+    View_Istream(std::string_view data) : View_Streambuf(data), std::istream(static_cast<View_Streambuf*>(this)) {}
+};
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+#include "common.hpp"
+
+#if __has_include(<lz4.h>)
+#include <lz4.h>
+#define LINK_HAVE_LZ4 1
+#endif
+
+#if __has_include(<zstd.h>)
+#include <zstd.h>
+#define LINK_HAVE_ZSTD 1
+#endif
+
+namespace {
+
+/*
+ * Per-message payload compression. Which codecs an end can use is advertised
+ * through the link capability bits, so a build without one of the libraries
+ * simply never offers it. Small messages aren't worth the round trip through
+ * a compressor and are always sent raw, as are messages that don't shrink.
+ */
+
+enum class Link_Codec : u8 {
+    NONE = 0,
+    LZ4  = 1,
+    ZSTD = 2,
+};
+
+static constexpr size_t LINK_COMPRESS_THRESHOLD = 1024;
+static constexpr size_t LINK_ZSTD_THRESHOLD     = 64 * 1024;
+static constexpr int    LINK_ZSTD_LEVEL         = 3;
+
+inline Link_Codec link_pick_codec(bool lz4, bool zstd, size_t size) {
+    if (size < LINK_COMPRESS_THRESHOLD) { return Link_Codec::NONE; }
+
+    /* zstd is denser but slower; it only pays for itself on bulk payloads. */
+    if (zstd && (size >= LINK_ZSTD_THRESHOLD || !lz4)) { return Link_Codec::ZSTD; }
+    if (lz4)                                            { return Link_Codec::LZ4;  }
+
+    return Link_Codec::NONE;
+}
+
+inline bool link_compress(Link_Codec codec, std::string_view in, std::string &out) {
+    switch (codec) {
+#ifdef LINK_HAVE_LZ4
+        case Link_Codec::LZ4: {
+            if (in.size() > (size_t)LZ4_MAX_INPUT_SIZE) { return false; }
+
+            /* LZ4 blocks don't record their size, so prefix it (little-endian). */
+            u32 size  = in.size();
+            int bound = LZ4_compressBound(in.size());
+
+            out.resize(sizeof(u32) + bound);
+            out[0] = (char)(size         & 0xFF);
+            out[1] = (char)((size >> 8)  & 0xFF);
+            out[2] = (char)((size >> 16) & 0xFF);
+            out[3] = (char)((size >> 24) & 0xFF);
+
+            int n = LZ4_compress_default(in.data(), out.data() + sizeof(u32), in.size(), bound);
+            if (n <= 0) { return false; }
+
+            out.resize(sizeof(u32) + n);
+            break;
+        }
+#endif
+#ifdef LINK_HAVE_ZSTD
+        case Link_Codec::ZSTD: {
+            out.resize(ZSTD_compressBound(in.size()));
+
+            size_t n = ZSTD_compress(out.data(), out.size(), in.data(), in.size(), LINK_ZSTD_LEVEL);
+            if (ZSTD_isError(n)) { return false; }
+
+            out.resize(n);
+            break;
+        }
+#endif
+        default:
+            return false;
+    }
+
+    return out.size() < in.size();
+}
+
+inline bool link_decompress(Link_Codec codec, std::string_view in, std::string &out) {
+    switch (codec) {
+        case Link_Codec::NONE:
+            out.assign(in);
+            return true;
+#ifdef LINK_HAVE_LZ4
+        case Link_Codec::LZ4: {
+            if (in.size() < sizeof(u32)) { return false; }
+
+            const u8 *p    = (const u8*)in.data();
+            u32       size = (u32)p[0] | ((u32)p[1] << 8) | ((u32)p[2] << 16) | ((u32)p[3] << 24);
+
+            if (size > (u32)LZ4_MAX_INPUT_SIZE) { return false; }
+
+            out.resize(size);
+
+            int n = LZ4_decompress_safe(in.data() + sizeof(u32), out.data(), in.size() - sizeof(u32), size);
+
+            return n >= 0 && (u32)n == size;
+        }
+#endif
+#ifdef LINK_HAVE_ZSTD
+        case Link_Codec::ZSTD: {
+            unsigned long long size = ZSTD_getFrameContentSize(in.data(), in.size());
+
+            if (size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN || size > (1ull << 30)) {
+                return false;
+            }
+
+            out.resize(size);
+
+            size_t n = ZSTD_decompress(out.data(), out.size(), in.data(), in.size());
+
+            return !ZSTD_isError(n) && n == size;
+        }
+#endif
+        default:
+            return false;
+    }
+}
+
+}
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <array>
+#include <string>
+#include <string_view>
+#include <initializer_list>
+#include <utility>
+#include <cstring>
+
+#include "common.hpp"
+
+namespace {
+
+/*
+ * Every message carried by the link starts with a fixed little-endian header
+ *
+ *     u16 opcode | u16 flags | u32 request id | u32 payload length
+ *
+ * followed by the payload as opaque bytes (text, cereal archives, raw arrays),
+ * so nothing about a payload can be mistaken for a field separator. Receivers
+ * index a handler table with the opcode and hand the handler a view into the
+ * buffer the message arrived in.
+ *
+ * Requests carry an id chosen by the sender; the reply echoes it back with
+ * LINK_MSG_REPLY set. Unsolicited messages use request id 0.
+ */
+
+enum class Link_Op : u16 {
+    SERVER_CONNECT,
+    SERVER_WARNING,
+    LINK_CAPS_REQUEST,
+    LINK_CAPS,
+    TOPOLOGY_REQUEST,
+    TOPOLOGY,
+    CONFIG_REQUEST,
+    CONFIG,
+    HEATMAP_REQUEST,
+    HEATMAP_DATA,
+    MONITOR_START,
+    MONITOR_STARTED,
+    MONITOR_BATCH,
+    MONITOR_AGGREGATE,
+    MONITOR_STOP,
+    PROFILE_START,
+    STACK_DELTA,
+    PROFILE_STOP,
+
+    COUNT,
+};
+
+enum Link_Message_Flags : u16 {
+    LINK_MSG_REPLY = 1 << 0,
+};
+
+static constexpr const char *link_op_names[] = {
+    "SERVER-CONNECT",
+    "SERVER-WARNING",
+    "REQUEST/LINK-CAPS",
+    "LINK-CAPS",
+    "REQUEST/TOPOLOGY",
+    "TOPOLOGY",
+    "REQUEST/CONFIG",
+    "CONFIG",
+    "REQUEST/HEATMAP-DATA",
+    "HEATMAP-DATA",
+    "REQUEST/MONITOR-START",
+    "MONITOR-STARTED",
+    "MONITOR-BATCH",
+    "MONITOR-AGGREGATE",
+    "REQUEST/MONITOR-STOP",
+    "REQUEST/PROFILE-START",
+    "STACK-DELTA",
+    "REQUEST/PROFILE-STOP",
+};
+
+static_assert(std::size(link_op_names) == (size_t)Link_Op::COUNT, "every opcode needs a name");
+
+static constexpr size_t LINK_MESSAGE_HEADER_SIZE = 2 * sizeof(u16) + 2 * sizeof(u32);
+
+struct Link_Message {
+    Link_Op          op;
+    u16              flags;
+    u32              request_id;
+    std::string_view payload;
+};
+
+inline const char *link_op_name(Link_Op op) {
+    if ((size_t)op >= (size_t)Link_Op::COUNT) { return "UNKNOWN"; }
+    return link_op_names[(size_t)op];
+}
+
+inline void link_put_le(std::string &out, u64 value, int bytes) {
+    for (int i = 0; i < bytes; i += 1) {
+        out += (char)((value >> (8 * i)) & 0xFF);
+    }
+}
+
+inline u64 link_get_le(const char *p, int bytes) {
+    u64 value = 0;
+    for (int i = 0; i < bytes; i += 1) {
+        value |= (u64)(u8)p[i] << (8 * i);
+    }
+    return value;
+}
+
+inline std::string link_message(Link_Op op, std::string_view payload = {}, u32 request_id = 0, u16 flags = 0) {
+    std::string out;
+
+    out.reserve(LINK_MESSAGE_HEADER_SIZE + payload.size());
+
+    link_put_le(out, (u16)op,         sizeof(u16));
+    link_put_le(out, flags,           sizeof(u16));
+    link_put_le(out, request_id,      sizeof(u32));
+    link_put_le(out, payload.size(),  sizeof(u32));
+
+    out.append(payload);
+
+    return out;
+}
+
+inline std::string link_reply(const Link_Message &request, Link_Op op, std::string_view payload = {}) {
+    return link_message(op, payload, request.request_id, LINK_MSG_REPLY);
+}
+
+/* msg.payload points into raw, which must outlive it. */
+inline bool link_message_parse(std::string_view raw, Link_Message &msg) {
+    if (raw.size() < LINK_MESSAGE_HEADER_SIZE) { return false; }
+
+    const char *p = raw.data();
+
+    u16 op     = link_get_le(p,      sizeof(u16));
+    u16 flags  = link_get_le(p + 2,  sizeof(u16));
+    u32 id     = link_get_le(p + 4,  sizeof(u32));
+    u32 length = link_get_le(p + 8,  sizeof(u32));
+
+    if (op >= (u16)Link_Op::COUNT || length != raw.size() - LINK_MESSAGE_HEADER_SIZE) {
+        return false;
+    }
+
+    msg.op         = (Link_Op)op;
+    msg.flags      = flags;
+    msg.request_id = id;
+    msg.payload    = raw.substr(LINK_MESSAGE_HEADER_SIZE);
+
+    return true;
+}
+
+/* Fixed-size payload helpers. */
+
+inline std::string link_u32_payload(u32 value) {
+    std::string out;
+    link_put_le(out, value, sizeof(u32));
+    return out;
+}
+
+inline bool link_read_u32(std::string_view payload, u32 &value) {
+    if (payload.size() != sizeof(u32)) { return false; }
+    value = link_get_le(payload.data(), sizeof(u32));
+    return true;
+}
+
+/*
+ * Opcode-indexed handler table. Ctx is whatever the handlers need to act on
+ * (the link on the server, the UI on the client).
+ */
+template<typename Ctx>
+struct Link_Dispatcher {
+    using Handler = void (*)(Ctx &ctx, const Link_Message &msg);
+
+    enum class Result {
+        OK,
+        MALFORMED,
+        UNHANDLED,
+    };
+
+private:
+    std::array<Handler, (size_t)Link_Op::COUNT> handlers {};
+
+public:
+    Link_Dispatcher(std::initializer_list<std::pair<Link_Op, Handler>> entries) {
+        for (auto &[op, handler] : entries) {
+            this->handlers[(size_t)op] = handler;
+        }
+    }
+
+    Result dispatch(Ctx &ctx, std::string_view raw, Link_Message &msg) const {
+        if (!link_message_parse(raw, msg)) { return Result::MALFORMED; }
+
+        Handler handler = this->handlers[(size_t)msg.op];
+        if (handler == NULL) { return Result::UNHANDLED; }
+
+        handler(ctx, msg);
+
+        return Result::OK;
+    }
+};
+
+}
@@ -0,0 +1,340 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+#include "common.hpp"
+#include "base64_simd.hpp"
+#include "link_codec.hpp"
+
+namespace {
+
+/*
+ * Every message starts its life on the link wrapped in an OSC escape sequence
+ * with a base64 payload, since that survives anything sitting between the two
+ * ends. After the SERVER-CONNECT handshake, the ends can agree to switch to
+ * binary framing: a fixed header (magic, little-endian length, codec, flags)
+ * followed by the raw payload bytes.
+ *
+ * Negotiated compression is self-describing in either framing: the codec is
+ * the last header byte of a binary frame, and a compressed OSC payload starts
+ * with a marker character that is not part of the base64 alphabet.
+ *
+ * Binary frames also carry a logical channel. Control messages travel whole
+ * on the CONTROL channel; BULK messages are compressed as a whole and then
+ * cut into fragments, so that a writer can slip control frames in between
+ * the fragments of a multi-megabyte transfer. OSC framing has no channels and
+ * everything it carries is delivered as CONTROL.
+ *
+ * Parsers always accept every framing and codec, so either end may switch its
+ * writer as soon as it knows the other end understands them.
+ */
+
+static constexpr const char *LINK_OSC_TO_SERVER = "\033]9999;";
+static constexpr const char *LINK_OSC_TO_CLIENT = "\033]9998;";
+
+enum Link_Capability : u32 {
+    LINK_CAP_BINARY_FRAMING = 1 << 0,
+    LINK_CAP_LZ4            = 1 << 1,
+    LINK_CAP_ZSTD           = 1 << 2,
+};
+
+enum class Link_Channel : u8 {
+    CONTROL = 0,
+    BULK    = 1,
+};
+
+enum Link_Frame_Flags : u8 {
+    LINK_FRAME_BULK = 1 << 0,
+    LINK_FRAME_MORE = 1 << 1, /* Another fragment of the same bulk message follows. */
+};
+
+static constexpr char LINK_OSC_LZ4_MARKER  = '!';
+static constexpr char LINK_OSC_ZSTD_MARKER = '~';
+
+static constexpr char   LINK_FRAME_MAGIC[4]           = { '\033', 'O', 'L', 'K' };
+static constexpr u32    LINK_FRAME_MAX_LENGTH         = 1u << 30;
+static constexpr int    LINK_FRAME_HEADER_SIZE        = sizeof(LINK_FRAME_MAGIC) + sizeof(u32) + 2 * sizeof(u8);
+static constexpr size_t LINK_BULK_FRAGMENT_SIZE       = 64 * 1024;
+static constexpr size_t LINK_DEFAULT_READ_BUFFER_SIZE = 256 * 1024;
+
+inline u32 link_supported_capabilities() {
+    u32 caps = LINK_CAP_BINARY_FRAMING;
+#ifdef LINK_HAVE_LZ4
+    caps |= LINK_CAP_LZ4;
+#endif
+#ifdef LINK_HAVE_ZSTD
+    caps |= LINK_CAP_ZSTD;
+#endif
+    return caps;
+}
+
+inline void link_put_frame_header(std::string &out, u32 length, Link_Codec codec, u8 flags = 0) {
+    out.append(LINK_FRAME_MAGIC, sizeof(LINK_FRAME_MAGIC));
+    out += (char)(length         & 0xFF);
+    out += (char)((length >> 8)  & 0xFF);
+    out += (char)((length >> 16) & 0xFF);
+    out += (char)((length >> 24) & 0xFF);
+    out += (char)codec;
+    out += (char)flags;
+}
+
+/* Compresses msg in place if a codec is negotiated and it actually helps. */
+inline Link_Codec link_compress_in_place(u32 caps, std::string &msg) {
+    Link_Codec  codec = link_pick_codec(caps & LINK_CAP_LZ4, caps & LINK_CAP_ZSTD, msg.size());
+    std::string compressed;
+
+    if (codec != Link_Codec::NONE && link_compress(codec, msg, compressed)) {
+        msg = std::move(compressed);
+        return codec;
+    }
+
+    return Link_Codec::NONE;
+}
+
+/*
+ * Appends the encoded message to parts. A raw binary payload is moved in as
+ * its own part behind a small header part rather than copied, so a caller
+ * that writes with writev() never touches the payload bytes.
+ */
+inline void link_encode_parts(std::vector<std::string> &parts, u32 caps, std::string &&msg, const char *osc_pattern, const char *osc_terminator) {
+    Link_Codec codec = link_compress_in_place(caps, msg);
+
+    if (caps & LINK_CAP_BINARY_FRAMING) {
+        std::string header;
+        link_put_frame_header(header, msg.size(), codec);
+        parts.push_back(std::move(header));
+        parts.push_back(std::move(msg));
+    } else {
+        std::string out = osc_pattern;
+        if      (codec == Link_Codec::LZ4)  { out += LINK_OSC_LZ4_MARKER;  }
+        else if (codec == Link_Codec::ZSTD) { out += LINK_OSC_ZSTD_MARKER; }
+        try {
+            out += base64_encode(msg);
+        } catch (...) {}
+        out += osc_terminator;
+        parts.push_back(std::move(out));
+    }
+}
+
+inline void link_encode(std::string &out, u32 caps, std::string &&msg, const char *osc_pattern, const char *osc_terminator) {
+    std::vector<std::string> parts;
+
+    link_encode_parts(parts, caps, std::move(msg), osc_pattern, osc_terminator);
+
+    for (auto &part : parts) {
+        out += part;
+    }
+}
+
+struct Link_Stream_Parser {
+private:
+    enum class State {
+        SCAN,
+        OSC_PAYLOAD,
+        FRAME_HEADER,
+        FRAME_PAYLOAD,
+    };
+
+    const char  *osc_pattern;
+    int          osc_pattern_len;
+    int          matched       = 0;
+    bool         osc_alive     = false;
+    bool         magic_alive   = false;
+    State        state         = State::SCAN;
+    u8           header[LINK_FRAME_HEADER_SIZE];
+    int          header_have   = 0;
+    u32          frame_left    = 0;
+    Link_Codec   codec         = Link_Codec::NONE;
+    u8           flags         = 0;
+    bool         osc_start     = false;
+    std::string  cur_msg;
+    std::string  bulk_msg;
+    std::string *target        = &cur_msg;
+
+    Base64_Stream_Decoder osc_decoder;
+
+    void reset() {
+        this->state   = State::SCAN;
+        this->matched = 0;
+        this->cur_msg.clear();
+    }
+
+    template<typename F>
+    void deliver(std::string &&payload, Link_Channel channel, F &&on_message) {
+        if (this->codec == Link_Codec::NONE) {
+            on_message(std::move(payload), channel);
+            return;
+        }
+
+        std::string msg;
+        if (link_decompress(this->codec, payload, msg)) {
+            on_message(std::move(msg), channel);
+        }
+    }
+
+    template<typename F>
+    void frame_complete(F &&on_message) {
+        if (!(this->flags & LINK_FRAME_BULK)) {
+            this->deliver(std::move(this->cur_msg), Link_Channel::CONTROL, on_message);
+        } else if (!(this->flags & LINK_FRAME_MORE)) {
+            this->deliver(std::move(this->bulk_msg), Link_Channel::BULK, on_message);
+            this->bulk_msg.clear();
+        }
+        this->reset();
+    }
+
+    bool header_complete() {
+        u32 length =   (u32)this->header[4]
+                     | ((u32)this->header[5] << 8)
+                     | ((u32)this->header[6] << 16)
+                     | ((u32)this->header[7] << 24);
+        u8  codec  = this->header[8];
+        u8  flags  = this->header[9];
+
+        if (codec > (u8)Link_Codec::ZSTD || length > LINK_FRAME_MAX_LENGTH) {
+            return false;
+        }
+
+        if ((flags & LINK_FRAME_BULK) && this->bulk_msg.size() + length > LINK_FRAME_MAX_LENGTH) {
+            this->bulk_msg.clear();
+            return false;
+        }
+
+        this->codec      = (Link_Codec)codec;
+        this->flags      = flags;
+        this->frame_left = length;
+
+        /* Fragments of a bulk message accumulate until the last one arrives. */
+        if (flags & LINK_FRAME_BULK) {
+            this->target = &this->bulk_msg;
+        } else {
+            this->target = &this->cur_msg;
+            this->cur_msg.clear();
+            this->cur_msg.reserve(length);
+        }
+
+        return true;
+    }
+
+public:
+    Link_Stream_Parser(const char *osc_pattern) : osc_pattern(osc_pattern), osc_pattern_len(strlen(osc_pattern)) {}
+
+    template<typename F>
+    void feed(const char *buff, int n, F &&on_message) {
+        int i = 0;
+
+        while (i < n) {
+            switch (this->state) {
+                case State::SCAN: {
+                    /*
+                     * Both the OSC pattern and the frame magic start with ESC, so
+                     * anything before the next ESC is skipped in bulk. The partial
+                     * match is kept in the parser so that a delimiter split across
+                     * reads is picked up on the next feed.
+                     */
+                    if (this->matched == 0) {
+                        const char *esc = (const char*)memchr(buff + i, '\033', n - i);
+                        if (esc == NULL) {
+                            i = n;
+                            break;
+                        }
+                        i                 = esc - buff + 1;
+                        this->matched     = 1;
+                        this->osc_alive   = true;
+                        this->magic_alive = true;
+                        break;
+                    }
+
+                    char c = buff[i];
+
+                    this->osc_alive   = this->osc_alive   && this->osc_pattern[this->matched] == c;
+                    this->magic_alive = this->magic_alive && LINK_FRAME_MAGIC[this->matched]  == c;
+
+                    if (!this->osc_alive && !this->magic_alive) {
+                        /* Don't consume c; it may start the next delimiter. */
+                        this->matched = 0;
+                        break;
+                    }
+
+                    i             += 1;
+                    this->matched += 1;
+
+                    if (this->osc_alive && this->matched == this->osc_pattern_len) {
+                        this->state     = State::OSC_PAYLOAD;
+                        this->codec     = Link_Codec::NONE;
+                        this->osc_start = true;
+                        this->osc_decoder.reset();
+                    } else if (this->magic_alive && this->matched == sizeof(LINK_FRAME_MAGIC)) {
+                        this->state       = State::FRAME_HEADER;
+                        this->header_have = sizeof(LINK_FRAME_MAGIC);
+                    }
+                    break;
+                }
+                case State::OSC_PAYLOAD: {
+                    if (this->osc_start) {
+                        this->osc_start = false;
+                        if (buff[i] == LINK_OSC_LZ4_MARKER) {
+                            this->codec  = Link_Codec::LZ4;
+                            i           += 1;
+                            break;
+                        } else if (buff[i] == LINK_OSC_ZSTD_MARKER) {
+                            this->codec  = Link_Codec::ZSTD;
+                            i           += 1;
+                            break;
+                        }
+                    }
+
+                    const char *end = (const char*)memchr(buff + i, '\x07', n - i);
+                    int         len = (end ? end - buff : n) - i;
+
+                    this->osc_decoder.feed(buff + i, len);
+                    i += len;
+
+                    if (end != NULL) {
+                        i += 1;
+                        try {
+                            this->deliver(this->osc_decoder.finish(), Link_Channel::CONTROL, on_message);
+                        } catch (...) {}
+                        this->reset();
+                    }
+                    break;
+                }
+                case State::FRAME_HEADER: {
+                    int take = std::min(n - i, LINK_FRAME_HEADER_SIZE - this->header_have);
+
+                    memcpy(this->header + this->header_have, buff + i, take);
+                    this->header_have += take;
+                    i                 += take;
+
+                    if (this->header_have == LINK_FRAME_HEADER_SIZE) {
+                        if (!this->header_complete()) {
+                            this->reset();
+                        } else if (this->frame_left == 0) {
+                            this->frame_complete(on_message);
+                        } else {
+                            this->state = State::FRAME_PAYLOAD;
+                        }
+                    }
+                    break;
+                }
+                case State::FRAME_PAYLOAD: {
+                    u32 take = std::min((u32)(n - i), this->frame_left);
+
+                    this->target->append(buff + i, take);
+                    this->frame_left -= take;
+                    i                += take;
+
+                    if (this->frame_left == 0) {
+                        this->frame_complete(on_message);
+                    }
+                    break;
+                }
+            }
+        }
+    }
+};
+
+}
@@ -68,13 +68,13 @@ struct Profile_Config {
         return ss.str();
     }
 
-    static Profile_Config from_serialized(std::string &data) {
+    static Profile_Config from_serialized(std::string_view data) {
         Profile_Config ret;
 
-        std::stringstream ss(data);
+        View_Istream is(data);
 
         {
-            cereal::BinaryInputArchive iarchive(ss);
+            cereal::BinaryInputArchive iarchive(is);
             iarchive(ret);
         }
 
@@ -82,12 +82,459 @@ struct Profile_Config {
     }
 };
 
+/* What the counting engine should count, and how to share the PMU's counters between the events. */
+struct Monitor_Request {
+    std::vector<std::string> events;                  /* Empty means the server's defaults. */
+    u32                      counters_per_group = 4;
+    u32                      time_slice_ms      = 10;
+
+    template<class Archive>
+    void serialize(Archive & archive) {
+        archive(events, counters_per_group, time_slice_ms);
+    }
+
+    bool operator==(const Monitor_Request&) const = default;
+
+    std::string to_serialized() {
+        std::stringstream ss;
+
+        {
+            cereal::BinaryOutputArchive oarchive(ss);
+            oarchive(*this);
+        }
+
+        return ss.str();
+    }
+
+    static Monitor_Request from_serialized(std::string_view data) {
+        Monitor_Request ret;
+
+        View_Istream is(data);
+
+        {
+            cereal::BinaryInputArchive iarchive(is);
+            iarchive(ret);
+        }
+
+        return ret;
+    }
+};
+
+/* One sample of the counting engine: a row per CPU thread, a column per event. */
 struct Monitor_Data {
+    std::vector<std::string> events;
+    std::vector<std::string> threads;     /* Names of CPU_THREAD topology nodes. */
+    std::vector<s32>         cpus;        /* The CPU number of each thread, for Flat_Topology::rows_for(). */
+    std::vector<u64>         values;      /* threads.size() x events.size(), row-major, scaled to the interval. */
+    std::vector<f32>         confidence;  /* Same shape; the fraction of the interval each value was counted. */
+    u64                      interval_ns = 0;
+
+    u64 at(size_t thread, size_t event) const {
+        return this->values[thread * this->events.size() + event];
+    }
+
+    f32 confidence_at(size_t thread, size_t event) const {
+        return this->confidence[thread * this->events.size() + event];
+    }
+
+    template<class Archive>
+    void serialize(Archive & archive) {
+        archive(events, threads, cpus, values, confidence, interval_ns);
+    }
+
+    std::string to_serialized() {
+        std::stringstream ss;
+
+        {
+            cereal::BinaryOutputArchive oarchive(ss);
+            oarchive(*this);
+        }
+
+        return ss.str();
+    }
+
+    static Monitor_Data from_serialized(std::string_view data) {
+        Monitor_Data ret;
+
+        View_Istream is(data);
+
+        {
+            cereal::BinaryInputArchive iarchive(is);
+            iarchive(ret);
+        }
+
+        return ret;
+    }
+};
+
+/* Starts the live monitor: counters sampled every interval_us and streamed back in batches. */
+struct Monitor_Stream_Request {
+    Monitor_Request counters;
+    u32             interval_us = 10000;
+    u64             bucket_ns   = 0;       /* Non-zero: reduce ticks into buckets this wide on the server. */
+    bool            histograms  = false;   /* With buckets, also send a log-linear histogram per cell. */
+
+    template<class Archive>
+    void serialize(Archive & archive) {
+        archive(counters, interval_us, bucket_ns, histograms);
+    }
+
+    std::string to_serialized() {
+        std::stringstream ss;
 
+        {
+            cereal::BinaryOutputArchive oarchive(ss);
+            oarchive(*this);
+        }
+
+        return ss.str();
+    }
+
+    static Monitor_Stream_Request from_serialized(std::string_view data) {
+        Monitor_Stream_Request ret;
+
+        View_Istream is(data);
+
+        {
+            cereal::BinaryInputArchive iarchive(is);
+            iarchive(ret);
+        }
+
+        return ret;
+    }
+};
+
+/* Sent once when a stream starts; batches only carry numbers. */
+struct Monitor_Stream_Header {
+    std::vector<std::string> events;
+    std::vector<std::string> threads;
+    std::vector<s32>         cpus;        /* Same order as threads. */
+    u64                      interval_ns = 0;
+
+    template<class Archive>
+    void serialize(Archive & archive) {
+        archive(events, threads, cpus, interval_ns);
+    }
+
+    std::string to_serialized() {
+        std::stringstream ss;
+
+        {
+            cereal::BinaryOutputArchive oarchive(ss);
+            oarchive(*this);
+        }
+
+        return ss.str();
+    }
+
+    static Monitor_Stream_Header from_serialized(std::string_view data) {
+        Monitor_Stream_Header ret;
+
+        View_Istream is(data);
+
+        {
+            cereal::BinaryInputArchive iarchive(is);
+            iarchive(ret);
+        }
+
+        return ret;
+    }
+};
+
+/*
+ * A run of consecutive ticks, stored by series: values holds one series per
+ * (thread, event) pair in Monitor_Data order, each time_ns.size() long, so
+ * that a series is contiguous for plotting and compresses well.
+ */
+struct Monitor_Stream_Batch {
+    u64              seq    = 0;
+    u64              missed = 0;       /* Ticks the sampler overran since the previous batch. */
+    std::vector<u64> time_ns;          /* Since the start of the stream. */
+    std::vector<u64> values;
+    std::vector<f32> confidence;
+
+    size_t n_ticks() const { return this->time_ns.size(); }
+
+    const u64 *series(size_t index) const { return this->values.data() + index * this->n_ticks(); }
+
+    template<class Archive>
+    void serialize(Archive & archive) {
+        archive(seq, missed, time_ns, values, confidence);
+    }
+
+    std::string to_serialized() {
+        std::stringstream ss;
+
+        {
+            cereal::BinaryOutputArchive oarchive(ss);
+            oarchive(*this);
+        }
+
+        return ss.str();
+    }
+
+    static Monitor_Stream_Batch from_serialized(std::string_view data) {
+        Monitor_Stream_Batch ret;
+
+        View_Istream is(data);
+
+        {
+            cereal::BinaryInputArchive iarchive(is);
+            iarchive(ret);
+        }
+
+        return ret;
+    }
+};
+
+/*
+ * A run of consecutive time buckets, each reduced per series to sum, min,
+ * max and count (and optionally a histogram), stored series-major like
+ * Monitor_Stream_Batch: cell (series, bucket) is at series * n_buckets + bucket.
+ *
+ * Histograms are sparse: the bins of cell i are hist_bins/hist_counts in
+ * [hist_offsets[i], hist_offsets[i + 1]), with bin indices as defined by
+ * Log_Linear_Histogram.
+ */
+struct Monitor_Aggregate_Batch {
+    u64              seq          = 0;
+    u64              missed       = 0;
+    u64              bucket_ns    = 0;
+    u64              first_bucket = 0;     /* Index of the first bucket since the start of the stream. */
+    u32              n_buckets    = 0;
+    std::vector<u64> sum;
+    std::vector<u64> min;
+    std::vector<u64> max;
+    std::vector<u32> count;               /* Ticks the series was measured in; unmeasured ones are left out. */
+    std::vector<u32> hist_offsets;
+    std::vector<u16> hist_bins;
+    std::vector<u32> hist_counts;
+
+    size_t cell(size_t series, size_t bucket) const { return series * this->n_buckets + bucket; }
+
+    template<class Archive>
+    void serialize(Archive & archive) {
+        archive(seq, missed, bucket_ns, first_bucket, n_buckets, sum, min, max, count, hist_offsets, hist_bins, hist_counts);
+    }
+
+    std::string to_serialized() {
+        std::stringstream ss;
+
+        {
+            cereal::BinaryOutputArchive oarchive(ss);
+            oarchive(*this);
+        }
+
+        return ss.str();
+    }
+
+    static Monitor_Aggregate_Batch from_serialized(std::string_view data) {
+        Monitor_Aggregate_Batch ret;
+
+        View_Istream is(data);
+
+        {
+            cereal::BinaryInputArchive iarchive(is);
+            iarchive(ret);
+        }
+
+        return ret;
+    }
+};
+
+/*
+ * Samples from one CPU, stored column-wise: one vector per field, with no
+ * per-sample objects, so a batch can be aggregated or shipped as is.
+ *
+ * With callchains, sample i's frames (innermost first) are chain_ips in
+ * [chain_begin(i), chain_end[i]).
+ */
+struct Profile_Sample_Batch {
+    s32              cpu  = -1;
+    u64              lost = 0;      /* Records the kernel dropped because the ring was full. */
+    std::vector<u64> ip;
+    std::vector<u32> pid;
+    std::vector<u32> tid;
+    std::vector<u64> time;
+    std::vector<u64> period;
+    std::vector<u32> chain_end;
+    std::vector<u64> chain_ips;
+
+    size_t size() const { return this->ip.size(); }
+
+    bool   has_chains() const { return !this->chain_end.empty(); }
+    u32    chain_begin(size_t i) const { return i ? this->chain_end[i - 1] : 0; }
+
+    /* Ends the chain of the sample pushed last. */
+    void push_chain(const u64 *ips, size_t n) {
+        this->chain_ips.insert(this->chain_ips.end(), ips, ips + n);
+        this->chain_end.push_back(this->chain_ips.size());
+    }
+
+    void push(u64 ip, u32 pid, u32 tid, u64 time, u64 period) {
+        this->ip.push_back(ip);
+        this->pid.push_back(pid);
+        this->tid.push_back(tid);
+        this->time.push_back(time);
+        this->period.push_back(period);
+    }
+
+    void reserve(size_t n) {
+        this->ip.reserve(n);
+        this->pid.reserve(n);
+        this->tid.reserve(n);
+        this->time.reserve(n);
+        this->period.reserve(n);
+    }
+
+    /* Keeps the capacity, so a batch can be refilled without allocating. */
+    void clear() {
+        this->lost = 0;
+        this->ip.clear();
+        this->pid.clear();
+        this->tid.clear();
+        this->time.clear();
+        this->period.clear();
+        this->chain_end.clear();
+        this->chain_ips.clear();
+    }
+
+    template<class Archive>
+    void serialize(Archive & archive) {
+        archive(cpu, lost, ip, pid, tid, time, period, chain_end, chain_ips);
+    }
 };
 
 struct Profile_Data {
+    std::vector<Profile_Sample_Batch> batches;
+
+    template<class Archive>
+    void serialize(Archive & archive) {
+        archive(batches);
+    }
+
+    std::string to_serialized() {
+        std::stringstream ss;
+
+        {
+            cereal::BinaryOutputArchive oarchive(ss);
+            oarchive(*this);
+        }
+
+        return ss.str();
+    }
 
+    static Profile_Data from_serialized(std::string_view data) {
+        Profile_Data ret;
+
+        View_Istream is(data);
+
+        {
+            cereal::BinaryInputArchive iarchive(is);
+            iarchive(ret);
+        }
+
+        return ret;
+    }
+};
+
+struct Stack_Profile_Request {
+    std::string event;                 /* Empty means cycles, or cpu-clock where that can't be sampled. */
+    u64         frequency = 999;       /* Samples per second per CPU. */
+
+    template<class Archive>
+    void serialize(Archive & archive) {
+        archive(event, frequency);
+    }
+
+    std::string to_serialized() {
+        std::stringstream ss;
+
+        {
+            cereal::BinaryOutputArchive oarchive(ss);
+            oarchive(*this);
+        }
+
+        return ss.str();
+    }
+
+    static Stack_Profile_Request from_serialized(std::string_view data) {
+        Stack_Profile_Request ret;
+
+        View_Istream is(data);
+
+        {
+            cereal::BinaryInputArchive iarchive(is);
+            iarchive(ret);
+        }
+
+        return ret;
+    }
+};
+
+static constexpr u32 NO_SYMBOL = ~0u;
+
+/*
+ * What changed in a Stack_Trie since the previous delta: the nodes appended
+ * since then (ids first_node onwards, in order) and the sample counts added
+ * to existing or new nodes.
+ *
+ * New nodes come symbolized: symbol[i] is a symbol id or NO_SYMBOL, and
+ * process_name has the command name of each new process node, in order
+ * (empty if the process was already gone). Modules and
+ * symbols are interned for the whole connection, and each is sent once, in
+ * the first delta that refers to it; ids are dense and start where the
+ * previous delta's left off.
+ */
+struct Stack_Trie_Delta {
+    u64                      seq        = 0;
+    u64                      lost       = 0;
+    u32                      first_node = 0;
+    std::vector<u32>         parent;
+    std::vector<u64>         ip;
+    std::vector<u32>         counted;
+    std::vector<u64>         counts;
+
+    std::vector<u32>         symbol;
+    std::vector<std::string> process_name;
+
+    u32                      first_module = 0;
+    std::vector<std::string> module_path;
+    std::vector<std::string> module_build_id;
+    u32                      first_symbol = 0;
+    std::vector<u32>         symbol_module;
+    std::vector<u64>         symbol_addr;
+    std::vector<std::string> symbol_name;     /* As found in the binary, i.e. possibly mangled. */
+
+    template<class Archive>
+    void serialize(Archive & archive) {
+        archive(seq, lost, first_node, parent, ip, counted, counts, symbol, process_name,
+                first_module, module_path, module_build_id, first_symbol, symbol_module, symbol_addr, symbol_name);
+    }
+
+    std::string to_serialized() {
+        std::stringstream ss;
+
+        {
+            cereal::BinaryOutputArchive oarchive(ss);
+            oarchive(*this);
+        }
+
+        return ss.str();
+    }
+
+    static Stack_Trie_Delta from_serialized(std::string_view data) {
+        Stack_Trie_Delta ret;
+
+        View_Istream is(data);
+
+        {
+            cereal::BinaryInputArchive iarchive(is);
+            iarchive(ret);
+        }
+
+        return ret;
+    }
 };
 
 }
@@ -1,50 +1,136 @@
 #pragma once
 
 #include <string>
-#include <queue>
-#include <thread>
-#include <mutex>
-#include <condition_variable>
+#include <memory>
+#include <atomic>
 #include <optional>
+#include <algorithm>
+
+#include "common.hpp"
 
 namespace {
 
+/*
+ * Bounded single-producer/single-consumer ring of messages. The producer only
+ * ever writes `tail` and the consumer only ever writes `head`, so neither side
+ * takes a lock; slots are moved in and out, never copied.
+ *
+ * Blocking waits go through std::atomic::wait(), which parks on a futex (or
+ * the platform equivalent) instead of spinning. The indices are 32 bits wide
+ * because that is what a futex waits on directly. A side about to block says
+ * so in its `*_waiting` flag and the other side clears the flag as it wakes
+ * it, so only the first push or pop after a side blocks pays for a wake-up
+ * (a woken thread that hasn't been scheduled yet still counts as a waiter to
+ * the futex, and would otherwise be woken again on every operation).
+ */
 struct SSH_Link_Inbox {
+    static constexpr size_t DEFAULT_CAPACITY = 4096;
+    static constexpr size_t MAX_CAPACITY     = (size_t)1 << 31;
 
 private:
-    std::queue<std::string> q;
-    std::mutex              mtx;
-    std::condition_variable cv;
+    static constexpr size_t CACHE_LINE = 64;
+
+    std::unique_ptr<std::string[]> slots;
+    u32                            mask;
+
+    alignas(CACHE_LINE) std::atomic<u32> head { 0 };
+    u32                                  cached_tail = 0;
+
+    alignas(CACHE_LINE) std::atomic<u32> tail { 0 };
+    u32                                  cached_head = 0;
+
+    alignas(CACHE_LINE) std::atomic<bool> consumer_waiting { false };
+    std::atomic<bool>                     producer_waiting { false };
+
+    static u32 round_up_pow2(size_t n) {
+        u32 p = 1;
+        while (p < n) { p <<= 1; }
+        return p;
+    }
+
+    /*
+     * The fence pairs with the one in wake(): either the waiter's re-check sees
+     * the other side's index move, or the other side sees the flag.
+     */
+    static void announce_wait(std::atomic<bool> &waiting) {
+        waiting.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    static void wake(std::atomic<bool> &waiting, std::atomic<u32> &index) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiting.load(std::memory_order_relaxed) && waiting.exchange(false, std::memory_order_relaxed)) {
+            index.notify_one();
+        }
+    }
 
 public:
-    void push(const std::string &&msg) {
-        std::lock_guard<std::mutex> lock(mtx);
-        q.push(std::move(msg));
-        cv.notify_one();
+    SSH_Link_Inbox(size_t capacity = DEFAULT_CAPACITY)
+        : slots(new std::string[round_up_pow2(std::clamp(capacity, (size_t)2, MAX_CAPACITY))]),
+          mask(round_up_pow2(std::clamp(capacity, (size_t)2, MAX_CAPACITY)) - 1) {}
+
+    SSH_Link_Inbox(const SSH_Link_Inbox&)            = delete;
+    SSH_Link_Inbox& operator=(const SSH_Link_Inbox&) = delete;
+
+    /* Producer side. Leaves msg untouched and returns false if the ring is full. */
+    bool try_push(std::string &msg) {
+        u32 t = this->tail.load(std::memory_order_relaxed);
+
+        if (t - this->cached_head > this->mask) {
+            this->cached_head = this->head.load(std::memory_order_acquire);
+            if (t - this->cached_head > this->mask) { return false; }
+        }
+
+        this->slots[t & this->mask] = std::move(msg);
+        this->tail.store(t + 1, std::memory_order_release);
+        wake(this->consumer_waiting, this->tail);
+
+        return true;
     }
 
+    /* Producer side. Blocks while the ring is full. */
+    void push(std::string &&msg) {
+        while (!this->try_push(msg)) {
+            announce_wait(this->producer_waiting);
+            if (this->try_push(msg)) { break; }
+            this->head.wait(this->cached_head, std::memory_order_acquire);
+        }
+    }
+
+    /* Consumer side. */
     std::optional<std::string> try_pop(void) {
-        std::lock_guard<std::mutex> lock(mtx);
+        u32 h = this->head.load(std::memory_order_relaxed);
 
-        if (q.empty()) return {};
+        if (h == this->cached_tail) {
+            this->cached_tail = this->tail.load(std::memory_order_acquire);
+            if (h == this->cached_tail) { return {}; }
+        }
 
-        auto msg = std::move(q.front());
-        q.pop();
+        std::string msg = std::move(this->slots[h & this->mask]);
+        this->slots[h & this->mask].clear();
+        this->head.store(h + 1, std::memory_order_release);
+        wake(this->producer_waiting, this->head);
 
         return msg;
     }
 
+    /* Consumer side. Blocks while the ring is empty. */
     std::string wait_and_pop(void) {
-        std::unique_lock<std::mutex> lock(mtx);
-
-        cv.wait(lock, [this]{ return !q.empty(); });
-        auto msg = q.front();
-        q.pop();
+        for (;;) {
+            if (auto msg = this->try_pop()) { return std::move(*msg); }
+            announce_wait(this->consumer_waiting);
+            if (auto msg = this->try_pop()) { return std::move(*msg); }
+            this->tail.wait(this->cached_tail, std::memory_order_acquire);
+        }
+    }
 
-        return msg;
+    size_t size() {
+        u32 h = this->head.load(std::memory_order_acquire);
+        u32 t = this->tail.load(std::memory_order_acquire);
+        return (u32)(t - h);
     }
 
-    size_t size() { return this->q.size(); }
+    size_t capacity() const { return this->mask + 1; }
 };
 
 }
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+
+#include "common.hpp"
+#include "profile.hpp"
+
+namespace {
+
+/*
+ * Callchains merged into a prefix tree: node 0 is the root, its children are
+ * processes (ip holds the pid), and below them every node is one frame, from
+ * the outermost caller down. count is the number of samples whose innermost
+ * frame is that node.
+ *
+ * Nodes are only ever appended and a node always comes after its parent, so
+ * the server can send just the nodes added since the last delta plus the
+ * counts that changed, and the client's copy grows in the same order.
+ */
+struct Stack_Trie {
+    std::vector<u32> parent;
+    std::vector<u64> ip;
+    std::vector<u64> count;
+
+private:
+    struct Edge {
+        u32 parent;
+        u64 ip;
+
+        bool operator==(const Edge &other) const { return this->parent == other.parent && this->ip == other.ip; }
+    };
+
+    struct Edge_Hash {
+        size_t operator()(const Edge &e) const { return std::hash<u64>()(e.ip * 0x9E3779B97F4A7C15ull ^ e.parent); }
+    };
+
+    /* Sender side only. */
+    std::unordered_map<Edge, u32, Edge_Hash> children;
+    std::vector<u64>                         pending;     /* Counts added since the last delta, per node. */
+    std::vector<u32>                         counted;     /* Nodes with a non-zero pending count. */
+    u32                                      sent  = 1;
+    u64                                      seq   = 0;
+
+    u32 child(u32 parent, u64 ip) {
+        auto [it, added] = this->children.try_emplace({ parent, ip }, (u32)this->size());
+
+        if (added) {
+            this->parent.push_back(parent);
+            this->ip.push_back(ip);
+            this->count.push_back(0);
+            this->pending.push_back(0);
+        }
+
+        return it->second;
+    }
+
+public:
+    Stack_Trie() { this->clear(); }
+
+    size_t size() const { return this->parent.size(); }
+
+    void clear() {
+        this->parent  = { 0 };
+        this->ip      = { 0 };
+        this->count   = { 0 };
+        this->pending = { 0 };
+        this->children.clear();
+        this->counted.clear();
+        this->sent = 1;
+        this->seq  = 0;
+    }
+
+    /* frames are innermost first, as perf reports them. */
+    void insert(u32 pid, const u64 *frames, size_t n, u64 weight = 1) {
+        u32 node = this->child(0, pid);
+
+        for (size_t i = n; i-- > 0;) {
+            node = this->child(node, frames[i]);
+        }
+
+        if (this->pending[node] == 0) {
+            this->counted.push_back(node);
+        }
+
+        this->count[node]   += weight;
+        this->pending[node] += weight;
+    }
+
+    /* Returns false if nothing changed since the last delta. */
+    bool take_delta(Stack_Trie_Delta &delta) {
+        if (this->counted.empty() && this->sent == this->size()) { return false; }
+
+        delta.seq        = this->seq++;
+        delta.first_node = this->sent;
+        delta.parent.assign(this->parent.begin() + this->sent, this->parent.end());
+        delta.ip.assign(this->ip.begin() + this->sent, this->ip.end());
+
+        delta.counted.clear();
+        delta.counts.clear();
+        for (u32 node : this->counted) {
+            delta.counted.push_back(node);
+            delta.counts.push_back(this->pending[node]);
+            this->pending[node] = 0;
+        }
+
+        this->counted.clear();
+        this->sent = this->size();
+
+        return true;
+    }
+
+    /* Receiver side. Returns false if the delta doesn't continue this trie (e.g. one was lost). */
+    bool apply(const Stack_Trie_Delta &delta) {
+        if (delta.first_node != this->size() || delta.parent.size() != delta.ip.size() || delta.counted.size() != delta.counts.size()) {
+            return false;
+        }
+
+        size_t new_size = this->size() + delta.parent.size();
+
+        for (size_t i = 0; i < delta.parent.size(); i += 1) {
+            if (delta.parent[i] >= delta.first_node + i) { return false; }
+        }
+        for (u32 node : delta.counted) {
+            if (node >= new_size) { return false; }
+        }
+
+        this->parent.insert(this->parent.end(), delta.parent.begin(), delta.parent.end());
+        this->ip.insert(this->ip.end(), delta.ip.begin(), delta.ip.end());
+        this->count.resize(new_size, 0);
+
+        for (size_t i = 0; i < delta.counted.size(); i += 1) {
+            this->count[delta.counted[i]] += delta.counts[i];
+        }
+
+        return true;
+    }
+
+    /* Samples at or below each node, with one backwards pass. */
+    void inclusive(std::vector<u64> &out) const {
+        out = this->count;
+
+        for (size_t i = this->size(); i-- > 1;) {
+            out[this->parent[i]] += out[i];
+        }
+    }
+};
+
+}
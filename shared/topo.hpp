@@ -2,7 +2,9 @@
 
 #include <map>
 #include <string>
+#include <vector>
 #include <sstream>
+#include <algorithm>
 
 #include <cereal/cereal.hpp>
 #include <cereal/types/string.hpp>
@@ -49,16 +51,165 @@ struct Topology_Node {
     std::string                          name;
     std::map<std::string, Topology_Node> subnodes;
     std::map<std::string, Topology_Edge> edges;
-    Resource_Type                        type = Resource_Type::UNKNOWN;
+    Resource_Type                        type     = Resource_Type::UNKNOWN;
+    s32                                  os_index = -1;   /* hwloc's, e.g. the CPU number of a thread. */
 
     template<class Archive>
     void serialize(Archive & archive) {
-        archive(name, subnodes, edges, type);
+        archive(name, subnodes, edges, type, os_index);
     }
 };
 
+/*
+ * The topology as flat arrays, one entry per node, laid out breadth-first:
+ * the children of node i are [first_child[i], first_child[i] + n_children[i]),
+ * and every node comes after its parent. Names are interned, so comparing two
+ * nodes' names is comparing two integers.
+ *
+ * Per-thread values are rolled up to every enclosing core, cache, socket and
+ * the root with a single backwards pass that adds each node's row into its
+ * parent's, so the cost is one vector add per node regardless of depth.
+ */
+struct Flat_Topology {
+    std::vector<Resource_Type> type;
+    std::vector<u32>           parent;        /* The root is its own parent. */
+    std::vector<u32>           first_child;
+    std::vector<u32>           n_children;
+    std::vector<u32>           name_id;
+    std::vector<s32>           os_index;
+    std::vector<u32>           n_threads;     /* CPU threads below (or at) each node. */
+    std::vector<std::string>   names;
+    std::vector<s32>           cpu_node;      /* CPU number -> its CPU thread node, or -1. */
+
+    size_t             size() const { return this->type.size(); }
+    const std::string &name(u32 i) const { return this->names[this->name_id[i]]; }
+
+    s32 node_of_cpu(int cpu) const {
+        if (cpu < 0 || cpu >= (int)this->cpu_node.size()) { return -1; }
+        return this->cpu_node[cpu];
+    }
+
+    void build(const Topology_Node &root) {
+        std::vector<const Topology_Node*> queue = { &root };
+        std::map<std::string_view, u32>   interned;
+
+        *this = Flat_Topology();
+
+        this->push(root, 0, interned);
+
+        for (size_t i = 0; i < queue.size(); i += 1) {
+            const Topology_Node &node = *queue[i];
+
+            this->first_child[i] = queue.size();
+            this->n_children[i]  = node.subnodes.size();
+
+            for (auto &pair : node.subnodes) {
+                this->push(pair.second, i, interned);
+                queue.push_back(&pair.second);
+            }
+        }
+
+        for (size_t i = this->size(); i-- > 1;) {
+            this->n_threads[this->parent[i]] += this->n_threads[i];
+        }
+    }
+
+    /* Indices of the nodes of one type, in breadth-first order. */
+    std::vector<u32> of_type(Resource_Type type) const {
+        std::vector<u32> out;
+
+        for (size_t i = 0; i < this->size(); i += 1) {
+            if (this->type[i] == type) {
+                out.push_back(i);
+            }
+        }
+
+        return out;
+    }
+
+    /* Sorted CPU numbers of all CPU threads. */
+    std::vector<int> cpus() const {
+        std::vector<int> out;
+
+        for (size_t cpu = 0; cpu < this->cpu_node.size(); cpu += 1) {
+            if (this->cpu_node[cpu] >= 0) {
+                out.push_back(cpu);
+            }
+        }
+
+        return out;
+    }
 
+    /* For each node, the row of cpus (e.g. Monitor_Data::cpus) holding its CPU number if it is a CPU thread, or -1. */
+    std::vector<s32> rows_for(const std::vector<s32> &cpus) const {
+        std::vector<s32> out(this->size(), -1);
+
+        for (size_t t = 0; t < cpus.size(); t += 1) {
+            s32 node = this->node_of_cpu(cpus[t]);
+            if (node >= 0) { out[node] = t; }
+        }
+
+        return out;
+    }
+
+    /*
+     * in holds n_cols values per input row (row-major, like Monitor_Data) and
+     * rows maps nodes to input rows as returned by rows_for(); out gets n_cols
+     * values per node.
+     */
+    template<typename T>
+    void roll_up(const T *in, size_t n_cols, const std::vector<s32> &rows, std::vector<T> &out) const {
+        out.assign(this->size() * n_cols, T());
+
+        for (size_t i = 0; i < this->size(); i += 1) {
+            if (rows[i] >= 0) {
+                std::copy(in + rows[i] * n_cols, in + (rows[i] + 1) * n_cols, out.data() + i * n_cols);
+            }
+        }
+
+        for (size_t i = this->size(); i-- > 1;) {
+            T       *dst = out.data() + this->parent[i] * n_cols;
+            const T *src = out.data() + i * n_cols;
+
+            for (size_t c = 0; c < n_cols; c += 1) {
+                dst[c] += src[c];
+            }
+        }
+    }
+
+private:
+    void push(const Topology_Node &node, u32 parent, std::map<std::string_view, u32> &interned) {
+        auto [it, added] = interned.try_emplace(node.name, this->names.size());
+        if (added) {
+            this->names.push_back(node.name);
+        }
+
+        this->type.push_back(node.type);
+        this->parent.push_back(parent);
+        this->first_child.push_back(0);
+        this->n_children.push_back(0);
+        this->name_id.push_back(it->second);
+        this->os_index.push_back(node.os_index);
+        this->n_threads.push_back(node.type == Resource_Type::CPU_THREAD);
+
+        if (node.type == Resource_Type::CPU_THREAD && node.os_index >= 0) {
+            if ((size_t)node.os_index >= this->cpu_node.size()) {
+                this->cpu_node.resize(node.os_index + 1, -1);
+            }
+            this->cpu_node[node.os_index] = this->size() - 1;
+        }
+    }
+};
+
+
+/*
+ * The tree is kept as a view for code that walks it by name; anything hot
+ * should go through flat, which is rebuilt from the tree on deserialization
+ * rather than sent along with it.
+ */
 struct Topology : Topology_Node {
+    Flat_Topology flat;
+
     Topology() : Topology_Node("System") { this->type = Resource_Type::ROOT; }
 
     template<class Archive>
@@ -77,16 +228,18 @@ struct Topology : Topology_Node {
         return ss.str();
     }
 
-    static Topology from_serialized(std::string &data) {
+    static Topology from_serialized(std::string_view data) {
         Topology ret;
 
-        std::stringstream ss(data);
+        View_Istream is(data);
 
         {
-            cereal::BinaryInputArchive iarchive(ss);
+            cereal::BinaryInputArchive iarchive(is);
             iarchive(ret);
         }
 
+        ret.flat.build(ret);
+
         return ret;
     }
 };
@@ -0,0 +1,192 @@
+#include <vector>
+#include <random>
+#include <climits>
+
+#include "common.hpp"
+#include "aggregate.hpp"
+#include "test.hpp"
+
+/*
+ * Log_Linear_Histogram's bins against their bounds, and Bucket_Aggregator's
+ * batches: empty buckets across gaps, the series-major layout take() hands
+ * out, the histogram offsets, unmeasured ticks and the final partial flush.
+ */
+
+static void check_bin(u64 v) {
+    u16 b    = Log_Linear_Histogram::bin(v);
+    u16 last = Log_Linear_Histogram::bin(UINT64_MAX);
+
+    CHECK(b < 500, "bin(%llu) = %u", (unsigned long long)v, b);
+    CHECK(Log_Linear_Histogram::lower_bound(b) <= v, "lower_bound(bin(%llu)) is above it", (unsigned long long)v);
+
+    if (b < last) {
+        CHECK(v < Log_Linear_Histogram::lower_bound(b + 1), "%llu reaches into bin %u", (unsigned long long)v, b + 1);
+    }
+}
+
+static void test_histogram() {
+    for (u64 v = 0; v < Log_Linear_Histogram::SUB; v += 1) {
+        CHECK(Log_Linear_Histogram::bin(v) == v, "bin(%llu) is not exact", (unsigned long long)v);
+        CHECK(Log_Linear_Histogram::lower_bound(v) == v, "lower_bound(%llu) is not exact", (unsigned long long)v);
+    }
+
+    for (int k = 3; k < 64; k += 1) {
+        check_bin(((u64)1 << k) - 1);
+        check_bin((u64)1 << k);
+        check_bin(((u64)1 << k) + 1);
+    }
+    check_bin(UINT64_MAX);
+
+    std::mt19937_64 rng(7);
+    for (int i = 0; i < 100000; i += 1) {
+        check_bin(rng() >> (rng() % 64));
+    }
+
+    /* Every bin up to the last is reachable and its lower bound lands in it. */
+    u16 last = Log_Linear_Histogram::bin(UINT64_MAX);
+    for (u16 b = 0; b <= last; b += 1) {
+        u64 lo = Log_Linear_Histogram::lower_bound(b);
+
+        CHECK(Log_Linear_Histogram::bin(lo) == b, "bin(lower_bound(%u)) = %u", b, Log_Linear_Histogram::bin(lo));
+        if (b > 0) {
+            CHECK(lo > Log_Linear_Histogram::lower_bound(b - 1), "lower_bound is not increasing at %u", b);
+        }
+    }
+}
+
+static void add(Bucket_Aggregator &agg, u64 time_ns, std::vector<u64> values, std::vector<f32> confidence = {}) {
+    if (confidence.empty()) { confidence.assign(values.size(), 1.0f); }
+    agg.add_row(time_ns, values.data(), confidence.data());
+}
+
+static void test_gaps() {
+    Bucket_Aggregator       agg;
+    Monitor_Aggregate_Batch batch;
+
+    agg.reset(2, 100, false);
+
+    add(agg, 1234, { 5, 50 });      /* Bucket 12. */
+    add(agg, 1299, { 7, 70 });
+    add(agg, 1550, { 1, 10 });      /* Bucket 15 closes 12, and 13 and 14 with nothing in them. */
+
+    CHECK(agg.closed_buckets() == 3, "%zu closed buckets", agg.closed_buckets());
+    CHECK(agg.take(batch), "nothing to take");
+    CHECK(batch.first_bucket == 12 && batch.n_buckets == 3 && batch.bucket_ns == 100,
+          "first %llu, %u buckets", (unsigned long long)batch.first_bucket, batch.n_buckets);
+
+    CHECK(batch.count[batch.cell(0, 0)] == 2 && batch.sum[batch.cell(0, 0)] == 12, "bucket 12, series 0");
+    CHECK(batch.min[batch.cell(1, 0)] == 50 && batch.max[batch.cell(1, 0)] == 70, "bucket 12, series 1");
+
+    for (size_t s = 0; s < 2; s += 1) {
+        for (size_t b = 1; b < 3; b += 1) {
+            size_t c = batch.cell(s, b);
+            CHECK(batch.count[c] == 0 && batch.sum[c] == 0 && batch.min[c] == 0 && batch.max[c] == 0, "gap bucket %zu, series %zu", b, s);
+        }
+    }
+
+    CHECK(!agg.take(batch), "took again with nothing closed");
+}
+
+static void test_layout() {
+    static constexpr size_t NS = 3;
+    static constexpr size_t NB = 4;
+    static constexpr u64    W  = 1000;
+
+    Bucket_Aggregator       agg;
+    Monitor_Aggregate_Batch batch;
+
+    agg.reset(NS, W, true);
+
+    /* Bucket b gets b + 1 rows; row k of series s is s * 1000 + b * 10 + k. */
+    for (size_t b = 0; b < NB; b += 1) {
+        for (size_t k = 0; k <= b; k += 1) {
+            std::vector<u64> row;
+            for (size_t s = 0; s < NS; s += 1) { row.push_back(s * 1000 + b * 10 + k); }
+            add(agg, b * W + k, row);
+        }
+    }
+    add(agg, NB * W, std::vector<u64>(NS, 0));
+
+    CHECK(agg.take(batch), "nothing to take");
+    CHECK(batch.n_buckets == NB, "%u buckets", batch.n_buckets);
+    CHECK(batch.sum.size() == NS * NB && batch.count.size() == NS * NB, "cell count");
+    CHECK(batch.hist_offsets.size() == NS * NB + 1 && batch.hist_offsets.front() == 0, "%zu offsets", batch.hist_offsets.size());
+    CHECK(batch.hist_offsets.back() == batch.hist_bins.size() && batch.hist_bins.size() == batch.hist_counts.size(), "offsets end");
+
+    for (size_t s = 0; s < NS; s += 1) {
+        for (size_t b = 0; b < NB; b += 1) {
+            size_t c    = s * NB + b;
+            u64    base = s * 1000 + b * 10;
+            u64    sum  = 0;
+
+            for (size_t k = 0; k <= b; k += 1) { sum += base + k; }
+
+            CHECK(batch.count[c] == b + 1, "count of (%zu, %zu) is %u", s, b, batch.count[c]);
+            CHECK(batch.sum[c] == sum, "sum of (%zu, %zu)", s, b);
+            CHECK(batch.min[c] == base && batch.max[c] == base + b, "min/max of (%zu, %zu)", s, b);
+
+            /* The histogram holds exactly this cell's values, in ascending bins. */
+            std::vector<u32> want(500, 0);
+            for (size_t k = 0; k <= b; k += 1) { want[Log_Linear_Histogram::bin(base + k)] += 1; }
+
+            std::vector<u32> got(500, 0);
+            for (u32 i = batch.hist_offsets[c]; i < batch.hist_offsets[c + 1]; i += 1) {
+                CHECK(i == batch.hist_offsets[c] || batch.hist_bins[i - 1] < batch.hist_bins[i], "bins of (%zu, %zu) not ascending", s, b);
+                got[batch.hist_bins[i]] += batch.hist_counts[i];
+            }
+
+            CHECK(got == want, "histogram of (%zu, %zu)", s, b);
+        }
+    }
+}
+
+static void test_unmeasured() {
+    Bucket_Aggregator       agg;
+    Monitor_Aggregate_Batch batch;
+
+    agg.reset(2, 100, true);
+
+    add(agg, 0,  { 40, 400 }, { 1.0f, 0.0f });
+    add(agg, 10, { 0,  0   }, { 0.0f, 0.0f });
+    add(agg, 20, { 60, 600 }, { 0.5f, 1.0f });
+
+    CHECK(agg.take(batch, true), "nothing to take");
+    CHECK(batch.count[batch.cell(0, 0)] == 2 && batch.min[batch.cell(0, 0)] == 40 && batch.sum[batch.cell(0, 0)] == 100, "series 0");
+    CHECK(batch.count[batch.cell(1, 0)] == 1 && batch.min[batch.cell(1, 0)] == 600, "series 1");
+    CHECK(batch.hist_offsets[1] - batch.hist_offsets[0] == 2 && batch.hist_bins[0] != 0, "series 0 histogram");
+}
+
+static void test_close_open() {
+    Bucket_Aggregator       agg;
+    Monitor_Aggregate_Batch batch;
+
+    agg.reset(1, 100, false);
+
+    CHECK(!agg.take(batch, true), "took from an empty aggregator");
+
+    add(agg, 510, { 3 });
+    add(agg, 520, { 4 });
+
+    CHECK(!agg.take(batch), "took the open bucket without close_open");
+    CHECK(agg.take(batch, true), "close_open didn't flush the open bucket");
+    CHECK(batch.first_bucket == 5 && batch.n_buckets == 1 && batch.count[0] == 2 && batch.sum[0] == 7, "partial bucket");
+
+    CHECK(!agg.take(batch, true), "flushed the same bucket twice");
+
+    /* The stream carries on from the next bucket. */
+    add(agg, 650, { 9 });
+    add(agg, 700, { 1 });
+
+    CHECK(agg.take(batch), "nothing to take after the flush");
+    CHECK(batch.first_bucket == 6 && batch.n_buckets == 1 && batch.sum[0] == 9, "first %llu", (unsigned long long)batch.first_bucket);
+}
+
+int main() {
+    test_histogram();
+    test_gaps();
+    test_layout();
+    test_unmeasured();
+    test_close_open();
+
+    return test_result("aggregate_test");
+}
@@ -0,0 +1,133 @@
+#include <string>
+#include <vector>
+#include <random>
+#include <stdexcept>
+
+#include "common.hpp"
+#include "base64_simd.hpp"
+#include "test.hpp"
+
+/*
+ * Every kernel base64_select_kernels() can pick, checked against the scalar
+ * reference in base64.hpp: the kernels on their own, the full encode/decode
+ * built on each, and the stream decoder fed in pieces.
+ */
+
+static constexpr size_t MAX_LENGTH = 400;    /* Several AVX2 blocks plus every tail. */
+static constexpr int    ROUNDS     = 4;
+
+static const char bad_chars[] = { '!', '.', '@', '[', '`', '{', '~', ' ', '\n', '\0', '\x7f', '\x80', '\xff' };
+
+static std::vector<Base64_Kernels> kernels_to_test() {
+    std::vector<Base64_Kernels> out = { { "scalar", base64_scalar_encode, base64_scalar_decode } };
+
+#ifdef BASE64_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1")) {
+        out.push_back({ "sse4.1", base64_sse_encode, base64_sse_decode });
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        out.push_back({ "avx2", base64_avx2_encode, base64_avx2_decode });
+    }
+#endif
+
+    return out;
+}
+
+static bool throws_decode(std::string_view text, const Base64_Kernels &kernels) {
+    try { base64_decode(text, kernels); } catch (std::runtime_error &) { return true; }
+    return false;
+}
+
+static bool throws_reference(std::string_view text) {
+    try { base64::from_base64(text); } catch (std::runtime_error &) { return true; }
+    return false;
+}
+
+static bool throws_stream(std::string_view text, const Base64_Kernels &kernels) {
+    Base64_Stream_Decoder dec(kernels);
+
+    dec.reset();
+    dec.feed(text.data(), text.size());
+
+    try { dec.finish(); } catch (std::runtime_error &) { return true; }
+    return false;
+}
+
+static void check_kernel_blocks(const Base64_Kernels &k, const std::string &data, const std::string &ref) {
+    std::string enc(ref.size() + 64, '?');
+    size_t      used = k.encode((const u8*)data.data(), data.size(), enc.data());
+
+    CHECK(used % 3 == 0 && used <= data.size(), "%s encode consumed %zu of %zu", k.name, used, data.size());
+    CHECK(enc.compare(0, used / 3 * 4, ref, 0, used / 3 * 4) == 0, "%s encode differs, length %zu", k.name, data.size());
+
+    /* Only the groups before the last may be handed to a kernel; the last may be padded. */
+    size_t      n_plain = ref.empty() ? 0 : ref.size() - 4;
+    std::string dec(data.size() + 64, '?');
+    size_t      done = k.decode(ref.data(), n_plain, (u8*)dec.data());
+
+    CHECK(done % 4 == 0 && done <= n_plain, "%s decode consumed %zu of %zu", k.name, done, n_plain);
+    CHECK(dec.compare(0, done / 4 * 3, data, 0, done / 4 * 3) == 0, "%s decode differs, length %zu", k.name, data.size());
+}
+
+static void check_round_trip(const Base64_Kernels &k, const std::string &data, const std::string &ref, std::mt19937 &rng) {
+    CHECK(base64_encode(data, k) == ref, "%s base64_encode, length %zu", k.name, data.size());
+    CHECK(base64_decode(ref, k) == data, "%s base64_decode, length %zu", k.name, data.size());
+
+    /* The stream decoder in random pieces, including empty ones. */
+    Base64_Stream_Decoder dec(k);
+    size_t                at = 0;
+
+    dec.reset();
+    while (at < ref.size()) {
+        size_t piece = std::min(ref.size() - at, (size_t)(rng() % 40));
+        dec.feed(ref.data() + at, piece);
+        at += piece;
+    }
+
+    std::string streamed;
+    try {
+        streamed = dec.finish();
+    } catch (std::runtime_error &e) {
+        CHECK(false, "%s stream decoder threw '%s', length %zu", k.name, e.what(), data.size());
+    }
+    CHECK(streamed == data, "%s stream decoder, length %zu", k.name, data.size());
+}
+
+static void check_rejects(const Base64_Kernels &k, const std::string &ref, std::mt19937 &rng) {
+    if (ref.empty()) { return; }
+
+    for (int r = 0; r < 8; r += 1) {
+        std::string bad = ref;
+        size_t      pos = rng() % bad.size();
+
+        bad[pos] = bad_chars[rng() % sizeof(bad_chars)];
+
+        CHECK(throws_reference(bad), "reference accepted '%c' at %zu", bad[pos], pos);
+        CHECK(throws_decode(bad, k), "%s base64_decode accepted 0x%02x at %zu of %zu", k.name, (u8)bad[pos], pos, bad.size());
+        CHECK(throws_stream(bad, k), "%s stream decoder accepted 0x%02x at %zu of %zu", k.name, (u8)bad[pos], pos, bad.size());
+    }
+}
+
+int main() {
+    std::mt19937 rng(12345);
+
+    for (auto &k : kernels_to_test()) {
+        printf("kernel %s\n", k.name);
+
+        for (size_t n = 0; n <= MAX_LENGTH; n += 1) {
+            for (int round = 0; round < ROUNDS; round += 1) {
+                std::string data(n, 0);
+                for (char &c : data) { c = (char)rng(); }
+
+                std::string ref = base64::to_base64(data);
+
+                check_kernel_blocks(k, data, ref);
+                check_round_trip(k, data, ref, rng);
+                check_rejects(k, ref, rng);
+            }
+        }
+    }
+
+    return test_result("base64_test");
+}
@@ -0,0 +1,35 @@
+#!/usr/bin/env bash
+
+DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" >/dev/null 2>&1 && pwd )"
+
+cd ${DIR}/..
+
+TESTS=""
+TESTS+=" base64_test"
+TESTS+=" link_stream_test"
+TESTS+=" aggregate_test"
+TESTS+=" topo_test"
+
+# Built but not run; see the comment at the top of each.
+BENCHES=""
+BENCHES+=" inbox_bench"
+
+CPP_FLAGS="--std=c++20 -Wall -Werror -O2 -Ishared -Itests"
+LD_FLAGS=""
+
+# Exercise the link codecs too when server/build.sh has fetched them.
+if [ -f server/lz4/lib/liblz4.a ] && [ -f server/zstd/lib/libzstd.a ]; then
+    CPP_FLAGS+=" -Iserver/lz4/lib -Iserver/zstd/lib"
+    LD_FLAGS+=" server/lz4/lib/liblz4.a server/zstd/lib/libzstd.a"
+fi
+
+mkdir -p build/tests
+
+for T in ${TESTS}; do
+    g++ -o build/tests/${T} tests/${T}.cpp ${CPP_FLAGS} ${LD_FLAGS} || exit $?
+    build/tests/${T} || exit $?
+done
+
+for B in ${BENCHES}; do
+    g++ -o build/tests/${B} tests/${B}.cpp ${CPP_FLAGS} ${LD_FLAGS} || exit $?
+done
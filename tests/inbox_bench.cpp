@@ -0,0 +1,125 @@
+#include <string>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <optional>
+#include <chrono>
+
+#include "common.hpp"
+#include "ssh_link_inbox.hpp"
+
+/*
+ * SSH_Link_Inbox against the mutex/condvar queue it replaced, one producer
+ * thread and one consumer thread, for small (control-sized) and large
+ * (bulk-sized) messages. Not a test: build/tests/inbox_bench is built by
+ * tests/build.sh and run by hand.
+ */
+
+/* The previous SSH_Link_Inbox, as it was. */
+struct Mutex_Inbox {
+
+private:
+    std::queue<std::string> q;
+    std::mutex              mtx;
+    std::condition_variable cv;
+
+public:
+    void push(const std::string &&msg) {
+        std::lock_guard<std::mutex> lock(mtx);
+        q.push(std::move(msg));
+        cv.notify_one();
+    }
+
+    std::optional<std::string> try_pop(void) {
+        std::lock_guard<std::mutex> lock(mtx);
+
+        if (q.empty()) return {};
+
+        auto msg = std::move(q.front());
+        q.pop();
+
+        return msg;
+    }
+
+    std::string wait_and_pop(void) {
+        std::unique_lock<std::mutex> lock(mtx);
+
+        cv.wait(lock, [this]{ return !q.empty(); });
+        auto msg = q.front();
+        q.pop();
+
+        return msg;
+    }
+};
+
+static constexpr size_t SMALL = 64;
+static constexpr size_t LARGE = 64 * 1024;
+
+template<typename Produce, typename Consume>
+static void run(const char *name, size_t msg_size, size_t n_msgs, Produce &&produce, Consume &&consume) {
+    std::string payload(msg_size, 'x');
+    size_t      bytes = 0;
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::thread producer([&] {
+        for (size_t i = 0; i < n_msgs; i += 1) { produce(std::string(payload)); }
+    });
+
+    for (size_t i = 0; i < n_msgs; i += 1) { bytes += consume().size(); }
+
+    producer.join();
+
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("%-28s %6zu B  %10.0f msg/s  %9.1f MB/s\n", name, msg_size, n_msgs / secs, bytes / secs / 1e6);
+}
+
+static void bench(size_t msg_size, size_t n_msgs) {
+    {
+        Mutex_Inbox inbox;
+        run("mutex push/wait_and_pop", msg_size, n_msgs,
+            [&](std::string &&m) { inbox.push(std::move(m)); },
+            [&]                  { return inbox.wait_and_pop(); });
+    }
+    {
+        Mutex_Inbox inbox;
+        run("mutex push/try_pop", msg_size, n_msgs,
+            [&](std::string &&m) { inbox.push(std::move(m)); },
+            [&] {
+                for (;;) {
+                    if (auto m = inbox.try_pop()) { return std::move(*m); }
+                    std::this_thread::yield();
+                }
+            });
+    }
+    {
+        SSH_Link_Inbox inbox;
+        run("ring push/wait_and_pop", msg_size, n_msgs,
+            [&](std::string &&m) { inbox.push(std::move(m)); },
+            [&]                  { return inbox.wait_and_pop(); });
+    }
+    {
+        SSH_Link_Inbox inbox;
+        run("ring try_push/try_pop", msg_size, n_msgs,
+            [&](std::string &&m) {
+                while (!inbox.try_push(m)) { std::this_thread::yield(); }
+            },
+            [&] {
+                for (;;) {
+                    if (auto m = inbox.try_pop()) { return std::move(*m); }
+                    std::this_thread::yield();
+                }
+            });
+    }
+}
+
+int main() {
+    printf("%u hardware threads\n", std::thread::hardware_concurrency());
+
+    bench(SMALL, 2000000);
+    bench(LARGE, 10000);
+
+    return 0;
+}
@@ -0,0 +1,164 @@
+#include <string>
+#include <vector>
+#include <random>
+
+#include "common.hpp"
+#include "link_protocol.hpp"
+#include "test.hpp"
+
+/*
+ * Link_Stream_Parser against a stream of OSC messages, binary control frames
+ * and bulk messages cut into fragments (with control messages between the
+ * fragments), separated by junk that starts with ESC or half a delimiter.
+ * The same bytes are fed in pieces of every size from 1 to MAX_PIECE and in
+ * random pieces; every feeding has to deliver the same messages, in order,
+ * on the right channels.
+ */
+
+static constexpr int MAX_PIECE = 17;
+
+static const char *junk[] = {
+    "",
+    "plain text\r\n",
+    "\033",
+    "\033[0m",
+    "\033]9997;not for us\x07",
+    "\033]999",
+    "\033]9998",
+    "\033O",
+    "\033OL",
+    "\033OLx",
+    "\033\033\033",
+    "\x07\x07",
+};
+
+struct Expected {
+    std::string  payload;
+    Link_Channel channel;
+};
+
+struct Stream {
+    std::string           bytes;
+    std::vector<Expected> messages;
+};
+
+static std::string random_payload(std::mt19937 &rng, size_t max) {
+    std::string out(rng() % (max + 1), 0);
+
+    /* Bias towards the bytes that mean something to the parser. */
+    for (char &c : out) {
+        switch (rng() % 8) {
+            case 0:  c = '\033'; break;
+            case 1:  c = '\x07'; break;
+            case 2:  c = "OLK]9;"[rng() % 6]; break;
+            default: c = (char)rng();
+        }
+    }
+
+    return out;
+}
+
+static void add_control(Stream &s, std::mt19937 &rng, u32 caps) {
+    std::string msg = random_payload(rng, 300);
+
+    /* Something that compresses, so that negotiated codecs actually get used. */
+    if (rng() % 4 == 0) {
+        for (int i = 0, n = rng() % 2000; i < n; i += 1) { msg += msg.empty() ? 'x' : msg[i % msg.size()]; }
+    }
+
+    s.messages.push_back({ msg, Link_Channel::CONTROL });
+
+    /* OSC framing, or binary, possibly compressed. */
+    u32 c = rng() % 2 ? caps : (caps & ~LINK_CAP_BINARY_FRAMING);
+    link_encode(s.bytes, c, std::move(msg), LINK_OSC_TO_CLIENT, "\x07");
+}
+
+static void add_junk(Stream &s, std::mt19937 &rng) {
+    s.bytes += junk[rng() % std::size(junk)];
+}
+
+static void add_bulk(Stream &s, std::mt19937 &rng) {
+    std::string msg = random_payload(rng, 5000);
+    size_t      at  = 0;
+
+    do {
+        size_t len  = std::min(msg.size() - at, (size_t)(rng() % 1500));
+        bool   more = at + len < msg.size() || (len != 0 && rng() % 4 == 0);
+
+        link_put_frame_header(s.bytes, len, Link_Codec::NONE, LINK_FRAME_BULK | (more ? LINK_FRAME_MORE : 0));
+        s.bytes.append(msg, at, len);
+        at += len;
+
+        if (!more) { break; }
+
+        /* Control traffic may be slipped in between fragments. */
+        if (rng() % 2) {
+            add_junk(s, rng);
+            add_control(s, rng, LINK_CAP_BINARY_FRAMING);
+        }
+    } while (true);
+
+    s.messages.push_back({ msg, Link_Channel::BULK });
+}
+
+static Stream make_stream(std::mt19937 &rng, u32 caps) {
+    Stream s;
+
+    for (int i = 0; i < 60; i += 1) {
+        add_junk(s, rng);
+
+        if (rng() % 4 == 0) {
+            add_bulk(s, rng);
+        } else {
+            add_control(s, rng, caps);
+        }
+    }
+
+    add_junk(s, rng);
+
+    return s;
+}
+
+template<typename Piece>
+static void check_feeding(const Stream &s, const char *what, Piece &&piece) {
+    Link_Stream_Parser    parser(LINK_OSC_TO_CLIENT);
+    std::vector<Expected> got;
+    size_t                at = 0;
+
+    while (at < s.bytes.size()) {
+        size_t n = std::min(s.bytes.size() - at, piece());
+
+        parser.feed(s.bytes.data() + at, n, [&got](std::string &&msg, Link_Channel channel) {
+            got.push_back({ std::move(msg), channel });
+        });
+
+        at += n;
+    }
+
+    CHECK(got.size() == s.messages.size(), "%s: got %zu messages, expected %zu", what, got.size(), s.messages.size());
+
+    for (size_t i = 0; i < std::min(got.size(), s.messages.size()); i += 1) {
+        CHECK(got[i].channel == s.messages[i].channel, "%s: message %zu on the wrong channel", what, i);
+        CHECK(got[i].payload == s.messages[i].payload, "%s: message %zu differs (%zu vs %zu bytes)",
+              what, i, got[i].payload.size(), s.messages[i].payload.size());
+    }
+}
+
+int main() {
+    std::mt19937 rng(4242);
+    u32          caps = link_supported_capabilities();
+
+    for (int round = 0; round < 8; round += 1) {
+        Stream s = make_stream(rng, caps);
+
+        for (int k = 1; k <= MAX_PIECE; k += 1) {
+            std::string what = "pieces of " + std::to_string(k);
+            check_feeding(s, what.c_str(), [k] { return (size_t)k; });
+        }
+
+        check_feeding(s, "random pieces", [&rng] { return (size_t)(rng() % 64); });
+        check_feeding(s, "one piece",     [&s]   { return s.bytes.size(); });
+    }
+
+    return test_result("link_stream_test");
+}
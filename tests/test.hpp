@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstdio>
+
+namespace {
+
+/* Every failed CHECK is reported and counted; main() returns test_result(). */
+static int test_failures = 0;
+
+#define CHECK(cond, ...)                                                         \
+    do {                                                                         \
+        if (!(cond)) {                                                           \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed: ", __FILE__, __LINE__, #cond); \
+            fprintf(stderr, __VA_ARGS__);                                        \
+            fprintf(stderr, "\n");                                               \
+            test_failures += 1;                                                  \
+        }                                                                        \
+    } while (0)
+
+inline int test_result(const char *name) {
+    if (test_failures) {
+        fprintf(stderr, "%s: %d failure(s)\n", name, test_failures);
+        return 1;
+    }
+
+    printf("%s: ok\n", name);
+    return 0;
+}
+
+}
@@ -0,0 +1,205 @@
+#include <string>
+#include <vector>
+#include <random>
+#include <functional>
+
+#include "common.hpp"
+#include "topo.hpp"
+#include "test.hpp"
+
+/*
+ * Flat_Topology against the Topology_Node tree it was built from: the
+ * breadth-first layout and child ranges, CPU numbers that are sparse or
+ * missing, rows_for() with CPUs the topology doesn't have, and roll_up()
+ * against a plain recursive sum.
+ */
+
+/* Sockets, shared caches, cores (some behind a private cache) and threads; CPU numbers sparse, some missing. */
+static Topology_Node make_topology(std::mt19937 &rng) {
+    Topology_Node root("Machine");
+    int           next_cpu = 0;
+
+    root.type = Resource_Type::ROOT;
+
+    for (int s = 0, n_sockets = 1 + rng() % 3; s < n_sockets; s += 1) {
+        Topology_Node &socket = root.get_subnode("Package#" + std::to_string(s), Resource_Type::SOCKET);
+
+        for (int c = 0, n_caches = rng() % 3; c < n_caches; c += 1) {
+            Topology_Node &cache = socket.get_subnode("L3#" + std::to_string(c), Resource_Type::SHARED_CACHE);
+
+            for (int k = 0, n_cores = rng() % 4; k < n_cores; k += 1) {
+                Topology_Node *parent = &cache;
+
+                if (rng() % 2) {
+                    parent = &cache.get_subnode("L2", Resource_Type::PRIVATE_CACHE);    /* Repeated names. */
+                }
+
+                Topology_Node &core = parent->get_subnode("Core#" + std::to_string(k), Resource_Type::CPU_CORE);
+
+                for (int t = 0, n_threads = 1 + rng() % 2; t < n_threads; t += 1) {
+                    Topology_Node &thread = core.get_subnode("PU#" + std::to_string(t), Resource_Type::CPU_THREAD);
+
+                    next_cpu        += 1 + (rng() % 4 == 0 ? rng() % 20 : 0);
+                    thread.os_index  = rng() % 10 == 0 ? -1 : next_cpu;
+                }
+            }
+        }
+    }
+
+    return root;
+}
+
+static void check_layout(const Topology_Node &root, const Flat_Topology &flat) {
+    /* The reference breadth-first order, with each node's depth. */
+    std::vector<const Topology_Node*> order = { &root };
+    std::vector<int>                  depth = { 0 };
+
+    for (size_t i = 0; i < order.size(); i += 1) {
+        for (auto &pair : order[i]->subnodes) {
+            order.push_back(&pair.second);
+            depth.push_back(depth[i] + 1);
+        }
+    }
+
+    CHECK(flat.size() == order.size(), "%zu nodes, expected %zu", flat.size(), order.size());
+    if (flat.size() != order.size()) { return; }
+
+    CHECK(flat.parent[0] == 0, "the root's parent is %u", flat.parent[0]);
+
+    u32 expected_child = 1;
+
+    for (size_t i = 0; i < flat.size(); i += 1) {
+        CHECK(flat.name(i) == order[i]->name, "node %zu is %s, expected %s", i, flat.name(i).c_str(), order[i]->name.c_str());
+        CHECK(flat.type[i] == order[i]->type && flat.os_index[i] == order[i]->os_index, "node %zu type/os_index", i);
+        CHECK(i == 0 || flat.parent[i] < i, "node %zu comes before its parent", i);
+        CHECK(i == 0 || depth[i] >= depth[i - 1], "node %zu is out of breadth-first order", i);
+
+        /* Children ranges are consecutive and cover every non-root node once. */
+        CHECK(flat.n_children[i] == order[i]->subnodes.size(), "node %zu has %u children", i, flat.n_children[i]);
+        CHECK(flat.n_children[i] == 0 || flat.first_child[i] == expected_child, "node %zu's children start at %u", i, flat.first_child[i]);
+
+        for (u32 c = flat.first_child[i]; c < flat.first_child[i] + flat.n_children[i]; c += 1) {
+            CHECK(c < flat.size() && flat.parent[c] == i, "child %u of %zu", c, i);
+        }
+
+        expected_child += flat.n_children[i];
+
+        std::function<u32(const Topology_Node&)> threads = [&](const Topology_Node &n) {
+            u32 count = n.type == Resource_Type::CPU_THREAD;
+            for (auto &pair : n.subnodes) { count += threads(pair.second); }
+            return count;
+        };
+
+        CHECK(flat.n_threads[i] == threads(*order[i]), "node %zu has %u threads", i, flat.n_threads[i]);
+    }
+
+    CHECK(expected_child == flat.size(), "children ranges cover %u nodes", expected_child);
+}
+
+static void check_cpus(const Flat_Topology &flat) {
+    std::vector<int> present;
+
+    for (size_t i = 0; i < flat.size(); i += 1) {
+        if (flat.type[i] == Resource_Type::CPU_THREAD && flat.os_index[i] >= 0) {
+            present.push_back(flat.os_index[i]);
+            CHECK(flat.node_of_cpu(flat.os_index[i]) == (s32)i, "cpu %d maps to %d, expected %zu", flat.os_index[i], flat.node_of_cpu(flat.os_index[i]), i);
+        }
+    }
+
+    std::sort(present.begin(), present.end());
+    CHECK(flat.cpus() == present, "cpus() lists %zu CPUs, expected %zu", flat.cpus().size(), present.size());
+
+    for (int cpu = -5; cpu < (int)flat.cpu_node.size() + 5; cpu += 1) {
+        if (!std::binary_search(present.begin(), present.end(), cpu)) {
+            CHECK(flat.node_of_cpu(cpu) == -1, "cpu %d isn't in the topology but maps to %d", cpu, flat.node_of_cpu(cpu));
+        }
+    }
+}
+
+/* Sum of the input rows of the CPU threads at or below node, the slow way. */
+static u64 naive_sum(const Topology_Node &node, const std::vector<s32> &cpus, const std::vector<u64> &in, size_t n_cols, size_t col) {
+    u64 sum = 0;
+
+    if (node.type == Resource_Type::CPU_THREAD && node.os_index >= 0) {
+        for (size_t t = 0; t < cpus.size(); t += 1) {
+            if (cpus[t] == node.os_index) { sum += in[t * n_cols + col]; }
+        }
+    }
+
+    for (auto &pair : node.subnodes) {
+        sum += naive_sum(pair.second, cpus, in, n_cols, col);
+    }
+
+    return sum;
+}
+
+static void check_roll_up(const Topology_Node &root, const Flat_Topology &flat, std::mt19937 &rng) {
+    static constexpr size_t N_COLS = 3;
+
+    /* Monitored CPUs: most of the topology's in shuffled order, plus some it doesn't have. */
+    std::vector<s32> cpus;
+
+    for (int cpu : flat.cpus()) {
+        if (rng() % 5) { cpus.push_back(cpu); }
+    }
+    cpus.push_back(-1);
+    cpus.push_back(flat.cpu_node.size() + 7);
+    std::shuffle(cpus.begin(), cpus.end(), rng);
+
+    std::vector<s32> rows = flat.rows_for(cpus);
+
+    for (size_t i = 0; i < flat.size(); i += 1) {
+        if (rows[i] < 0) {
+            bool monitored = flat.type[i] == Resource_Type::CPU_THREAD && flat.os_index[i] >= 0
+                          && std::find(cpus.begin(), cpus.end(), flat.os_index[i]) != cpus.end();
+            CHECK(!monitored, "node %zu (cpu %d) has no row", i, flat.os_index[i]);
+        } else {
+            CHECK(flat.type[i] == Resource_Type::CPU_THREAD && cpus[rows[i]] == flat.os_index[i], "node %zu maps to row %d", i, rows[i]);
+        }
+    }
+
+    std::vector<u64> in(cpus.size() * N_COLS);
+    for (u64 &v : in) { v = rng() % 1000; }
+
+    std::vector<u64> out;
+    flat.roll_up(in.data(), N_COLS, rows, out);
+
+    /* The same order as flat, so node i is order[i]. */
+    std::vector<const Topology_Node*> order = { &root };
+    for (size_t i = 0; i < order.size(); i += 1) {
+        for (auto &pair : order[i]->subnodes) { order.push_back(&pair.second); }
+    }
+
+    for (size_t i = 0; i < flat.size(); i += 1) {
+        for (size_t c = 0; c < N_COLS; c += 1) {
+            u64 want = naive_sum(*order[i], cpus, in, N_COLS, c);
+            CHECK(out[i * N_COLS + c] == want, "node %zu (%s) column %zu: %llu, expected %llu", i, flat.name(i).c_str(), c,
+                  (unsigned long long)out[i * N_COLS + c], (unsigned long long)want);
+        }
+    }
+}
+
+int main() {
+    std::mt19937 rng(99);
+
+    for (int round = 0; round < 200; round += 1) {
+        Topology_Node root = make_topology(rng);
+        Flat_Topology flat;
+
+        flat.build(root);
+
+        check_layout(root, flat);
+        check_cpus(flat);
+        check_roll_up(root, flat, rng);
+    }
+
+    /* A lone root. */
+    Topology_Node root("Machine");
+    Flat_Topology flat;
+
+    flat.build(root);
+    CHECK(flat.size() == 1 && flat.first_child[0] == 1 && flat.n_children[0] == 0 && flat.cpus().empty(), "lone root");
+    CHECK(flat.rows_for({ 0, 1 }) == std::vector<s32>(1, -1), "lone root rows");
+
+    return test_result("topo_test");
+}